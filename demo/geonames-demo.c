@@ -30,12 +30,13 @@ query_cities_cb (GObject       *source_object,
   guint len;
   gint i;
 
-  gtk_container_foreach (GTK_CONTAINER (listbox), (GtkCallback) gtk_widget_destroy, NULL);
-
+  /* superseded queries return NULL */
   indices = geonames_query_cities_finish (result, &len, NULL);
   if (indices == NULL)
     return;
 
+  gtk_container_foreach (GTK_CONTAINER (listbox), (GtkCallback) gtk_widget_destroy, NULL);
+
   for (i = 0; i < len; i++)
     {
       g_autoptr(GeonamesCity) city;
@@ -58,13 +59,21 @@ entry_changed (GtkEditable *editable,
                gpointer     user_data)
 {
   GtkWidget *listbox = user_data;
+  GeonamesQuerySession *session;
   const gchar *text;
 
+  session = g_object_get_data (G_OBJECT (listbox), "query-session");
+
   text = gtk_entry_get_text (GTK_ENTRY (editable));
   if (strlen (text) >= 2)
-    geonames_query_cities (text, GEONAMES_QUERY_DEFAULT, NULL, query_cities_cb, listbox);
+    {
+      geonames_query_session_query_cities (session, text, GEONAMES_QUERY_DEFAULT, 0, query_cities_cb, listbox);
+    }
   else
-    gtk_container_foreach (GTK_CONTAINER (listbox), (GtkCallback) gtk_widget_destroy, NULL);
+    {
+      geonames_query_session_cancel (session);
+      gtk_container_foreach (GTK_CONTAINER (listbox), (GtkCallback) gtk_widget_destroy, NULL);
+    }
 }
 
 int
@@ -84,6 +93,8 @@ main (int argc, char **argv)
   g_signal_connect (window, "destroy", G_CALLBACK (gtk_main_quit), NULL);
 
   listbox = gtk_list_box_new ();
+  g_object_set_data_full (G_OBJECT (listbox), "query-session",
+                          geonames_query_session_new (), (GDestroyNotify) geonames_query_session_free);
   scrolled_window = gtk_scrolled_window_new (NULL, NULL);
   gtk_container_add (GTK_CONTAINER (scrolled_window), listbox);
 
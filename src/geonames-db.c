@@ -0,0 +1,1126 @@
+/*
+ * Copyright 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "geonames-db.h"
+#include <stdlib.h>
+#include <string.h>
+
+static gboolean
+lookup_fixed_array (GVariant       *data,
+                    const gchar    *key,
+                    const gchar    *type,
+                    gsize           element_size,
+                    gconstpointer  *array,
+                    gsize          *n_elements,
+                    GError        **error)
+{
+  g_autoptr(GVariant) v = NULL;
+
+  v = g_variant_lookup_value (data, key, G_VARIANT_TYPE (type));
+  if (v == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "database does not contain '%s' of type '%s'", key, type);
+      return FALSE;
+    }
+
+  /* the returned pointer points into data, which outlives v */
+  *array = g_variant_get_fixed_array (v, n_elements, element_size);
+
+  return TRUE;
+}
+
+static gboolean
+lookup_translations (GVariant                *data,
+                     const gchar             *offsets_key,
+                     const gchar             *keys_key,
+                     const gchar             *values_key,
+                     const gchar             *sources_key,
+                     gsize                    n_languages,
+                     gsize                    n_keys,
+                     gsize                    max_value,
+                     GeonamesDbTranslations  *translations,
+                     GError                 **error)
+{
+  gsize n_offsets;
+  gsize n_values;
+  gsize n_sources;
+  gsize i, j;
+
+  if (!lookup_fixed_array (data, offsets_key, "au", sizeof (guint32),
+                           (gconstpointer *) &translations->offsets, &n_offsets, error) ||
+      !lookup_fixed_array (data, keys_key, "au", sizeof (guint32),
+                           (gconstpointer *) &translations->keys, &translations->n_entries, error) ||
+      !lookup_fixed_array (data, values_key, "au", sizeof (guint32),
+                           (gconstpointer *) &translations->values, &n_values, error) ||
+      !lookup_fixed_array (data, sources_key, "au", sizeof (guint32),
+                           (gconstpointer *) &translations->sources, &n_sources, error))
+    return FALSE;
+
+  if (n_offsets != n_languages + 1 ||
+      translations->offsets[n_languages] != translations->n_entries ||
+      n_values != translations->n_entries ||
+      n_sources != translations->n_entries)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "database contains invalid '%s'", offsets_key);
+      return FALSE;
+    }
+
+  /* lookup_translation() does a binary search in the keys of a language */
+  for (i = 0; i < n_languages; i++)
+    {
+      if (translations->offsets[i] > translations->offsets[i + 1])
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "database contains invalid '%s'", offsets_key);
+          return FALSE;
+        }
+
+      for (j = translations->offsets[i]; j < translations->offsets[i + 1]; j++)
+        {
+          if (translations->keys[j] >= n_keys ||
+              (j > translations->offsets[i] && translations->keys[j] <= translations->keys[j - 1]) ||
+              translations->values[j] >= max_value)
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "database contains invalid '%s'", keys_key);
+              return FALSE;
+            }
+        }
+    }
+
+  return TRUE;
+}
+
+/*
+ * Returns whether all elements of array are below limit. If optional is
+ * TRUE, elements may also be GEONAMES_DB_NO_TRANSLATION or
+ * GEONAMES_DB_NO_TOKEN, which are both G_MAXUINT32.
+ */
+static gboolean
+check_indices (const guint32 *array,
+               gsize          n_elements,
+               gsize          limit,
+               gboolean       optional)
+{
+  gsize i;
+
+  for (i = 0; i < n_elements; i++)
+    if (array[i] >= limit && !(optional && array[i] == G_MAXUINT32))
+      return FALSE;
+
+  return TRUE;
+}
+
+static gboolean
+check_short_indices (const guint16 *array,
+                     gsize          n_elements,
+                     gsize          limit)
+{
+  gsize i;
+
+  for (i = 0; i < n_elements; i++)
+    if (array[i] >= limit)
+      return FALSE;
+
+  return TRUE;
+}
+
+/* Returns whether n_elements offsets don't decrease */
+static gboolean
+check_offsets (const guint32 *offsets,
+               gsize          n_elements)
+{
+  gsize i;
+
+  for (i = 1; i < n_elements; i++)
+    if (offsets[i] < offsets[i - 1])
+      return FALSE;
+
+  return TRUE;
+}
+
+/* A translation comes from an alternate name, or from no alternate name
+ * at all, but never from one with id 0 that is preferred.
+ */
+static gboolean
+check_sources (const GeonamesDbTranslations *translations)
+{
+  gsize i;
+
+  for (i = 0; i < translations->n_entries; i++)
+    if (translations->sources[i] == GEONAMES_DB_SOURCE_PREFERRED)
+      return FALSE;
+
+  return TRUE;
+}
+
+/*
+ * Checks that every index and offset in the database is in the range
+ * of the table it refers to, so that corrupt or truncated databases are
+ * rejected when they are loaded instead of making lookups read out of
+ * bounds. Strings are known to be nul-terminated at this point.
+ */
+static gboolean
+check_references (GeonamesDb  *db,
+                  GError     **error)
+{
+  const gchar *what = NULL;
+
+  if (!check_indices (db->city_ids, db->n_cities, db->strings_size, FALSE) ||
+      !check_indices (db->city_feature_codes, db->n_cities, db->strings_size, FALSE) ||
+      !check_indices (db->city_file_names, db->n_cities, db->strings_size, TRUE) ||
+      !check_indices (db->states, db->n_states, db->strings_size, FALSE) ||
+      !check_indices (db->state_ids, db->n_states, db->strings_size, FALSE) ||
+      !check_indices (db->state_names, db->n_states, db->strings_size, FALSE) ||
+      !check_indices (db->state_file_names, db->n_states, db->strings_size, TRUE) ||
+      !check_indices (db->countries, db->n_countries, db->strings_size, FALSE) ||
+      !check_indices (db->country_ids, db->n_countries, db->strings_size, FALSE) ||
+      !check_indices (db->country_names, db->n_countries, db->strings_size, FALSE) ||
+      !check_indices (db->country_file_names, db->n_countries, db->strings_size, TRUE) ||
+      !check_indices (db->timezones, db->n_timezones, db->strings_size, FALSE))
+    what = "string offsets";
+  else if (!check_short_indices (db->city_states, db->n_cities, db->n_states) ||
+           !check_short_indices (db->city_countries, db->n_cities, db->n_countries) ||
+           !check_short_indices (db->city_timezones, db->n_cities, db->n_timezones))
+    what = "state, country or timezone references";
+  else if (!check_indices (db->token_offsets, db->n_tokens, db->tokens_size, FALSE) ||
+           !check_offsets (db->posting_offsets, db->n_tokens + 1) ||
+           !check_indices (db->postings, db->n_postings, db->n_cities, FALSE))
+    what = "token index";
+  else if (!check_indices (db->name_offsets, db->n_names, db->names_size, FALSE) ||
+           !check_offsets (db->name_token_offsets, db->n_names + 1) ||
+           !check_indices (db->name_tokens, db->n_name_tokens, db->n_tokens, FALSE) ||
+           !check_indices (db->name_ascii_tokens, db->n_name_tokens, db->n_tokens, TRUE) ||
+           !check_indices (db->city_names, db->n_cities, db->n_names, FALSE))
+    what = "name table";
+  else if (!check_offsets (db->trigram_offsets, db->n_trigrams + 1) ||
+           !check_indices (db->trigram_tokens, db->n_trigram_tokens, db->n_tokens, FALSE))
+    what = "trigram index";
+  else if (!check_indices (db->spatial_rows, db->n_cities, db->n_cities, FALSE) ||
+           !check_offsets (db->grid_offsets, GEONAMES_DB_GRID_CELLS + 1) ||
+           !check_indices (db->grid_rows, db->n_cities, db->n_cities, FALSE))
+    what = "spatial index";
+  else if (!check_indices (db->language_offsets, db->n_languages, db->languages_size, FALSE) ||
+           !check_sources (&db->city_translations) ||
+           !check_sources (&db->state_translations) ||
+           !check_sources (&db->country_translations))
+    what = "translations";
+
+  if (what)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "database contains invalid %s", what);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+geonames_db_locale_free (gpointer data)
+{
+  GeonamesDbLocale *locale = data;
+
+  g_free (locale->languages);
+  g_free (locale);
+}
+
+/*
+ * Creates a new #GeonamesDb from @bytes, which must contain a database
+ * in the format written by geonames-mkdb. Strings and arrays returned
+ * from the database point directly into @bytes.
+ */
+GeonamesDb *
+geonames_db_new (GBytes  *bytes,
+                 GError **error)
+{
+  g_autoptr(GVariant) data = NULL;
+  GeonamesDb *db;
+  guint32 version;
+  gsize n_token_offsets;
+  gsize n_posting_offsets;
+  gsize n_name_token_offsets;
+  gsize n_name_ascii_tokens;
+  gsize n_name_token_prefixes;
+  gsize n_name_ascii_token_prefixes;
+  gsize n_trigram_offsets;
+  gsize n_city_states;
+  gsize n_city_countries;
+  gsize n_city_timezones;
+  gsize n_city_populations;
+  gsize n_city_latitudes;
+  gsize n_city_longitudes;
+  gsize n_city_feature_codes;
+  gsize n_city_names;
+  gsize n_city_file_names;
+  gsize n_state_ids;
+  gsize n_state_names;
+  gsize n_state_file_names;
+  gsize n_country_ids;
+  gsize n_country_names;
+  gsize n_country_file_names;
+  gsize n_spatial_rows;
+  gsize n_spatial_points;
+  gsize n_grid_offsets;
+  gsize n_grid_rows;
+  gsize n_tier_offsets;
+  gsize n_tier_min_populations;
+  guint i;
+
+  g_return_val_if_fail (bytes != NULL, NULL);
+
+  data = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE_VARDICT, bytes, TRUE));
+
+  if (!g_variant_lookup (data, GEONAMES_DB_KEY_VERSION, "u", &version) ||
+      version != GEONAMES_DB_VERSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "unsupported database version (expected %u)", GEONAMES_DB_VERSION);
+      return NULL;
+    }
+
+  db = g_new0 (GeonamesDb, 1);
+  db->data = g_steal_pointer (&data);
+  g_mutex_init (&db->locales_lock);
+  db->locales = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, geonames_db_locale_free);
+
+  if (!g_variant_lookup (db->data, GEONAMES_DB_KEY_MIN_POPULATION, "u", &db->min_population))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "database does not contain '%s' of type 'u'", GEONAMES_DB_KEY_MIN_POPULATION);
+      geonames_db_free (db);
+      return NULL;
+    }
+
+  if (!lookup_fixed_array (db->data, GEONAMES_DB_KEY_STRINGS, "ay", 1,
+                           (gconstpointer *) &db->strings, &db->strings_size, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_CITY_IDS, "au", sizeof (guint32),
+                           (gconstpointer *) &db->city_ids, &db->n_cities, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_CITY_STATES, "aq", sizeof (guint16),
+                           (gconstpointer *) &db->city_states, &n_city_states, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_CITY_COUNTRIES, "aq", sizeof (guint16),
+                           (gconstpointer *) &db->city_countries, &n_city_countries, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_CITY_TIMEZONES, "aq", sizeof (guint16),
+                           (gconstpointer *) &db->city_timezones, &n_city_timezones, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_CITY_POPULATIONS, "au", sizeof (guint32),
+                           (gconstpointer *) &db->city_populations, &n_city_populations, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_CITY_LATITUDES, "ad", sizeof (gdouble),
+                           (gconstpointer *) &db->city_latitudes, &n_city_latitudes, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_CITY_LONGITUDES, "ad", sizeof (gdouble),
+                           (gconstpointer *) &db->city_longitudes, &n_city_longitudes, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_CITY_FEATURE_CODES, "au", sizeof (guint32),
+                           (gconstpointer *) &db->city_feature_codes, &n_city_feature_codes, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_TOKENS, "ay", 1,
+                           (gconstpointer *) &db->tokens, &db->tokens_size, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_TOKEN_OFFSETS, "au", sizeof (guint32),
+                           (gconstpointer *) &db->token_offsets, &n_token_offsets, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_POSTING_OFFSETS, "au", sizeof (guint32),
+                           (gconstpointer *) &db->posting_offsets, &n_posting_offsets, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_POSTINGS, "au", sizeof (guint32),
+                           (gconstpointer *) &db->postings, &db->n_postings, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_NAMES, "ay", 1,
+                           (gconstpointer *) &db->names, &db->names_size, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_NAME_OFFSETS, "au", sizeof (guint32),
+                           (gconstpointer *) &db->name_offsets, &db->n_names, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_NAME_TOKEN_OFFSETS, "au", sizeof (guint32),
+                           (gconstpointer *) &db->name_token_offsets, &n_name_token_offsets, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_NAME_TOKENS, "au", sizeof (guint32),
+                           (gconstpointer *) &db->name_tokens, &db->n_name_tokens, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_NAME_ASCII_TOKENS, "au", sizeof (guint32),
+                           (gconstpointer *) &db->name_ascii_tokens, &n_name_ascii_tokens, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_NAME_TOKEN_PREFIXES, "at", sizeof (guint64),
+                           (gconstpointer *) &db->name_token_prefixes, &n_name_token_prefixes, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_NAME_ASCII_TOKEN_PREFIXES, "at", sizeof (guint64),
+                           (gconstpointer *) &db->name_ascii_token_prefixes, &n_name_ascii_token_prefixes, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_TRIGRAMS, "at", sizeof (guint64),
+                           (gconstpointer *) &db->trigrams, &db->n_trigrams, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_TRIGRAM_OFFSETS, "au", sizeof (guint32),
+                           (gconstpointer *) &db->trigram_offsets, &n_trigram_offsets, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_TRIGRAM_TOKENS, "au", sizeof (guint32),
+                           (gconstpointer *) &db->trigram_tokens, &db->n_trigram_tokens, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_CITY_NAMES, "au", sizeof (guint32),
+                           (gconstpointer *) &db->city_names, &n_city_names, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_CITY_FILE_NAMES, "au", sizeof (guint32),
+                           (gconstpointer *) &db->city_file_names, &n_city_file_names, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_STATES, "au", sizeof (guint32),
+                           (gconstpointer *) &db->states, &db->n_states, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_STATE_IDS, "au", sizeof (guint32),
+                           (gconstpointer *) &db->state_ids, &n_state_ids, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_STATE_NAMES, "au", sizeof (guint32),
+                           (gconstpointer *) &db->state_names, &n_state_names, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_STATE_FILE_NAMES, "au", sizeof (guint32),
+                           (gconstpointer *) &db->state_file_names, &n_state_file_names, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_COUNTRIES, "au", sizeof (guint32),
+                           (gconstpointer *) &db->countries, &db->n_countries, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_COUNTRY_IDS, "au", sizeof (guint32),
+                           (gconstpointer *) &db->country_ids, &n_country_ids, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_COUNTRY_NAMES, "au", sizeof (guint32),
+                           (gconstpointer *) &db->country_names, &n_country_names, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_COUNTRY_FILE_NAMES, "au", sizeof (guint32),
+                           (gconstpointer *) &db->country_file_names, &n_country_file_names, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_TIMEZONES, "au", sizeof (guint32),
+                           (gconstpointer *) &db->timezones, &db->n_timezones, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_LANGUAGES, "ay", 1,
+                           (gconstpointer *) &db->languages, &db->languages_size, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_LANGUAGE_OFFSETS, "au", sizeof (guint32),
+                           (gconstpointer *) &db->language_offsets, &db->n_languages, error) ||
+      !lookup_translations (db->data,
+                            GEONAMES_DB_KEY_CITY_TRANSLATION_OFFSETS,
+                            GEONAMES_DB_KEY_CITY_TRANSLATION_KEYS,
+                            GEONAMES_DB_KEY_CITY_TRANSLATION_VALUES,
+                            GEONAMES_DB_KEY_CITY_TRANSLATION_SOURCES,
+                            db->n_languages, db->n_cities, db->n_names, &db->city_translations, error) ||
+      !lookup_translations (db->data,
+                            GEONAMES_DB_KEY_STATE_TRANSLATION_OFFSETS,
+                            GEONAMES_DB_KEY_STATE_TRANSLATION_KEYS,
+                            GEONAMES_DB_KEY_STATE_TRANSLATION_VALUES,
+                            GEONAMES_DB_KEY_STATE_TRANSLATION_SOURCES,
+                            db->n_languages, db->n_states, db->strings_size, &db->state_translations, error) ||
+      !lookup_translations (db->data,
+                            GEONAMES_DB_KEY_COUNTRY_TRANSLATION_OFFSETS,
+                            GEONAMES_DB_KEY_COUNTRY_TRANSLATION_KEYS,
+                            GEONAMES_DB_KEY_COUNTRY_TRANSLATION_VALUES,
+                            GEONAMES_DB_KEY_COUNTRY_TRANSLATION_SOURCES,
+                            db->n_languages, db->n_countries, db->strings_size, &db->country_translations, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_SPATIAL_ROWS, "au", sizeof (guint32),
+                           (gconstpointer *) &db->spatial_rows, &n_spatial_rows, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_SPATIAL_POINTS, "ad", sizeof (gdouble),
+                           (gconstpointer *) &db->spatial_points, &n_spatial_points, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_GRID_OFFSETS, "au", sizeof (guint32),
+                           (gconstpointer *) &db->grid_offsets, &n_grid_offsets, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_GRID_ROWS, "au", sizeof (guint32),
+                           (gconstpointer *) &db->grid_rows, &n_grid_rows, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_TIER_OFFSETS, "au", sizeof (guint32),
+                           (gconstpointer *) &db->tier_offsets, &n_tier_offsets, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_TIER_MIN_POPULATIONS, "au", sizeof (guint32),
+                           (gconstpointer *) &db->tier_min_populations, &n_tier_min_populations, error) ||
+      !lookup_fixed_array (db->data, GEONAMES_DB_KEY_TIER_POPULATIONS, "au", sizeof (guint32),
+                           (gconstpointer *) &db->tier_populations, &db->n_tiers, error))
+    {
+      geonames_db_free (db);
+      return NULL;
+    }
+
+  if (n_city_states != db->n_cities ||
+      n_city_countries != db->n_cities ||
+      n_city_timezones != db->n_cities ||
+      n_state_ids != db->n_states ||
+      n_state_names != db->n_states ||
+      n_state_file_names != db->n_states ||
+      n_country_ids != db->n_countries ||
+      n_country_names != db->n_countries ||
+      n_country_file_names != db->n_countries ||
+      n_city_file_names != db->n_cities ||
+      n_city_populations != db->n_cities ||
+      n_city_latitudes != db->n_cities ||
+      n_city_longitudes != db->n_cities ||
+      n_city_feature_codes != db->n_cities ||
+      (db->strings_size > 0 && db->strings[db->strings_size - 1] != '\0'))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "database contains invalid city columns");
+      geonames_db_free (db);
+      return NULL;
+    }
+
+  db->n_tokens = n_token_offsets;
+
+  if (n_posting_offsets != db->n_tokens + 1 ||
+      db->posting_offsets[db->n_tokens] != db->n_postings ||
+      (db->tokens_size > 0 && db->tokens[db->tokens_size - 1] != '\0'))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "database contains an invalid token index");
+      geonames_db_free (db);
+      return NULL;
+    }
+
+  if (n_trigram_offsets != db->n_trigrams + 1 ||
+      db->trigram_offsets[db->n_trigrams] != db->n_trigram_tokens)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "database contains an invalid trigram index");
+      geonames_db_free (db);
+      return NULL;
+    }
+
+  if (n_name_token_offsets != db->n_names + 1 ||
+      db->name_token_offsets[db->n_names] != db->n_name_tokens ||
+      n_name_ascii_tokens != db->n_name_tokens ||
+      n_name_token_prefixes != db->n_name_tokens ||
+      n_name_ascii_token_prefixes != db->n_name_tokens ||
+      n_city_names != db->n_cities ||
+      (db->names_size > 0 && db->names[db->names_size - 1] != '\0'))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "database contains an invalid name table");
+      geonames_db_free (db);
+      return NULL;
+    }
+
+  if (n_spatial_rows != db->n_cities || n_spatial_points != 3 * db->n_cities ||
+      n_grid_offsets != GEONAMES_DB_GRID_CELLS + 1 ||
+      db->grid_offsets[GEONAMES_DB_GRID_CELLS] != n_grid_rows ||
+      n_grid_rows != db->n_cities)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "database contains an invalid spatial index");
+      geonames_db_free (db);
+      return NULL;
+    }
+
+  if (n_tier_offsets != db->n_tiers + 1 ||
+      n_tier_min_populations != db->n_tiers ||
+      db->tier_offsets[0] != 0 ||
+      db->tier_offsets[db->n_tiers] != db->n_cities)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "database contains invalid tiers");
+      geonames_db_free (db);
+      return NULL;
+    }
+
+  /* tier_may_improve() relies on later tiers having fewer inhabitants */
+  for (i = 0; i < db->n_tiers; i++)
+    {
+      if (db->tier_offsets[i] > db->tier_offsets[i + 1] ||
+          db->tier_populations[i] < db->tier_min_populations[i] ||
+          (i > 0 && db->tier_populations[i] >= db->tier_min_populations[i - 1]))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "database contains invalid tiers");
+          geonames_db_free (db);
+          return NULL;
+        }
+    }
+
+  if (db->languages_size > 0 && db->languages[db->languages_size - 1] != '\0')
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "database contains an invalid language table");
+      geonames_db_free (db);
+      return NULL;
+    }
+
+  if (!check_references (db, error))
+    {
+      geonames_db_free (db);
+      return NULL;
+    }
+
+  return db;
+}
+
+void
+geonames_db_free (GeonamesDb *db)
+{
+  g_clear_pointer (&db->locales, g_hash_table_unref);
+  g_mutex_clear (&db->locales_lock);
+  g_clear_pointer (&db->data, g_variant_unref);
+  g_free (db);
+}
+
+gsize
+geonames_db_get_n_cities (GeonamesDb *db)
+{
+  return db->n_cities;
+}
+
+/*
+ * Binary search for str in a sorted table of n_entries strings, which
+ * start at offsets in strings.
+ */
+static gboolean
+lookup_string (const gchar   *strings,
+               const guint32 *offsets,
+               gsize          n_entries,
+               const gchar   *str,
+               guint32       *index)
+{
+  gsize lo = 0;
+  gsize hi = n_entries;
+
+  while (lo < hi)
+    {
+      gsize mid = lo + (hi - lo) / 2;
+      gint cmp;
+
+      cmp = strcmp (strings + offsets[mid], str);
+      if (cmp == 0)
+        {
+          *index = mid;
+          return TRUE;
+        }
+      else if (cmp < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return FALSE;
+}
+
+/*
+ * Returns the languages of @languages (as returned by
+ * g_get_language_names()) that the database has translations for, in
+ * order of preference.
+ *
+ * A locale only lists languages, the translations themselves are read
+ * from the database when they are looked up. Locales are cached until
+ * @db is freed, so that the same language list always returns the
+ * same locale.
+ */
+GeonamesDbLocale *
+geonames_db_get_locale (GeonamesDb          *db,
+                        const gchar * const *languages)
+{
+  g_autoptr(GMutexLocker) locker = NULL;
+  g_autofree gchar *key = NULL;
+  GeonamesDbLocale *locale;
+  guint i, j;
+
+  key = g_strjoinv (":", (gchar **) languages);
+
+  locker = g_mutex_locker_new (&db->locales_lock);
+
+  locale = g_hash_table_lookup (db->locales, key);
+  if (locale)
+    return locale;
+
+  locale = g_new (GeonamesDbLocale, 1);
+  locale->languages = g_new (guint32, g_strv_length ((gchar **) languages));
+  locale->n_languages = 0;
+
+  for (i = 0; languages[i]; i++)
+    {
+      guint32 language;
+
+      if (!lookup_string (db->languages, db->language_offsets, db->n_languages, languages[i], &language))
+        continue;
+
+      for (j = 0; j < locale->n_languages; j++)
+        if (locale->languages[j] == language)
+          break;
+
+      if (j == locale->n_languages)
+        locale->languages[locale->n_languages++] = language;
+    }
+
+  g_hash_table_insert (db->locales, g_steal_pointer (&key), locale);
+
+  return locale;
+}
+
+/*
+ * Returns the translation of key in the first language of locale that
+ * has one, or GEONAMES_DB_NO_TRANSLATION. The keys of each language
+ * are sorted, so this is a binary search in the database for the
+ * preferred language, and in the following ones only if it doesn't
+ * have a translation.
+ */
+static guint32
+lookup_translation (const GeonamesDbTranslations *translations,
+                    const GeonamesDbLocale       *locale,
+                    guint32                       key)
+{
+  guint i;
+
+  for (i = 0; i < locale->n_languages; i++)
+    {
+      guint32 lo = translations->offsets[locale->languages[i]];
+      guint32 hi = translations->offsets[locale->languages[i] + 1];
+
+      while (lo < hi)
+        {
+          guint32 mid = lo + (hi - lo) / 2;
+
+          if (translations->keys[mid] == key)
+            return translations->values[mid];
+          else if (translations->keys[mid] < key)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+    }
+
+  return GEONAMES_DB_NO_TRANSLATION;
+}
+
+/* Returns the index of the translated name of city in the name table */
+guint32
+geonames_db_get_city_translation (GeonamesDb             *db,
+                                  const GeonamesDbLocale *locale,
+                                  guint32                 city)
+{
+  return lookup_translation (&db->city_translations, locale, city);
+}
+
+/* Returns the offset of the translated name of state in strings */
+guint32
+geonames_db_get_state_translation (GeonamesDb             *db,
+                                   const GeonamesDbLocale *locale,
+                                   guint32                 state)
+{
+  return lookup_translation (&db->state_translations, locale, state);
+}
+
+/* Returns the offset of the translated name of country in strings */
+guint32
+geonames_db_get_country_translation (GeonamesDb             *db,
+                                     const GeonamesDbLocale *locale,
+                                     guint32                 country)
+{
+  return lookup_translation (&db->country_translations, locale, country);
+}
+
+/*
+ * Finds the range of tokens in the index that start with @prefix.
+ * Tokens first_token up to (but not including) last_token match.
+ *
+ * Returns the number of postings for all tokens in that range, which
+ * is an upper bound of the number of cities that contain a token
+ * starting with @prefix.
+ */
+gsize
+geonames_db_lookup_prefix (GeonamesDb  *db,
+                           const gchar *prefix,
+                           gsize       *first_token,
+                           gsize       *last_token)
+{
+  gsize len;
+  gsize lo, hi;
+
+  len = strlen (prefix);
+
+  /* first token that is >= prefix */
+  lo = 0;
+  hi = db->n_tokens;
+  while (lo < hi)
+    {
+      gsize mid = lo + (hi - lo) / 2;
+
+      if (strcmp (geonames_db_get_token (db, mid), prefix) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  *first_token = lo;
+
+  /* first token after that which doesn't start with prefix */
+  hi = db->n_tokens;
+  while (lo < hi)
+    {
+      gsize mid = lo + (hi - lo) / 2;
+
+      if (strncmp (geonames_db_get_token (db, mid), prefix, len) == 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  *last_token = lo;
+
+  return db->posting_offsets[*last_token] - db->posting_offsets[*first_token];
+}
+
+/* the longest query token that is matched with typos, in characters */
+#define MAX_SIMILAR_TOKEN_LENGTH 64
+
+static gint
+compare_trigrams (gconstpointer a,
+                  gconstpointer b)
+{
+  guint64 trigram_a = *(const guint64 *) a;
+  guint64 trigram_b = *(const guint64 *) b;
+
+  return (trigram_a > trigram_b) - (trigram_a < trigram_b);
+}
+
+typedef struct
+{
+  const guint32 *tokens;
+  guint32 n_tokens;
+} TrigramList;
+
+static gint
+compare_trigram_lists (gconstpointer a,
+                       gconstpointer b)
+{
+  guint32 n_a = ((const TrigramList *) a)->n_tokens;
+  guint32 n_b = ((const TrigramList *) b)->n_tokens;
+
+  return (n_a > n_b) - (n_a < n_b);
+}
+
+static gboolean
+trigram_list_contains (const TrigramList *list,
+                       guint32            token)
+{
+  guint32 lo = 0;
+  guint32 hi = list->n_tokens;
+
+  while (lo < hi)
+    {
+      guint32 mid = lo + (hi - lo) / 2;
+
+      if (list->tokens[mid] < token)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return lo < list->n_tokens && list->tokens[lo] == token;
+}
+
+/*
+ * Computes the smallest number of edits that turn the n characters in
+ * chars into a prefix of a token, for tokens in sorted order. The
+ * Levenshtein distances of chars to all prefixes of a token are
+ * computed one column (a character of the token) at a time. The
+ * columns of the prefix a token shares with the previous one are
+ * reused, and once no distance in a column is max_distance or less,
+ * tokens sharing that prefix are done without computing more.
+ */
+typedef struct
+{
+  const gunichar *chars;
+  guint n;
+  guint max_distance;
+
+  gunichar token[MAX_SIMILAR_TOKEN_LENGTH + MAX_SIMILAR_TOKEN_LENGTH / 3 + 1];
+  guint n_columns;  /* columns[0 .. n_columns - 1] belong to token */
+  guint failed;     /* the first column without a small enough distance, or G_MAXUINT */
+  guint8 columns[MAX_SIMILAR_TOKEN_LENGTH + MAX_SIMILAR_TOKEN_LENGTH / 3 + 1][MAX_SIMILAR_TOKEN_LENGTH + 1];
+  guint8 best[MAX_SIMILAR_TOKEN_LENGTH + MAX_SIMILAR_TOKEN_LENGTH / 3 + 1];
+} PrefixDistance;
+
+static void
+prefix_distance_init (PrefixDistance *pd,
+                      const gunichar *chars,
+                      guint           n,
+                      guint           max_distance)
+{
+  guint i;
+
+  pd->chars = chars;
+  pd->n = n;
+  pd->max_distance = max_distance;
+
+  for (i = 0; i <= n; i++)
+    pd->columns[0][i] = i;
+
+  pd->best[0] = n;
+  pd->n_columns = 1;
+  pd->failed = G_MAXUINT;
+}
+
+/* Returns the distance to token, or max_distance + 1 if it is larger */
+static guint
+prefix_distance_next (PrefixDistance *pd,
+                      const gchar    *token)
+{
+  gunichar chars[G_N_ELEMENTS (pd->token)];
+  guint max_columns = pd->n + pd->max_distance;
+  guint len = 0;
+  guint shared = 0;
+  guint i, j;
+
+  /* longer prefixes can't be any closer */
+  for (; *token && len < max_columns; token = g_utf8_next_char (token))
+    chars[len++] = g_utf8_get_char (token);
+
+  while (shared < len && shared + 1 < pd->n_columns && chars[shared] == pd->token[shared])
+    shared++;
+
+  /* longer prefixes of this token can't get any closer than the shared ones */
+  if (pd->failed <= shared)
+    return MIN (pd->best[pd->failed], pd->max_distance + 1);
+
+  pd->failed = G_MAXUINT;
+
+  for (j = shared + 1; j <= len; j++)
+    {
+      const guint8 *left = pd->columns[j - 1];
+      guint8 *column = pd->columns[j];
+      guint lowest;
+
+      pd->token[j - 1] = chars[j - 1];
+
+      column[0] = j;
+      lowest = j;
+
+      for (i = 1; i <= pd->n; i++)
+        {
+          column[i] = MIN (MIN (left[i], column[i - 1]) + 1, left[i - 1] + (pd->chars[i - 1] != chars[j - 1]));
+          lowest = MIN (lowest, column[i]);
+        }
+
+      pd->best[j] = MIN (pd->best[j - 1], column[pd->n]);
+
+      if (lowest > pd->max_distance)
+        {
+          pd->failed = j;
+          break;
+        }
+    }
+
+  pd->n_columns = MIN (j, len) + 1;
+
+  return MIN (pd->best[pd->n_columns - 1], pd->max_distance + 1);
+}
+
+/*
+ * Buffers of geonames_db_lookup_similar(), kept per thread so that a
+ * query doesn't allocate and clear arrays as large as the token table.
+ * Both counts and candidates are all zeros between calls: counts is
+ * reset through the touched tokens and candidates while it is read.
+ */
+typedef struct
+{
+  guint8 *counts;
+  guint64 *candidates;
+  gsize n_tokens;
+  guint32 *touched;
+  gsize n_touched;
+} SimilarScratch;
+
+static void
+similar_scratch_free (gpointer data)
+{
+  SimilarScratch *scratch = data;
+
+  g_free (scratch->counts);
+  g_free (scratch->candidates);
+  g_free (scratch->touched);
+  g_free (scratch);
+}
+
+static GPrivate similar_scratch = G_PRIVATE_INIT (similar_scratch_free);
+
+/* Returns the buffers of this thread, with room for n_tokens tokens of
+ * which n_touched are touched */
+static SimilarScratch *
+get_similar_scratch (gsize n_tokens,
+                     gsize n_touched)
+{
+  SimilarScratch *scratch;
+
+  scratch = g_private_get (&similar_scratch);
+  if (scratch == NULL)
+    {
+      scratch = g_new0 (SimilarScratch, 1);
+      g_private_set (&similar_scratch, scratch);
+    }
+
+  if (scratch->n_tokens < n_tokens)
+    {
+      g_free (scratch->counts);
+      g_free (scratch->candidates);
+      scratch->counts = g_new0 (guint8, n_tokens);
+      scratch->candidates = g_new0 (guint64, (n_tokens + 63) / 64);
+      scratch->n_tokens = n_tokens;
+    }
+
+  if (scratch->n_touched < n_touched)
+    {
+      g_free (scratch->touched);
+      scratch->touched = g_new (guint32, n_touched);
+      scratch->n_touched = n_touched;
+    }
+
+  return scratch;
+}
+
+/*
+ * Returns all tokens that start with a string at most max_distance
+ * edits (inserted, deleted, or replaced characters) away from token,
+ * as an array of GeonamesDbSimilarToken sorted by token. This includes
+ * the tokens starting with token itself.
+ *
+ * Every edit changes at most three trigrams, so only the tokens that
+ * have all but 3 * max_distance of the trigrams of token in common
+ * with it need to be compared. Tokens that are too short to share any
+ * trigrams with such a token have no similar tokens.
+ *
+ * The first two trigrams of token (those with padding) are shared by
+ * exactly the tokens that start with the same one or two characters,
+ * which are ranges of the sorted token table. Only the lists of the
+ * other trigrams are read from the index, and the longest of those
+ * only for tokens found in the others.
+ */
+GArray *
+geonames_db_lookup_similar (GeonamesDb  *db,
+                            const gchar *token,
+                            guint        max_distance)
+{
+  gunichar chars[MAX_SIMILAR_TOKEN_LENGTH];
+  guint64 trigrams[MAX_SIMILAR_TOKEN_LENGTH];
+  SimilarScratch *scratch;
+  guint8 *counts;
+  guint64 *candidates;
+  guint32 *touched;
+  TrigramList lists[MAX_SIMILAR_TOKEN_LENGTH];
+  gchar prefix[2 * 6 + 1] = { 0, };
+  gsize first[2], last[2];
+  PrefixDistance pd;
+  GArray *similar;
+  const gchar *p;
+  guint n_chars = 0;
+  guint n_trigrams = 0;
+  guint min_shared;
+  guint n_scanned;
+  gsize n_touched = 0;
+  gsize n_words;
+  gsize w;
+  guint i, k;
+
+  similar = g_array_new (FALSE, FALSE, sizeof (GeonamesDbSimilarToken));
+
+  for (p = token; *p && n_chars < MAX_SIMILAR_TOKEN_LENGTH; p = g_utf8_next_char (p))
+    chars[n_chars++] = g_utf8_get_char (p);
+
+  if (*p != '\0' || n_chars < 2)
+    return similar;
+
+  for (i = 2; i < n_chars; i++)
+    trigrams[i - 2] = geonames_db_trigram (chars[i - 2], chars[i - 1], chars[i]);
+
+  qsort (trigrams, n_chars - 2, sizeof (guint64), compare_trigrams);
+  for (i = 0; i < n_chars - 2; i++)
+    if (n_trigrams == 0 || trigrams[n_trigrams - 1] != trigrams[i])
+      trigrams[n_trigrams++] = trigrams[i];
+
+  /* including the two with padding */
+  if (n_trigrams + 2 <= 3 * max_distance)
+    return similar;
+
+  min_shared = n_trigrams + 2 - 3 * max_distance;
+
+  /* the tokens starting with the first character, and with the first two */
+  for (k = 0; k < 2; k++)
+    {
+      g_unichar_to_utf8 (chars[k], prefix + strlen (prefix));
+      geonames_db_lookup_prefix (db, prefix, &first[k], &last[k]);
+    }
+
+  for (i = 0; i < n_trigrams; i++)
+    {
+      gsize lo = 0;
+      gsize hi = db->n_trigrams;
+
+      while (lo < hi)
+        {
+          gsize mid = lo + (hi - lo) / 2;
+
+          if (db->trigrams[mid] < trigrams[i])
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+
+      if (lo < db->n_trigrams && db->trigrams[lo] == trigrams[i])
+        {
+          lists[i].tokens = db->trigram_tokens + db->trigram_offsets[lo];
+          lists[i].n_tokens = db->trigram_offsets[lo + 1] - db->trigram_offsets[lo];
+        }
+      else
+        {
+          lists[i].tokens = NULL;
+          lists[i].n_tokens = 0;
+        }
+    }
+
+  qsort (lists, n_trigrams, sizeof (TrigramList), compare_trigram_lists);
+
+  /* Outside of the ranges, a token needs at least MAX (min_shared - 2, 1)
+   * of the trigrams, and thus is in one of the n_trigrams - that + 1
+   * shortest lists. The longer lists are only searched for those. */
+  n_scanned = MIN (n_trigrams + 3 - MAX (min_shared, 3), n_trigrams);
+
+  for (i = 0; i < n_scanned; i++)
+    n_touched += lists[i].n_tokens;
+
+  scratch = get_similar_scratch (db->n_tokens, n_touched);
+  counts = scratch->counts;
+  candidates = scratch->candidates;
+  touched = scratch->touched;
+  n_touched = 0;
+  n_words = (db->n_tokens + 63) / 64;
+
+  for (k = 0; k < 2; k++)
+    {
+      gsize t;
+
+      if (min_shared > k + 1)
+        continue;
+
+      for (t = first[k]; t < last[k]; t++)
+        candidates[t / 64] |= G_GUINT64_CONSTANT (1) << (t % 64);
+    }
+
+  for (i = 0; i < n_scanned; i++)
+    {
+      guint32 j;
+
+      for (j = 0; j < lists[i].n_tokens; j++)
+        {
+          guint32 t = lists[i].tokens[j];
+
+          if (t >= db->n_tokens)
+            continue;
+
+          if (counts[t]++ == 0)
+            touched[n_touched++] = t;
+        }
+    }
+
+  for (w = 0; w < n_touched; w++)
+    {
+      guint32 t = touched[w];
+      guint shared = counts[t] + (t >= first[0] && t < last[0]) + (t >= first[1] && t < last[1]);
+      guint j;
+
+      counts[t] = 0;
+
+      for (j = n_scanned; j < n_trigrams && shared < min_shared; j++)
+        {
+          if (shared + n_trigrams - j < min_shared)
+            break;
+
+          shared += trigram_list_contains (&lists[j], t);
+        }
+
+      if (shared >= min_shared)
+        candidates[t / 64] |= G_GUINT64_CONSTANT (1) << (t % 64);
+    }
+
+  /* in the order of the token table, so that similar tokens are next to each other */
+  prefix_distance_init (&pd, chars, n_chars, max_distance);
+
+  for (w = 0; w < n_words; w++)
+    {
+      guint64 bits;
+      guint bit;
+
+      bits = candidates[w];
+      candidates[w] = 0;
+
+      for (bit = 0; bits != 0; bits >>= 1, bit++)
+        {
+          GeonamesDbSimilarToken match;
+
+          if ((bits & 1) == 0)
+            continue;
+
+          match.token = w * 64 + bit;
+          match.distance = prefix_distance_next (&pd, geonames_db_get_token (db, match.token));
+
+          if (match.distance <= max_distance)
+            g_array_append_val (similar, match);
+        }
+    }
+
+  return similar;
+}
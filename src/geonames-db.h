@@ -0,0 +1,415 @@
+/*
+ * Copyright 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GEONAMES_DB
+#define GEONAMES_DB
+
+#include <gio/gio.h>
+#include <math.h>
+#include <string.h>
+
+/*
+ * cities.compiled is a serialized a{sv}. This header is shared between
+ * geonames-mkdb, which writes it, and the library, which reads it.
+ *
+ * GEONAMES_DB_VERSION must be bumped whenever the set of keys or the
+ * layout of any of their values changes.
+ */
+#define GEONAMES_DB_VERSION                 15
+
+#define GEONAMES_DB_KEY_VERSION             "version"               /* u */
+
+/* Places with fewer inhabitants than this are left out, except for
+ * capitals. geonames-mkdb --update applies it to new places.
+ */
+#define GEONAMES_DB_KEY_MIN_POPULATION      "min-population"        /* u */
+
+/* Cities are stored column-wise: element i of each "city-" array
+ * belongs to the city with index i. String columns contain offsets of
+ * nul-terminated strings in "strings", which stores every distinct
+ * string only once. States, countries and timezones are shared by many
+ * cities and are stored as indices into the tables below instead.
+ */
+#define GEONAMES_DB_KEY_STRINGS             "strings"               /* ay */
+#define GEONAMES_DB_KEY_CITY_IDS            "city-ids"              /* au */
+#define GEONAMES_DB_KEY_CITY_STATES         "city-states"           /* aq */
+#define GEONAMES_DB_KEY_CITY_COUNTRIES      "city-countries"        /* aq */
+#define GEONAMES_DB_KEY_CITY_TIMEZONES      "city-timezones"        /* aq */
+#define GEONAMES_DB_KEY_CITY_POPULATIONS    "city-populations"      /* au */
+#define GEONAMES_DB_KEY_CITY_LATITUDES      "city-latitudes"        /* ad */
+#define GEONAMES_DB_KEY_CITY_LONGITUDES     "city-longitudes"       /* ad */
+#define GEONAMES_DB_KEY_CITY_FEATURE_CODES  "city-feature-codes"    /* au */
+
+/* Sorted table of all folded name tokens (and their ASCII
+ * transliterations) of all city names in all languages. "tokens"
+ * contains the nul-terminated strings, "token-offsets" their start in
+ * "tokens". The cities containing token i are
+ * postings[posting-offsets[i] .. posting-offsets[i + 1]], in ascending
+ * order.
+ */
+#define GEONAMES_DB_KEY_TOKENS              "tokens"                /* ay */
+#define GEONAMES_DB_KEY_TOKEN_OFFSETS       "token-offsets"         /* au */
+#define GEONAMES_DB_KEY_POSTING_OFFSETS     "posting-offsets"       /* au */
+#define GEONAMES_DB_KEY_POSTINGS            "postings"              /* au */
+
+/* Sorted table of all city names (English and translations), stored
+ * like the token table above. The tokens of name i are
+ * name-tokens[name-token-offsets[i] .. name-token-offsets[i + 1]], as
+ * indices into the token table. name-ascii-tokens contains the index
+ * of the ASCII transliteration of each of those tokens, or
+ * GEONAMES_DB_NO_TOKEN if the token is ASCII already.
+ */
+#define GEONAMES_DB_KEY_NAMES               "names"                 /* ay */
+#define GEONAMES_DB_KEY_NAME_OFFSETS        "name-offsets"          /* au */
+#define GEONAMES_DB_KEY_NAME_TOKEN_OFFSETS  "name-token-offsets"    /* au */
+#define GEONAMES_DB_KEY_NAME_TOKENS         "name-tokens"           /* au */
+#define GEONAMES_DB_KEY_NAME_ASCII_TOKENS   "name-ascii-tokens"     /* au */
+
+/* The first GEONAMES_DB_TOKEN_PREFIX_SIZE bytes of each token in
+ * name-tokens and name-ascii-tokens, padded with zeros (see
+ * geonames_db_token_prefix()), so that prefixes can be compared
+ * without looking up the tokens. The prefix of GEONAMES_DB_NO_TOKEN
+ * is 0.
+ */
+#define GEONAMES_DB_KEY_NAME_TOKEN_PREFIXES "name-token-prefixes"   /* at */
+#define GEONAMES_DB_KEY_NAME_ASCII_TOKEN_PREFIXES "name-ascii-token-prefixes" /* at */
+
+#define GEONAMES_DB_TOKEN_PREFIX_SIZE       8
+
+/* Trigram index of the token table, for queries that tolerate typos.
+ * The trigrams of a token are the triples of consecutive characters
+ * after prepending two zero characters to it, so that a token of n
+ * characters has n trigrams, packed as in geonames_db_trigram().
+ * "trigrams" is sorted and the tokens containing trigram i are
+ * trigram-tokens[trigram-offsets[i] .. trigram-offsets[i + 1]], in
+ * ascending order.
+ */
+#define GEONAMES_DB_KEY_TRIGRAMS            "trigrams"              /* at */
+#define GEONAMES_DB_KEY_TRIGRAM_OFFSETS     "trigram-offsets"       /* au */
+#define GEONAMES_DB_KEY_TRIGRAM_TOKENS      "trigram-tokens"        /* au */
+
+/* Index of the English name of each city in the name table */
+#define GEONAMES_DB_KEY_CITY_NAMES          "city-names"            /* au */
+
+/* Sorted tables of "<country code>.<admin1 code>" of all states and
+ * of all country codes, and the geonames ids and English names of those
+ * states and countries, as offsets into "strings".
+ */
+#define GEONAMES_DB_KEY_STATES              "states"                /* au */
+#define GEONAMES_DB_KEY_STATE_IDS           "state-ids"             /* au */
+#define GEONAMES_DB_KEY_STATE_NAMES         "state-names"           /* au */
+#define GEONAMES_DB_KEY_COUNTRIES           "countries"             /* au */
+#define GEONAMES_DB_KEY_COUNTRY_IDS         "country-ids"           /* au */
+#define GEONAMES_DB_KEY_COUNTRY_NAMES       "country-names"         /* au */
+
+/* All timezones, in no particular order, as offsets into "strings" */
+#define GEONAMES_DB_KEY_TIMEZONES           "timezones"             /* au */
+
+/* Sorted table of all languages that have translations, stored like
+ * the token table. Translations of language i are at positions
+ * offsets[i] .. offsets[i + 1] of the "-keys" and "-values" arrays of
+ * a translation table, sorted by key.
+ *
+ * City translations map city indices to indices in the name table.
+ * State and country translations map indices into "states" and
+ * "countries" to offsets into "strings".
+ */
+#define GEONAMES_DB_KEY_LANGUAGES                   "languages"                     /* ay */
+#define GEONAMES_DB_KEY_LANGUAGE_OFFSETS            "language-offsets"              /* au */
+#define GEONAMES_DB_KEY_CITY_TRANSLATION_OFFSETS    "city-translation-offsets"      /* au */
+#define GEONAMES_DB_KEY_CITY_TRANSLATION_KEYS       "city-translation-keys"         /* au */
+#define GEONAMES_DB_KEY_CITY_TRANSLATION_VALUES     "city-translation-values"       /* au */
+#define GEONAMES_DB_KEY_STATE_TRANSLATION_OFFSETS   "state-translation-offsets"     /* au */
+#define GEONAMES_DB_KEY_STATE_TRANSLATION_KEYS      "state-translation-keys"        /* au */
+#define GEONAMES_DB_KEY_STATE_TRANSLATION_VALUES    "state-translation-values"      /* au */
+#define GEONAMES_DB_KEY_COUNTRY_TRANSLATION_OFFSETS "country-translation-offsets"   /* au */
+#define GEONAMES_DB_KEY_COUNTRY_TRANSLATION_KEYS    "country-translation-keys"      /* au */
+#define GEONAMES_DB_KEY_COUNTRY_TRANSLATION_VALUES  "country-translation-values"    /* au */
+
+/* Where each translation came from, for geonames-mkdb --update: the id
+ * of the alternate name in alternateNames.txt, with
+ * GEONAMES_DB_SOURCE_PREFERRED set if it is a preferred name, or
+ * GEONAMES_DB_SOURCE_NONE for English names that come from the cities,
+ * admin1 or countries file.
+ */
+#define GEONAMES_DB_KEY_CITY_TRANSLATION_SOURCES    "city-translation-sources"      /* au */
+#define GEONAMES_DB_KEY_STATE_TRANSLATION_SOURCES   "state-translation-sources"     /* au */
+#define GEONAMES_DB_KEY_COUNTRY_TRANSLATION_SOURCES "country-translation-sources"   /* au */
+
+/* The names of cities, states and countries in the cities, admin1 and
+ * countries file, as offsets into "strings", or
+ * GEONAMES_DB_NO_TRANSLATION where the English name is that name. An
+ * English alternate name takes their place, and geonames-mkdb --update
+ * falls back to them when it is deleted.
+ */
+#define GEONAMES_DB_KEY_CITY_FILE_NAMES     "city-file-names"       /* au */
+#define GEONAMES_DB_KEY_STATE_FILE_NAMES    "state-file-names"      /* au */
+#define GEONAMES_DB_KEY_COUNTRY_FILE_NAMES  "country-file-names"    /* au */
+
+/* Implicit balanced k-d tree over the positions of all cities on the
+ * unit sphere. "spatial-points" contains the x, y, and z coordinates of
+ * the city spatial-rows[i] at positions 3 * i .. 3 * i + 2. The root of
+ * the tree for a range of nodes is the node in its middle, which splits
+ * the range on the axis depth % 3.
+ */
+#define GEONAMES_DB_KEY_SPATIAL_ROWS        "spatial-rows"          /* au */
+#define GEONAMES_DB_KEY_SPATIAL_POINTS      "spatial-points"        /* ad */
+
+/* Grid of GEONAMES_DB_GRID_SIZE x GEONAMES_DB_GRID_SIZE degree cells.
+ * The cities in the cell at latitude index i and longitude index j
+ * (counting from -90 and -180 degrees) are
+ * grid-rows[grid-offsets[c] .. grid-offsets[c + 1]], where
+ * c = i * GEONAMES_DB_GRID_LONGITUDE_CELLS + j, ordered by descending
+ * population.
+ */
+#define GEONAMES_DB_KEY_GRID_OFFSETS        "grid-offsets"          /* au */
+#define GEONAMES_DB_KEY_GRID_ROWS           "grid-rows"             /* au */
+
+/* Cities are ordered by population tier, most populous tier first.
+ * The cities of tier i are rows tier-offsets[i] .. tier-offsets[i + 1].
+ * They have at least tier-min-populations[i] inhabitants, fewer than
+ * the minimum of the tier before, and tier-populations[i] is the
+ * largest population among them. Queries by name only descend into the
+ * next tier while a city of it could still be one of the results.
+ */
+#define GEONAMES_DB_KEY_TIER_OFFSETS        "tier-offsets"          /* au */
+#define GEONAMES_DB_KEY_TIER_MIN_POPULATIONS "tier-min-populations" /* au */
+#define GEONAMES_DB_KEY_TIER_POPULATIONS    "tier-populations"      /* au */
+
+#define GEONAMES_DB_GRID_SIZE               2
+#define GEONAMES_DB_GRID_LATITUDE_CELLS     (180 / GEONAMES_DB_GRID_SIZE)
+#define GEONAMES_DB_GRID_LONGITUDE_CELLS    (360 / GEONAMES_DB_GRID_SIZE)
+#define GEONAMES_DB_GRID_CELLS              (GEONAMES_DB_GRID_LATITUDE_CELLS * GEONAMES_DB_GRID_LONGITUDE_CELLS)
+
+#define GEONAMES_DB_NO_TOKEN                G_MAXUINT32
+#define GEONAMES_DB_NO_TRANSLATION          G_MAXUINT32
+
+#define GEONAMES_DB_SOURCE_NONE             0
+#define GEONAMES_DB_SOURCE_PREFERRED        (1u << 31)
+
+/* A token that starts with a string distance edits away from another one */
+typedef struct
+{
+  guint32 token;
+  guint32 distance;
+} GeonamesDbSimilarToken;
+
+typedef struct
+{
+  const guint32 *offsets;
+  const guint32 *keys;
+  const guint32 *values;
+  const guint32 *sources;
+  gsize n_entries;
+} GeonamesDbTranslations;
+
+/*
+ * The languages of a language list that the database has translations
+ * for, as indices into the language table, in order of preference.
+ */
+typedef struct
+{
+  guint32 *languages;
+  guint n_languages;
+} GeonamesDbLocale;
+
+typedef struct
+{
+  GVariant *data;
+
+  const gchar *strings;
+  gsize strings_size;
+  gsize n_cities;
+  const guint32 *city_ids;
+  const guint16 *city_states;
+  const guint16 *city_countries;
+  const guint16 *city_timezones;
+  const guint32 *city_populations;
+  const gdouble *city_latitudes;
+  const gdouble *city_longitudes;
+  const guint32 *city_feature_codes;
+  guint32 min_population;
+
+  const gchar *tokens;
+  gsize tokens_size;
+  const guint32 *token_offsets;
+  gsize n_tokens;
+  const guint32 *posting_offsets;
+  const guint32 *postings;
+  gsize n_postings;
+
+  const gchar *names;
+  gsize names_size;
+  const guint32 *name_offsets;
+  gsize n_names;
+  const guint32 *name_token_offsets;
+  const guint32 *name_tokens;
+  const guint32 *name_ascii_tokens;
+  const guint64 *name_token_prefixes;
+  const guint64 *name_ascii_token_prefixes;
+  gsize n_name_tokens;
+
+  const guint64 *trigrams;
+  gsize n_trigrams;
+  const guint32 *trigram_offsets;
+  const guint32 *trigram_tokens;
+  gsize n_trigram_tokens;
+  const guint32 *city_names;
+  const guint32 *city_file_names;
+
+  const guint32 *states;
+  const guint32 *state_ids;
+  const guint32 *state_names;
+  const guint32 *state_file_names;
+  gsize n_states;
+  const guint32 *countries;
+  const guint32 *country_ids;
+  const guint32 *country_names;
+  const guint32 *country_file_names;
+  gsize n_countries;
+  const guint32 *timezones;
+  gsize n_timezones;
+
+  const gchar *languages;
+  gsize languages_size;
+  const guint32 *language_offsets;
+  gsize n_languages;
+  GeonamesDbTranslations city_translations;
+  GeonamesDbTranslations state_translations;
+  GeonamesDbTranslations country_translations;
+
+  const guint32 *spatial_rows;
+  const gdouble *spatial_points;
+  const guint32 *grid_offsets;
+  const guint32 *grid_rows;
+
+  const guint32 *tier_offsets;
+  const guint32 *tier_min_populations;
+  const guint32 *tier_populations;
+  gsize n_tiers;
+
+  GMutex locales_lock;
+  GHashTable *locales;
+} GeonamesDb;
+
+GeonamesDb *            geonames_db_new                                 (GBytes       *bytes,
+                                                                         GError      **error);
+
+void                    geonames_db_free                                (GeonamesDb   *db);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (GeonamesDb, geonames_db_free)
+
+gsize                   geonames_db_get_n_cities                        (GeonamesDb   *db);
+
+/*
+ * Converts latitude and longitude (in degrees) to a point on the unit
+ * sphere. The squared euclidean distance between two such points grows
+ * monotonically with their great-circle distance.
+ */
+static inline void
+geonames_db_point_from_coordinates (gdouble  latitude,
+                                    gdouble  longitude,
+                                    gdouble *point)
+{
+  gdouble lat = latitude * G_PI / 180.0;
+  gdouble lon = longitude * G_PI / 180.0;
+
+  point[0] = cos (lat) * cos (lon);
+  point[1] = cos (lat) * sin (lon);
+  point[2] = sin (lat);
+}
+
+static inline guint
+geonames_db_grid_latitude_cell (gdouble latitude)
+{
+  return CLAMP ((gint) floor ((latitude + 90) / GEONAMES_DB_GRID_SIZE), 0, GEONAMES_DB_GRID_LATITUDE_CELLS - 1);
+}
+
+static inline guint
+geonames_db_grid_longitude_cell (gdouble longitude)
+{
+  return CLAMP ((gint) floor ((longitude + 180) / GEONAMES_DB_GRID_SIZE), 0, GEONAMES_DB_GRID_LONGITUDE_CELLS - 1);
+}
+
+/*
+ * Returns the first GEONAMES_DB_TOKEN_PREFIX_SIZE bytes of token,
+ * padded with zeros, in memory order.
+ */
+static inline guint64
+geonames_db_token_prefix (const gchar *token)
+{
+  guint64 prefix = 0;
+
+  memcpy (&prefix, token, MIN (strlen (token), GEONAMES_DB_TOKEN_PREFIX_SIZE));
+
+  return prefix;
+}
+
+/* Packs three characters into a trigram, see GEONAMES_DB_KEY_TRIGRAMS */
+static inline guint64
+geonames_db_trigram (gunichar a,
+                     gunichar b,
+                     gunichar c)
+{
+  return ((guint64) a << 42) | ((guint64) b << 21) | c;
+}
+
+static inline const gchar *
+geonames_db_get_string (GeonamesDb *db,
+                        guint32     offset)
+{
+  return db->strings + offset;
+}
+
+static inline const gchar *
+geonames_db_get_name (GeonamesDb *db,
+                      guint32     name)
+{
+  return db->names + db->name_offsets[name];
+}
+
+static inline const gchar *
+geonames_db_get_token (GeonamesDb *db,
+                       guint32     token)
+{
+  return db->tokens + db->token_offsets[token];
+}
+
+GeonamesDbLocale *      geonames_db_get_locale                          (GeonamesDb          *db,
+                                                                         const gchar * const *languages);
+
+guint32                 geonames_db_get_city_translation                (GeonamesDb             *db,
+                                                                         const GeonamesDbLocale *locale,
+                                                                         guint32                 city);
+
+guint32                 geonames_db_get_state_translation               (GeonamesDb             *db,
+                                                                         const GeonamesDbLocale *locale,
+                                                                         guint32                 state);
+
+guint32                 geonames_db_get_country_translation             (GeonamesDb             *db,
+                                                                         const GeonamesDbLocale *locale,
+                                                                         guint32                 country);
+
+gsize                   geonames_db_lookup_prefix                       (GeonamesDb   *db,
+                                                                         const gchar  *prefix,
+                                                                         gsize        *first_token,
+                                                                         gsize        *last_token);
+
+GArray *                geonames_db_lookup_similar                      (GeonamesDb   *db,
+                                                                         const gchar  *token,
+                                                                         guint         max_distance);
+
+#endif
@@ -20,6 +20,8 @@
 #include <string.h>
 #include <locale.h>
 
+#include "geonames-db.h"
+
 enum
 {
   ADMIN1_CODE = 0,
@@ -86,25 +88,125 @@ enum
   COUNTRIES_EQUIVALENTFIPSCODE
 };
 
+typedef struct
+{
+  guint32 id;             /* offsets into the string table */
+  guint32 feature_code;
+  guint16 state;          /* indices into the state, country and timezone tables */
+  guint16 country;
+  guint16 timezone;
+  guint32 population;
+  gdouble latitude;
+  gdouble longitude;
+} City;
+
+/*
+ * A translation of a place, with the id of the alternate name in
+ * alternateNames.txt it comes from. English names that come from the
+ * cities, admin1 or countries file have id 0.
+ */
+typedef struct
+{
+  gchar *name;
+  guint32 id;
+  gboolean preferred;
+} Alternate;
+
+static Alternate *
+alternate_new (gchar    *name,
+               guint32   id,
+               gboolean  preferred)
+{
+  Alternate *alternate;
+
+  alternate = g_new (Alternate, 1);
+  alternate->name = name;
+  alternate->id = id;
+  alternate->preferred = preferred;
+
+  return alternate;
+}
+
+static void
+alternate_free (gpointer data)
+{
+  Alternate *alternate = data;
+
+  g_free (alternate->name);
+  g_free (alternate);
+}
+
+/*
+ * Returns whether an alternate name with id and preferred replaces
+ * other as the translation of a place. alternateNames.txt is sorted by
+ * id, and of several names of a place in a language, the last preferred
+ * one is used, or the first one if none of them is preferred. Deciding
+ * by id makes that independent of the order names are read in.
+ */
+static gboolean
+alternate_replaces (guint32          id,
+                    gboolean         preferred,
+                    const Alternate *other)
+{
+  if (preferred != other->preferred)
+    return preferred;
+
+  return preferred ? id > other->id : id < other->id;
+}
+
 typedef struct
 {
   GHashTable *admin1;
   GHashTable *admin1_ids;
   GHashTable *countries;
   GHashTable *countries_ids;
+  gchar **states;         /* sorted keys of admin1 */
+  guint n_states;
+  GHashTable *state_indices;
+  gchar **country_codes;  /* sorted keys of countries */
+  guint n_countries;
+  GHashTable *country_indices;
+  GHashTable *timezones;  /* timezone -> index, in order of appearance */
   GHashTable *cities_ids;
+  GHashTable *english_names;  /* id -> name of states and countries */
   GHashTable *alternates;
-  GVariantBuilder builder;
+  GHashTable *tokens;
+  GHashTable *names;
+  GHashTable *name_tokens;    /* name -> tokens, of the database that is updated */
+  GPtrArray *city_names;
+  GPtrArray *city_file_names; /* names in the cities file, NULL where that is the English name */
+  GHashTable *strings;
+  GByteArray *string_data;
+  GArray *cities;
+  guint32 min_population;
 } CityData;
 
-static GVariant *
-variant_new_normalize_string (const gchar *str)
+/* Returns the offset of str in the string table, adding it if needed */
+static guint32
+add_string (CityData    *data,
+            const gchar *str)
 {
-  gchar *normalized;
+  gpointer offset;
+
+  if (!g_hash_table_lookup_extended (data->strings, str, NULL, &offset))
+    {
+      offset = GUINT_TO_POINTER (data->string_data->len);
+      g_byte_array_append (data->string_data, (const guint8 *) str, strlen (str) + 1);
+      g_hash_table_insert (data->strings, g_strdup (str), offset);
+    }
+
+  return GPOINTER_TO_UINT (offset);
+}
+
+static guint32
+add_normalized_string (CityData    *data,
+                       const gchar *str)
+{
+  g_autofree gchar *normalized = NULL;
 
   normalized = g_utf8_normalize (str, -1, G_NORMALIZE_ALL_COMPOSE);
 
-  return g_variant_new_take_string (normalized);
+  return add_string (data, normalized);
 }
 
 static void
@@ -115,27 +217,166 @@ ensure_english_translation (CityData *data, const gchar *id, const gchar *en_nam
   places = g_hash_table_lookup (data->alternates, "en");
   if (places == NULL)
     {
-      places = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+      places = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, alternate_free);
       g_hash_table_insert (data->alternates, g_strdup ("en"), places);
     }
   if (!g_hash_table_contains (places, id))
     {
       g_hash_table_insert (places, g_strdup (id),
-                           g_utf8_normalize (en_name, -1, G_NORMALIZE_ALL_COMPOSE));
+                           alternate_new (g_utf8_normalize (en_name, -1, G_NORMALIZE_ALL_COMPOSE), 0, FALSE));
     }
 }
 
-static const gchar *
-get_english_translation (CityData *data, const gchar *id)
+static const Alternate *
+lookup_english_translation (CityData *data, const gchar *id)
 {
   GHashTable *places;
-  const gchar *translation = NULL;
 
   places = g_hash_table_lookup (data->alternates, "en");
-  if (places)
-    translation = g_hash_table_lookup (places, id);
 
-  return translation ? translation : "";
+  return places ? g_hash_table_lookup (places, id) : NULL;
+}
+
+static const gchar *
+get_english_translation (CityData *data, const gchar *id)
+{
+  const Alternate *translation;
+
+  translation = lookup_english_translation (data, id);
+
+  return translation ? translation->name : "";
+}
+
+/*
+ * Returns name normalized, or NULL if it is the English name of the
+ * place with id anyway
+ */
+static gchar *
+get_file_name (CityData    *data,
+               const gchar *id,
+               const gchar *name)
+{
+  const Alternate *translation;
+  gchar *normalized;
+
+  translation = lookup_english_translation (data, id);
+  if (translation == NULL || translation->id == 0)
+    return NULL;
+
+  normalized = g_utf8_normalize (name, -1, G_NORMALIZE_ALL_COMPOSE);
+  if (g_str_equal (normalized, translation->name))
+    g_clear_pointer (&normalized, g_free);
+
+  return normalized;
+}
+
+static void
+add_token (CityData    *data,
+           guint32      row,
+           const gchar *token)
+{
+  GArray *rows;
+
+  rows = g_hash_table_lookup (data->tokens, token);
+  if (rows == NULL)
+    {
+      rows = g_array_new (FALSE, FALSE, sizeof (guint32));
+      g_hash_table_insert (data->tokens, g_strdup (token), rows);
+    }
+
+  /* cities are added in order, so a duplicate can only be the last one */
+  if (rows->len == 0 || g_array_index (rows, guint32, rows->len - 1) != row)
+    g_array_append_val (rows, row);
+}
+
+/*
+ * Splits @name into case-folded tokens. If @ascii_tokens is given, it
+ * is set to an array of the same length, containing the ASCII
+ * transliteration of each token that isn't ASCII already (and NULL for
+ * the others). The query engine matches against both.
+ */
+static gchar **
+tokenize_name (const gchar   *name,
+               gchar       ***ascii_tokens)
+{
+  gchar **tokens;
+  guint n_tokens;
+  guint i;
+
+  tokens = g_str_tokenize_and_fold (name, NULL, NULL);
+  n_tokens = g_strv_length (tokens);
+
+  *ascii_tokens = g_new0 (gchar *, n_tokens + 1);
+  for (i = 0; i < n_tokens; i++)
+    {
+      if (!g_str_is_ascii (tokens[i]))
+        {
+          gchar *ascii;
+
+          ascii = g_str_to_ascii (tokens[i], NULL);
+          if (ascii[0] != '\0')
+            (*ascii_tokens)[i] = ascii;
+          else
+            g_free (ascii);
+        }
+    }
+
+  return tokens;
+}
+
+static void
+add_name_tokens (CityData    *data,
+                 guint32      row,
+                 const gchar *name)
+{
+  g_auto(GStrv) tokens = NULL;
+  g_autofree gchar **ascii_tokens = NULL;
+  const gchar **known_tokens;
+  guint i;
+
+  if (!g_hash_table_contains (data->names, name))
+    g_hash_table_add (data->names, g_strdup (name));
+
+  if (data->name_tokens && (known_tokens = g_hash_table_lookup (data->name_tokens, name)))
+    {
+      for (i = 0; known_tokens[i]; i++)
+        add_token (data, row, known_tokens[i]);
+      return;
+    }
+
+  tokens = tokenize_name (name, &ascii_tokens);
+  for (i = 0; tokens[i]; i++)
+    {
+      add_token (data, row, tokens[i]);
+
+      if (ascii_tokens[i])
+        {
+          add_token (data, row, ascii_tokens[i]);
+          g_free (ascii_tokens[i]);
+        }
+    }
+}
+
+/* Index the English name and all translations of the city with @id */
+static void
+add_city_tokens (CityData    *data,
+                 guint32      row,
+                 const gchar *id)
+{
+  GHashTableIter iter;
+  GHashTable *translations;
+
+  add_name_tokens (data, row, get_english_translation (data, id));
+
+  g_hash_table_iter_init (&iter, data->alternates);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &translations))
+    {
+      const Alternate *translation;
+
+      translation = g_hash_table_lookup (translations, id);
+      if (translation)
+        add_name_tokens (data, row, translation->name);
+    }
 }
 
 static void
@@ -145,8 +386,7 @@ handle_admin1_line (gchar    **fields,
 {
   CityData *data = user_data;
 
-  ensure_english_translation (data, fields[ADMIN1_ID], fields[ADMIN1_NAME]);
-
+  g_hash_table_insert (data->english_names, g_strdup (fields[ADMIN1_ID]), g_strdup (fields[ADMIN1_NAME]));
   g_hash_table_insert (data->admin1, g_strdup (fields[ADMIN1_CODE]), g_strdup (fields[ADMIN1_ID]));
   g_hash_table_insert (data->admin1_ids, g_strdup (fields[ADMIN1_ID]), g_strdup (fields[ADMIN1_CODE]));
 }
@@ -158,19 +398,48 @@ handle_country_line (gchar    **fields,
 {
   CityData *data = user_data;
 
-  ensure_english_translation (data, fields[COUNTRIES_ID], fields[COUNTRIES_NAME]);
-
+  g_hash_table_insert (data->english_names, g_strdup (fields[COUNTRIES_ID]), g_strdup (fields[COUNTRIES_NAME]));
   g_hash_table_insert (data->countries, g_strdup (fields[COUNTRIES_ISO]), g_strdup (fields[COUNTRIES_ID]));
   g_hash_table_insert (data->countries_ids, g_strdup (fields[COUNTRIES_ID]), g_strdup (fields[COUNTRIES_ISO]));
 }
 
+typedef struct
+{
+  CityData *data;
+  const gchar *contents;
+  const gchar *start;
+  const gchar *end;
+  GHashTable *alternates;     /* language -> id -> Alternate */
+  GError *error;
+} AlternatesChunk;
+
+/*
+ * Adds the names of states and countries to the English translations
+ * for those that don't have one in alternateNames.txt
+ */
+static void
+add_english_names (CityData *data)
+{
+  GHashTableIter iter;
+  gchar *id;
+  gchar *name;
+
+  g_hash_table_iter_init (&iter, data->english_names);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &id, (gpointer *) &name))
+    ensure_english_translation (data, id, name);
+}
+
 static void
 handle_alternates_line (gchar    **fields,
                         gpointer   user_data,
                         GError   **error)
 {
-  CityData *data = user_data;
+  AlternatesChunk *chunk = user_data;
+  CityData *data = chunk->data;
   GHashTable *places;
+  Alternate *alternate;
+  guint32 id;
+  gboolean preferred;
   gchar *lang;
 
   if ((strchr (fields[ALTERNATES_LANG], '-') == NULL &&
@@ -185,38 +454,68 @@ handle_alternates_line (gchar    **fields,
     }
 
   lang = g_strdelimit (fields[ALTERNATES_LANG], "-", '_');
+  id = strtoul (fields[ALTERNATES_ID], NULL, 10);
+  preferred = g_strcmp0 (fields[ALTERNATES_IS_PREFERRED], "1") == 0;
+
+  /* Most alternate names belong to places that aren't in the database
+   * (airports, rivers, ...). Those are only read, not written, while
+   * parsing this file, so it's safe to look them up from many threads.
+   * Languages that only name such places get no table at all.
+   */
+  if (!g_hash_table_contains (data->cities_ids, fields[ALTERNATES_CITY_ID]) &&
+      !g_hash_table_contains (data->admin1_ids, fields[ALTERNATES_CITY_ID]) &&
+      !g_hash_table_contains (data->countries_ids, fields[ALTERNATES_CITY_ID]))
+    return;
 
-  places = g_hash_table_lookup (data->alternates, lang);
+  places = g_hash_table_lookup (chunk->alternates, lang);
   if (places == NULL)
     {
-      places = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
-      g_hash_table_insert (data->alternates, g_strdup (lang), places);
+      places = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, alternate_free);
+      g_hash_table_insert (chunk->alternates, g_strdup (lang), places);
     }
 
-  /* Only replace a translation if we are currently processing the preferred version */
-  if (g_hash_table_contains (places, fields[ALTERNATES_CITY_ID]) &&
-      g_strcmp0 (fields[ALTERNATES_IS_PREFERRED], "1") != 0)
+  alternate = g_hash_table_lookup (places, fields[ALTERNATES_CITY_ID]);
+  if (alternate && !alternate_replaces (id, preferred, alternate))
     return;
 
-  g_hash_table_insert (places,
-                       g_strdup (fields[ALTERNATES_CITY_ID]),
-                       g_utf8_normalize (fields[ALTERNATES_NAME], -1, G_NORMALIZE_ALL_COMPOSE));
+  if (alternate == NULL)
+    {
+      alternate = g_new0 (Alternate, 1);
+      g_hash_table_insert (places, g_strdup (fields[ALTERNATES_CITY_ID]), alternate);
+    }
+
+  g_free (alternate->name);
+  alternate->name = g_utf8_normalize (fields[ALTERNATES_NAME], -1, G_NORMALIZE_ALL_COMPOSE);
+  alternate->id = id;
+  alternate->preferred = preferred;
 }
 
-static void
-handle_city_line (gchar    **fields,
-                  gpointer   user_data,
-                  GError   **error)
+/* Capitals are included regardless of their population, like in geonames' citiesN.txt */
+static gboolean
+has_min_population (CityData  *data,
+                    gchar    **fields)
+{
+  return strtoul (fields[CITIES_POPULATION], NULL, 10) >= data->min_population ||
+         g_str_equal (fields[CITIES_FEATURE_CODE], "PPLC");
+}
+
+/*
+ * Returns whether the city in fields belongs into the database, and
+ * the indices of its state and country if it does.
+ */
+static gboolean
+lookup_city_state_and_country (CityData  *data,
+                               gchar    **fields,
+                               gpointer  *state,
+                               gpointer  *country)
 {
-  CityData *data = user_data;
   g_autofree gchar *index = NULL;
-  gchar *admin1_id;
-  gchar *country_id;
 
   /* only include cities and villages and ignore sections of other places (PPLX) */
   if (fields[CITIES_FEATURE_CLASS][0] != 'P' ||
-      g_str_equal (fields[CITIES_FEATURE_CODE], "PPLX"))
-    return;
+      g_str_equal (fields[CITIES_FEATURE_CODE], "PPLX") ||
+      !has_min_population (data, fields))
+    return FALSE;
 
   /* The documentation states that "00" is used for cities without a
    * specified admin1 zone. However, it is sometimes set to the empty
@@ -225,220 +524,1994 @@ handle_city_line (gchar    **fields,
    * admin1Codes.txt
    */
   index = g_strdup_printf ("%s.%s", fields[CITIES_COUNTRY_CODE], fields[CITIES_ADMIN1]);
-  admin1_id = g_hash_table_lookup (data->admin1, index);
-  if (!admin1_id)
-    return;
+  if (!g_hash_table_lookup_extended (data->state_indices, index, NULL, state))
+    return FALSE;
 
   /* However, do discard cities without associated countries */
-  country_id = g_hash_table_lookup (data->countries, fields[CITIES_COUNTRY_CODE]);
-  if (!country_id)
+  return g_hash_table_lookup_extended (data->country_indices, fields[CITIES_COUNTRY_CODE], NULL, country);
+}
+
+/* First pass over the cities file, to know which alternate names to keep */
+static void
+handle_city_id_line (gchar    **fields,
+                     gpointer   user_data,
+                     GError   **error)
+{
+  CityData *data = user_data;
+  gpointer state;
+  gpointer country;
+
+  if (lookup_city_state_and_country (data, fields, &state, &country))
+    g_hash_table_add (data->cities_ids, g_strdup (fields[CITIES_ID]));
+}
+
+static void
+handle_city_line (gchar    **fields,
+                  gpointer   user_data,
+                  GError   **error)
+{
+  CityData *data = user_data;
+  g_autofree gchar *timezone = NULL;
+  gpointer state;
+  gpointer country;
+  gpointer timezone_index;
+  City city;
+
+  if (!lookup_city_state_and_country (data, fields, &state, &country))
     return;
 
-  g_hash_table_add (data->cities_ids, g_strdup (fields[CITIES_ID]));
+  timezone = g_utf8_normalize (fields[CITIES_TIMEZONE], -1, G_NORMALIZE_ALL_COMPOSE);
+  if (!g_hash_table_lookup_extended (data->timezones, timezone, NULL, &timezone_index))
+    {
+      if (g_hash_table_size (data->timezones) > G_MAXUINT16)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "too many timezones");
+          return;
+        }
+
+      timezone_index = GUINT_TO_POINTER (g_hash_table_size (data->timezones));
+      g_hash_table_insert (data->timezones, g_strdup (timezone), timezone_index);
+    }
 
   ensure_english_translation (data, fields[CITIES_ID], fields[CITIES_NAME]);
 
-  g_variant_builder_add (&data->builder, "(@ss@ss@ss@sudd)",
-                         variant_new_normalize_string (fields[CITIES_ID]),
-                         get_english_translation (data, fields[CITIES_ID]),
-                         variant_new_normalize_string (fields[CITIES_ADMIN1]),
-                         get_english_translation (data, admin1_id),
-                         variant_new_normalize_string (fields[CITIES_COUNTRY_CODE]),
-                         get_english_translation (data, country_id),
-                         variant_new_normalize_string (fields[CITIES_TIMEZONE]),
-                         strtoul (fields[CITIES_POPULATION], NULL, 10),
-                         g_ascii_strtod (fields[CITIES_LATITUDE], NULL),
-                         g_ascii_strtod (fields[CITIES_LONGITUDE], NULL));
+  city.id = add_normalized_string (data, fields[CITIES_ID]);
+  city.feature_code = add_string (data, fields[CITIES_FEATURE_CODE]);
+  city.state = GPOINTER_TO_UINT (state);
+  city.country = GPOINTER_TO_UINT (country);
+  city.timezone = GPOINTER_TO_UINT (timezone_index);
+  city.population = strtoul (fields[CITIES_POPULATION], NULL, 10);
+  city.latitude = g_ascii_strtod (fields[CITIES_LATITUDE], NULL);
+  city.longitude = g_ascii_strtod (fields[CITIES_LONGITUDE], NULL);
+
+  add_city_tokens (data, data->cities->len, fields[CITIES_ID]);
+  g_ptr_array_add (data->city_names, g_strdup (get_english_translation (data, fields[CITIES_ID])));
+  g_ptr_array_add (data->city_file_names, get_file_name (data, fields[CITIES_ID], fields[CITIES_NAME]));
+  g_array_append_val (data->cities, city);
 }
 
-static gboolean
-parse_geo_names_file (GFile     *file,
-                      guint      n_columns,
-                      void     (*callback) (gchar **, gpointer, GError **),
-                      gpointer   user_data,
-                      GError   **error)
+/* Returns the number of the line in contents that position is on */
+static guint
+get_line_number (const gchar *contents,
+                 const gchar *position)
 {
-  g_autoptr(GFileInputStream) filestream = NULL;
-  g_autoptr(GDataInputStream) datastream = NULL;
-  guint line_nr = 0;
+  const gchar *p;
+  guint line_nr = 1;
 
-  filestream = g_file_read (file, NULL, error);
-  if (filestream == NULL)
-    return FALSE;
+  for (p = contents; p < position; p++)
+    if (*p == '\n')
+      line_nr++;
+
+  return line_nr;
+}
 
-  datastream = g_data_input_stream_new (G_INPUT_STREAM (filestream));
+/*
+ * Calls callback with the fields of every line between start and end
+ * (which must be at the start of a line) that isn't a comment. Lines
+ * are split in place in a buffer that is reused for every line, so
+ * fields are only valid until callback returns. contents is the start
+ * of the file, for line numbers in errors.
+ *
+ * Splitting directly in a mapping of the file would need a private
+ * writable mapping, which copies every page on the first write just the
+ * same and keeps all of them resident until the whole file is parsed.
+ */
+static gboolean
+parse_lines (const gchar  *contents,
+             const gchar  *start,
+             const gchar  *end,
+             guint         n_columns,
+             void        (*callback) (gchar **, gpointer, GError **),
+             gpointer      user_data,
+             GError      **error)
+{
+  g_autoptr(GString) line = NULL;
+  g_autofree gchar **fields = NULL;
+  const gchar *invalid;
 
-  for (;;)
+  if (!g_utf8_validate (start, end - start, &invalid))
     {
-      g_autofree gchar *line = NULL;
-      gsize length;
-      g_auto(GStrv) fields = NULL;
-
-      line = g_data_input_stream_read_line_utf8 (datastream, &length, NULL, error);
-      if (line == NULL)
-        return length == 0 ? TRUE : FALSE;
+      g_set_error (error, G_CONVERT_ERROR, G_CONVERT_ERROR_ILLEGAL_SEQUENCE,
+                   "line %u contains invalid UTF-8", get_line_number (contents, invalid));
+      return FALSE;
+    }
 
-      line_nr++;
+  line = g_string_sized_new (1024);
+  fields = g_new (gchar *, n_columns + 1);
 
-      if (line[0] == '#')
+  while (start < end)
+    {
+      const gchar *line_start = start;
+      const gchar *newline;
+      gchar *field;
+      gchar *tab;
+      guint n_fields;
+      GError *callback_error = NULL;
+
+      newline = memchr (start, '\n', end - start);
+      if (newline == NULL)
+        newline = end;
+
+      g_string_truncate (line, 0);
+      g_string_append_len (line, start, newline - start);
+      start = newline + 1;
+
+      if (line->str[0] == '#')
         continue;
 
-      fields = g_strsplit (line, "\t", 0);
-      if (g_strv_length (fields) != n_columns)
+      field = line->str;
+      n_fields = 0;
+      while (n_fields < n_columns && (tab = strchr (field, '\t')))
+        {
+          *tab = '\0';
+          fields[n_fields++] = field;
+          field = tab + 1;
+        }
+      fields[n_fields++] = field;
+
+      if (n_fields != n_columns)
         {
-          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
-                       "line %u doesn't contain %u fields", line_nr, n_columns);
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "line %u doesn't contain %u fields",
+                       get_line_number (contents, line_start), n_columns);
           return FALSE;
         }
 
-      callback (fields, user_data, error);
+      fields[n_fields] = NULL;
+
+      callback (fields, user_data, &callback_error);
+      if (callback_error)
+        {
+          g_propagate_prefixed_error (error, callback_error, "line %u: ",
+                                      get_line_number (contents, line_start));
+          return FALSE;
+        }
     }
 
   return TRUE;
 }
 
-void
-write_po_file (CityData *data, const gchar *lang, GHashTable *translations)
+/*
+ * Calls callback with the fields of every line in file that isn't a
+ * comment, see parse_lines().
+ */
+static gboolean
+parse_geo_names_file (GFile     *file,
+                      guint      n_columns,
+                      void     (*callback) (gchar **, gpointer, GError **),
+                      gpointer   user_data,
+                      GError   **error)
+{
+  g_autofree gchar *path = NULL;
+  g_autoptr(GMappedFile) mapped = NULL;
+  const gchar *contents;
+
+  path = g_file_get_path (file);
+  mapped = g_mapped_file_new (path, FALSE, error);
+  if (mapped == NULL)
+    return FALSE;
+
+  /* NULL for empty files */
+  contents = g_mapped_file_get_contents (mapped);
+  if (contents == NULL)
+    return TRUE;
+
+  return parse_lines (contents, contents, contents + g_mapped_file_get_length (mapped),
+                      n_columns, callback, user_data, error);
+}
+
+static gpointer
+parse_alternates_chunk (gpointer user_data)
+{
+  AlternatesChunk *chunk = user_data;
+
+  parse_lines (chunk->contents, chunk->start, chunk->end, 8,
+               handle_alternates_line, chunk, &chunk->error);
+
+  return NULL;
+}
+
+/*
+ * Moves the alternate names of a chunk into data->alternates. Like in
+ * handle_alternates_line(), alternate_replaces() decides between names
+ * of the same place, so the result is the same as parsing the file in
+ * one go.
+ */
+static void
+merge_alternates (CityData   *data,
+                  GHashTable *alternates)
 {
-  g_autofree gchar *path;
-  g_autoptr(GIOChannel) po;
-  g_autoptr(GError) error = NULL;
   GHashTableIter iter;
-  gchar *id;
-  gchar *translation;
-  GHashTable *base_lang = NULL;
+  gchar *lang;
+  GHashTable *chunk_places;
 
-  path = g_strdup_printf ("po/%s.po", lang);
-  po = g_io_channel_new_file (path, "w+", &error);
-  if (!po)
+  g_hash_table_iter_init (&iter, alternates);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &lang, (gpointer *) &chunk_places))
     {
-      g_printerr ("Unable to write po file '%s': %s\n", path, error->message);
-      return;
+      GHashTable *places;
+      GHashTableIter place_iter;
+      gchar *id;
+      Alternate *alternate;
+
+      places = g_hash_table_lookup (data->alternates, lang);
+      if (places == NULL)
+        {
+          places = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, alternate_free);
+          g_hash_table_insert (data->alternates, g_strdup (lang), places);
+        }
+
+      g_hash_table_iter_init (&place_iter, chunk_places);
+      while (g_hash_table_iter_next (&place_iter, (gpointer *) &id, (gpointer *) &alternate))
+        {
+          const Alternate *other = g_hash_table_lookup (places, id);
+
+          if (other == NULL || alternate_replaces (alternate->id, alternate->preferred, other))
+            {
+              g_hash_table_iter_steal (&place_iter);
+              g_hash_table_insert (places, id, alternate);
+            }
+        }
     }
+}
+
+/*
+ * Parses alternateNames.txt into data->alternates. The file is split
+ * into n_jobs chunks at line boundaries, which are parsed on separate
+ * threads and merged afterwards.
+ */
+static gboolean
+parse_alternates_file (CityData  *data,
+                       GFile     *file,
+                       guint      n_jobs,
+                       GError   **error)
+{
+  g_autofree gchar *path = NULL;
+  g_autoptr(GMappedFile) mapped = NULL;
+  g_autofree AlternatesChunk *chunks = NULL;
+  g_autofree GThread **threads = NULL;
+  const gchar *contents;
+  const gchar *end;
+  gsize length;
+  gboolean success = TRUE;
+  guint i;
+
+  path = g_file_get_path (file);
+  mapped = g_mapped_file_new (path, FALSE, error);
+  if (mapped == NULL)
+    return FALSE;
+
+  contents = g_mapped_file_get_contents (mapped);
+  if (contents == NULL)
+    return TRUE;
+
+  length = g_mapped_file_get_length (mapped);
+  end = contents + length;
 
-  g_io_channel_write_chars (po, "msgid \"\"\n", -1, NULL, NULL);
-  g_io_channel_write_chars (po, "msgstr \"\"\n", -1, NULL, NULL);
-  g_io_channel_write_chars (po, "\"Project-Id-Version: geonames\\n\"\n", -1, NULL, NULL);
-  g_io_channel_write_chars (po, "\"MIME-Version: 1.0\\n\"\n", -1, NULL, NULL);
-  g_io_channel_write_chars (po, "\"Content-Type: text/plain; charset=UTF-8\\n\"\n", -1, NULL, NULL);
-  g_io_channel_write_chars (po, "\"Content-Transfer-Encoding: 8bit\\n\"\n", -1, NULL, NULL);
+  n_jobs = MAX (n_jobs, 1);
+  chunks = g_new0 (AlternatesChunk, n_jobs);
+  threads = g_new0 (GThread *, n_jobs);
 
-  if (strchr (lang, '_') != NULL)
+  for (i = 0; i < n_jobs; i++)
     {
-      g_autofree gchar *base_lang_name;
-      base_lang_name = g_strdelimit (g_strdup (lang), "_", '\0');
-      base_lang = g_hash_table_lookup (data->alternates, base_lang_name);
+      AlternatesChunk *chunk = &chunks[i];
+
+      chunk->data = data;
+      chunk->contents = contents;
+      chunk->start = i > 0 ? chunks[i - 1].end : contents;
+      chunk->end = end;
+      chunk->alternates = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                 (GDestroyNotify) g_hash_table_unref);
+
+      /* end the chunk after the newline following its share of the file */
+      if (i < n_jobs - 1)
+        {
+          const gchar *p = MAX (chunk->start, contents + length / n_jobs * (i + 1));
+          const gchar *newline = memchr (p, '\n', end - p);
+
+          if (newline)
+            chunk->end = newline + 1;
+        }
     }
 
-  g_hash_table_iter_init (&iter, translations);
-  while (g_hash_table_iter_next (&iter, (gpointer*)&id, (gpointer*)&translation))
-    {
-      g_auto(GStrv) tokens_slash = NULL;
-      g_auto(GStrv) tokens_quote = NULL;
-      g_autofree gchar *translation_slashed = NULL;
-      g_autofree gchar *translation_quoted = NULL;
-      gchar *code;
+  for (i = 1; i < n_jobs; i++)
+    threads[i] = g_thread_new ("alternates", parse_alternates_chunk, &chunks[i]);
+
+  parse_alternates_chunk (&chunks[0]);
+
+  for (i = 1; i < n_jobs; i++)
+    g_thread_join (threads[i]);
 
-      code = g_hash_table_lookup (data->admin1_ids, id);
-      if (code == NULL)
-        code = g_hash_table_lookup (data->countries_ids, id);
-      if (code == NULL)
+  for (i = 0; i < n_jobs; i++)
+    {
+      if (success && chunks[i].error)
         {
-          if (!g_hash_table_contains (data->cities_ids, id))
-            continue; // an airport or some other translation we don't care about
-          code = id;
+          g_propagate_error (error, g_steal_pointer (&chunks[i].error));
+          success = FALSE;
         }
 
-      // optimize a tiny amount by skipping country-specific translations that aren't really specific
-      if (base_lang && g_strcmp0 (g_hash_table_lookup (base_lang, id), translation) == 0)
-        continue;
+      if (success)
+        merge_alternates (data, chunks[i].alternates);
+
+      g_clear_error (&chunks[i].error);
+      g_hash_table_unref (chunks[i].alternates);
+    }
 
-      // Is there not a nicer glib way of replacing parts of strings?
-      tokens_slash = g_strsplit (translation, "\\", -1);
-      translation_slashed = g_strjoinv ("\\\\", tokens_slash);
-      tokens_quote = g_strsplit (translation_slashed, "\"", -1);
-      translation_quoted = g_strjoinv ("\\\"", tokens_quote);
+  return success;
+}
+
+/*
+ * Writes strings as offsets into the string table, and NULL strings as
+ * GEONAMES_DB_NO_TRANSLATION
+ */
+static void
+add_string_table (CityData           *data,
+                  GVariantBuilder    *builder,
+                  const gchar        *key,
+                  const gchar * const *strings,
+                  guint               n_strings)
+{
+  g_autoptr(GArray) offsets = NULL;
+  guint i;
 
-      g_io_channel_write_chars (po, "\n", -1, NULL, NULL);
-      g_io_channel_write_chars (po, "msgid \"", -1, NULL, NULL);
-      g_io_channel_write_chars (po, code, -1, NULL, NULL);
-      g_io_channel_write_chars (po, "\"\n", -1, NULL, NULL);
-      g_io_channel_write_chars (po, "msgstr \"", -1, NULL, NULL);
-      g_io_channel_write_chars (po, translation_quoted, -1, NULL, NULL);
-      g_io_channel_write_chars (po, "\"\n", -1, NULL, NULL);
+  offsets = g_array_sized_new (FALSE, FALSE, sizeof (guint32), n_strings);
+  for (i = 0; i < n_strings; i++)
+    {
+      guint32 offset = strings[i] ? add_string (data, strings[i]) : GEONAMES_DB_NO_TRANSLATION;
+      g_array_append_val (offsets, offset);
     }
+
+  g_variant_builder_add (builder, "{sv}", key,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, offsets->data,
+                                                    offsets->len, sizeof (guint32)));
 }
 
-void
-write_po_files (CityData *data)
+/* Writes the field at field_offset of every city as a fixed array */
+static void
+add_city_column (CityData           *data,
+                 GVariantBuilder    *builder,
+                 const gchar        *key,
+                 const GVariantType *element_type,
+                 gsize               field_offset,
+                 gsize               element_size)
 {
-  GHashTableIter iter;
-  GHashTable *translations;
-  gchar *lang;
+  g_autoptr(GByteArray) column = NULL;
+  guint i;
 
-  g_mkdir ("po", 0755);
+  column = g_byte_array_sized_new (data->cities->len * element_size);
 
-  g_hash_table_iter_init (&iter, data->alternates);
-  while (g_hash_table_iter_next (&iter, (gpointer*)&lang, (gpointer*)&translations))
+  for (i = 0; i < data->cities->len; i++)
     {
-      write_po_file (data, lang, translations);
+      const City *city = &g_array_index (data->cities, City, i);
+
+      g_byte_array_append (column, (const guint8 *) city + field_offset, element_size);
     }
+
+  g_variant_builder_add (builder, "{sv}", key,
+                         g_variant_new_fixed_array (element_type, column->data, data->cities->len, element_size));
 }
 
-int
-main (int argc, char **argv)
+static void
+add_city_columns (CityData        *data,
+                  GVariantBuilder *builder)
+{
+  add_city_column (data, builder, GEONAMES_DB_KEY_CITY_IDS, G_VARIANT_TYPE_UINT32,
+                   G_STRUCT_OFFSET (City, id), sizeof (guint32));
+  add_city_column (data, builder, GEONAMES_DB_KEY_CITY_STATES, G_VARIANT_TYPE_UINT16,
+                   G_STRUCT_OFFSET (City, state), sizeof (guint16));
+  add_city_column (data, builder, GEONAMES_DB_KEY_CITY_COUNTRIES, G_VARIANT_TYPE_UINT16,
+                   G_STRUCT_OFFSET (City, country), sizeof (guint16));
+  add_city_column (data, builder, GEONAMES_DB_KEY_CITY_TIMEZONES, G_VARIANT_TYPE_UINT16,
+                   G_STRUCT_OFFSET (City, timezone), sizeof (guint16));
+  add_city_column (data, builder, GEONAMES_DB_KEY_CITY_POPULATIONS, G_VARIANT_TYPE_UINT32,
+                   G_STRUCT_OFFSET (City, population), sizeof (guint32));
+  add_city_column (data, builder, GEONAMES_DB_KEY_CITY_LATITUDES, G_VARIANT_TYPE_DOUBLE,
+                   G_STRUCT_OFFSET (City, latitude), sizeof (gdouble));
+  add_city_column (data, builder, GEONAMES_DB_KEY_CITY_LONGITUDES, G_VARIANT_TYPE_DOUBLE,
+                   G_STRUCT_OFFSET (City, longitude), sizeof (gdouble));
+  add_city_column (data, builder, GEONAMES_DB_KEY_CITY_FEATURE_CODES, G_VARIANT_TYPE_UINT32,
+                   G_STRUCT_OFFSET (City, feature_code), sizeof (guint32));
+  add_string_table (data, builder, GEONAMES_DB_KEY_CITY_FILE_NAMES,
+                    (const gchar * const *) data->city_file_names->pdata, data->city_file_names->len);
+}
+
+static gint
+compare_strings (gconstpointer a,
+                 gconstpointer b)
+{
+  return strcmp (*(const gchar **) a, *(const gchar **) b);
+}
+
+typedef struct
+{
+  guint64 trigram;
+  guint32 token;
+} TokenTrigram;
+
+static gint
+compare_token_trigrams (gconstpointer a,
+                        gconstpointer b)
+{
+  const TokenTrigram *trigram_a = a;
+  const TokenTrigram *trigram_b = b;
+
+  if (trigram_a->trigram != trigram_b->trigram)
+    return trigram_a->trigram < trigram_b->trigram ? -1 : 1;
+
+  return (trigram_a->token > trigram_b->token) - (trigram_a->token < trigram_b->token);
+}
+
+/* Writes the trigram index of the n_tokens tokens of the (sorted) token table */
+static void
+add_trigram_index (gchar           **tokens,
+                   guint             n_tokens,
+                   GVariantBuilder  *builder)
+{
+  g_autoptr(GArray) token_trigrams = NULL;
+  g_autoptr(GArray) trigrams = NULL;
+  g_autoptr(GArray) trigram_offsets = NULL;
+  g_autoptr(GArray) trigram_tokens = NULL;
+  guint i;
+
+  token_trigrams = g_array_new (FALSE, FALSE, sizeof (TokenTrigram));
+
+  for (i = 0; i < n_tokens; i++)
+    {
+      gunichar a = 0;
+      gunichar b = 0;
+      const gchar *p;
+
+      for (p = tokens[i]; *p; p = g_utf8_next_char (p))
+        {
+          gunichar c = g_utf8_get_char (p);
+          TokenTrigram trigram = { geonames_db_trigram (a, b, c), i };
+
+          g_array_append_val (token_trigrams, trigram);
+          a = b;
+          b = c;
+        }
+    }
+
+  g_array_sort (token_trigrams, compare_token_trigrams);
+
+  trigrams = g_array_new (FALSE, FALSE, sizeof (guint64));
+  trigram_offsets = g_array_new (FALSE, FALSE, sizeof (guint32));
+  trigram_tokens = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  for (i = 0; i < token_trigrams->len; i++)
+    {
+      const TokenTrigram *trigram = &g_array_index (token_trigrams, TokenTrigram, i);
+
+      if (i == 0 || trigram->trigram != (trigram - 1)->trigram)
+        {
+          g_array_append_val (trigrams, trigram->trigram);
+          g_array_append_val (trigram_offsets, trigram_tokens->len);
+        }
+      else if (trigram->token == (trigram - 1)->token)
+        {
+          /* the trigram occurs more than once in that token */
+          continue;
+        }
+
+      g_array_append_val (trigram_tokens, trigram->token);
+    }
+
+  g_array_append_val (trigram_offsets, trigram_tokens->len);
+
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_TRIGRAMS,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT64, trigrams->data,
+                                                    trigrams->len, sizeof (guint64)));
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_TRIGRAM_OFFSETS,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, trigram_offsets->data,
+                                                    trigram_offsets->len, sizeof (guint32)));
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_TRIGRAM_TOKENS,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, trigram_tokens->data,
+                                                    trigram_tokens->len, sizeof (guint32)));
+}
+
+/* Returns a table mapping each token to its index in the token table */
+static GHashTable *
+add_token_index (CityData        *data,
+                 GVariantBuilder *builder)
+{
+  GHashTable *token_ids;
+  g_autofree gchar **tokens = NULL;
+  g_autoptr(GByteArray) strings = NULL;
+  g_autoptr(GArray) token_offsets = NULL;
+  g_autoptr(GArray) posting_offsets = NULL;
+  g_autoptr(GArray) postings = NULL;
+  guint n_tokens;
+  guint i;
+
+  tokens = (gchar **) g_hash_table_get_keys_as_array (data->tokens, &n_tokens);
+  qsort (tokens, n_tokens, sizeof (gchar *), compare_strings);
+
+  token_ids = g_hash_table_new (g_str_hash, g_str_equal);
+  strings = g_byte_array_new ();
+  token_offsets = g_array_sized_new (FALSE, FALSE, sizeof (guint32), n_tokens);
+  posting_offsets = g_array_sized_new (FALSE, FALSE, sizeof (guint32), n_tokens + 1);
+  postings = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  for (i = 0; i < n_tokens; i++)
+    {
+      GArray *rows = g_hash_table_lookup (data->tokens, tokens[i]);
+      guint32 offset;
+
+      g_hash_table_insert (token_ids, tokens[i], GUINT_TO_POINTER (i));
+
+      offset = strings->len;
+      g_array_append_val (token_offsets, offset);
+      g_byte_array_append (strings, (const guint8 *) tokens[i], strlen (tokens[i]) + 1);
+
+      offset = postings->len;
+      g_array_append_val (posting_offsets, offset);
+      g_array_append_vals (postings, rows->data, rows->len);
+    }
+
+  g_array_append_val (posting_offsets, postings->len);
+
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_TOKENS,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, strings->data, strings->len, 1));
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_TOKEN_OFFSETS,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, token_offsets->data,
+                                                    token_offsets->len, sizeof (guint32)));
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_POSTING_OFFSETS,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, posting_offsets->data,
+                                                    posting_offsets->len, sizeof (guint32)));
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_POSTINGS,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, postings->data,
+                                                    postings->len, sizeof (guint32)));
+
+  add_trigram_index (tokens, n_tokens, builder);
+
+  return token_ids;
+}
+
+/* Returns a table mapping each name to its index in the name table */
+static GHashTable *
+add_name_table (CityData        *data,
+                GHashTable      *token_ids,
+                GVariantBuilder *builder)
+{
+  g_autofree gchar **names = NULL;
+  GHashTable *name_ids;
+  g_autoptr(GByteArray) strings = NULL;
+  g_autoptr(GArray) name_offsets = NULL;
+  g_autoptr(GArray) name_token_offsets = NULL;
+  g_autoptr(GArray) name_tokens = NULL;
+  g_autoptr(GArray) name_ascii_tokens = NULL;
+  g_autoptr(GArray) name_token_prefixes = NULL;
+  g_autoptr(GArray) name_ascii_token_prefixes = NULL;
+  g_autoptr(GArray) city_names = NULL;
+  guint n_names;
+  guint32 offset;
+  guint i;
+
+  names = (gchar **) g_hash_table_get_keys_as_array (data->names, &n_names);
+  qsort (names, n_names, sizeof (gchar *), compare_strings);
+
+  name_ids = g_hash_table_new (g_str_hash, g_str_equal);
+  strings = g_byte_array_new ();
+  name_offsets = g_array_sized_new (FALSE, FALSE, sizeof (guint32), n_names);
+  name_token_offsets = g_array_sized_new (FALSE, FALSE, sizeof (guint32), n_names + 1);
+  name_tokens = g_array_new (FALSE, FALSE, sizeof (guint32));
+  name_ascii_tokens = g_array_new (FALSE, FALSE, sizeof (guint32));
+  name_token_prefixes = g_array_new (FALSE, FALSE, sizeof (guint64));
+  name_ascii_token_prefixes = g_array_new (FALSE, FALSE, sizeof (guint64));
+
+  for (i = 0; i < n_names; i++)
+    {
+      g_auto(GStrv) tokens = NULL;
+      g_autofree gchar **ascii_tokens = NULL;
+      guint j;
+
+      g_hash_table_insert (name_ids, names[i], GUINT_TO_POINTER (i));
+
+      offset = strings->len;
+      g_array_append_val (name_offsets, offset);
+      g_byte_array_append (strings, (const guint8 *) names[i], strlen (names[i]) + 1);
+
+      offset = name_tokens->len;
+      g_array_append_val (name_token_offsets, offset);
+
+      tokens = tokenize_name (names[i], &ascii_tokens);
+      for (j = 0; tokens[j]; j++)
+        {
+          guint32 id;
+          guint32 ascii_id = GEONAMES_DB_NO_TOKEN;
+          guint64 prefix;
+          guint64 ascii_prefix = 0;
+
+          id = GPOINTER_TO_UINT (g_hash_table_lookup (token_ids, tokens[j]));
+          prefix = geonames_db_token_prefix (tokens[j]);
+
+          if (ascii_tokens[j])
+            {
+              ascii_id = GPOINTER_TO_UINT (g_hash_table_lookup (token_ids, ascii_tokens[j]));
+              ascii_prefix = geonames_db_token_prefix (ascii_tokens[j]);
+              g_free (ascii_tokens[j]);
+            }
+
+          g_array_append_val (name_tokens, id);
+          g_array_append_val (name_ascii_tokens, ascii_id);
+          g_array_append_val (name_token_prefixes, prefix);
+          g_array_append_val (name_ascii_token_prefixes, ascii_prefix);
+        }
+    }
+
+  offset = name_tokens->len;
+  g_array_append_val (name_token_offsets, offset);
+
+  city_names = g_array_sized_new (FALSE, FALSE, sizeof (guint32), data->city_names->len);
+  for (i = 0; i < data->city_names->len; i++)
+    {
+      guint32 id;
+
+      id = GPOINTER_TO_UINT (g_hash_table_lookup (name_ids, g_ptr_array_index (data->city_names, i)));
+      g_array_append_val (city_names, id);
+    }
+
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_NAMES,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, strings->data, strings->len, 1));
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_NAME_OFFSETS,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, name_offsets->data,
+                                                    name_offsets->len, sizeof (guint32)));
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_NAME_TOKEN_OFFSETS,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, name_token_offsets->data,
+                                                    name_token_offsets->len, sizeof (guint32)));
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_NAME_TOKENS,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, name_tokens->data,
+                                                    name_tokens->len, sizeof (guint32)));
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_NAME_ASCII_TOKENS,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, name_ascii_tokens->data,
+                                                    name_ascii_tokens->len, sizeof (guint32)));
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_NAME_TOKEN_PREFIXES,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT64, name_token_prefixes->data,
+                                                    name_token_prefixes->len, sizeof (guint64)));
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_NAME_ASCII_TOKEN_PREFIXES,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT64, name_ascii_token_prefixes->data,
+                                                    name_ascii_token_prefixes->len, sizeof (guint64)));
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_CITY_NAMES,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, city_names->data,
+                                                    city_names->len, sizeof (guint32)));
+
+  return name_ids;
+}
+
+typedef struct
+{
+  guint32 row;
+  gdouble point[3];
+} SpatialNode;
+
+static gint
+compare_spatial_nodes (gconstpointer a,
+                       gconstpointer b,
+                       gpointer      user_data)
+{
+  const SpatialNode *node_a = a;
+  const SpatialNode *node_b = b;
+  guint axis = GPOINTER_TO_UINT (user_data);
+
+  if (node_a->point[axis] != node_b->point[axis])
+    return node_a->point[axis] < node_b->point[axis] ? -1 : 1;
+
+  return (node_a->row > node_b->row) - (node_a->row < node_b->row);
+}
+
+/*
+ * Arranges nodes into an implicit k-d tree: the middle node of the
+ * range splits it on axis depth % 3, so that all nodes before it have
+ * smaller and all nodes after it larger coordinates on that axis.
+ */
+static void
+build_spatial_tree (SpatialNode *nodes,
+                    guint        n_nodes,
+                    guint        depth)
+{
+  guint mid;
+
+  if (n_nodes <= 1)
+    return;
+
+  g_qsort_with_data (nodes, n_nodes, sizeof (SpatialNode), compare_spatial_nodes, GUINT_TO_POINTER (depth % 3));
+
+  mid = n_nodes / 2;
+  build_spatial_tree (nodes, mid, depth + 1);
+  build_spatial_tree (nodes + mid + 1, n_nodes - mid - 1, depth + 1);
+}
+
+static void
+add_spatial_index (CityData        *data,
+                   GVariantBuilder *builder)
+{
+  g_autofree SpatialNode *nodes = NULL;
+  g_autoptr(GArray) rows = NULL;
+  g_autoptr(GArray) points = NULL;
+  guint i;
+
+  nodes = g_new (SpatialNode, data->cities->len);
+  for (i = 0; i < data->cities->len; i++)
+    {
+      const City *city = &g_array_index (data->cities, City, i);
+
+      nodes[i].row = i;
+      geonames_db_point_from_coordinates (city->latitude, city->longitude, nodes[i].point);
+    }
+
+  build_spatial_tree (nodes, data->cities->len, 0);
+
+  rows = g_array_sized_new (FALSE, FALSE, sizeof (guint32), data->cities->len);
+  points = g_array_sized_new (FALSE, FALSE, sizeof (gdouble), 3 * data->cities->len);
+  for (i = 0; i < data->cities->len; i++)
+    {
+      g_array_append_val (rows, nodes[i].row);
+      g_array_append_vals (points, nodes[i].point, 3);
+    }
+
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_SPATIAL_ROWS,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, rows->data,
+                                                    rows->len, sizeof (guint32)));
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_SPATIAL_POINTS,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_DOUBLE, points->data,
+                                                    points->len, sizeof (gdouble)));
+}
+
+static gint
+compare_grid_rows (gconstpointer a,
+                   gconstpointer b,
+                   gpointer      user_data)
+{
+  GArray *cities = user_data;
+  guint32 row_a = *(const guint32 *) a;
+  guint32 row_b = *(const guint32 *) b;
+  guint32 population_a = g_array_index (cities, City, row_a).population;
+  guint32 population_b = g_array_index (cities, City, row_b).population;
+
+  if (population_a != population_b)
+    return population_a > population_b ? -1 : 1;
+
+  return (row_a > row_b) - (row_a < row_b);
+}
+
+static void
+add_grid_index (CityData        *data,
+                GVariantBuilder *builder)
+{
+  g_autoptr(GArray) offsets = NULL;
+  g_autoptr(GArray) rows = NULL;
+  g_autofree guint32 *cells = NULL;
+  g_autofree guint32 *next = NULL;
+  guint32 i;
+
+  cells = g_new (guint32, data->cities->len);
+  offsets = g_array_sized_new (FALSE, TRUE, sizeof (guint32), GEONAMES_DB_GRID_CELLS + 1);
+  g_array_set_size (offsets, GEONAMES_DB_GRID_CELLS + 1);
+
+  /* count the cities in each cell, then turn counts into offsets */
+  for (i = 0; i < data->cities->len; i++)
+    {
+      const City *city = &g_array_index (data->cities, City, i);
+
+      cells[i] = geonames_db_grid_latitude_cell (city->latitude) * GEONAMES_DB_GRID_LONGITUDE_CELLS +
+                 geonames_db_grid_longitude_cell (city->longitude);
+      g_array_index (offsets, guint32, cells[i] + 1)++;
+    }
+
+  for (i = 1; i <= GEONAMES_DB_GRID_CELLS; i++)
+    g_array_index (offsets, guint32, i) += g_array_index (offsets, guint32, i - 1);
+
+  rows = g_array_sized_new (FALSE, FALSE, sizeof (guint32), data->cities->len);
+  g_array_set_size (rows, data->cities->len);
+
+  next = g_new (guint32, GEONAMES_DB_GRID_CELLS);
+  memcpy (next, offsets->data, GEONAMES_DB_GRID_CELLS * sizeof (guint32));
+
+  for (i = 0; i < data->cities->len; i++)
+    g_array_index (rows, guint32, next[cells[i]]++) = i;
+
+  for (i = 0; i < GEONAMES_DB_GRID_CELLS; i++)
+    {
+      guint32 first = g_array_index (offsets, guint32, i);
+      guint32 last = g_array_index (offsets, guint32, i + 1);
+
+      g_qsort_with_data (&g_array_index (rows, guint32, first), last - first, sizeof (guint32),
+                         compare_grid_rows, data->cities);
+    }
+
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_GRID_OFFSETS,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, offsets->data,
+                                                    offsets->len, sizeof (guint32)));
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_GRID_ROWS,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, rows->data,
+                                                    rows->len, sizeof (guint32)));
+}
+
+/* Minimum population of each tier, see GEONAMES_DB_KEY_TIER_OFFSETS */
+static const guint32 tier_min_populations[] = { 100000, 10000, 1000, 0 };
+
+static guint
+get_tier (guint32 population)
+{
+  guint tier = 0;
+
+  while (population < tier_min_populations[tier])
+    tier++;
+
+  return tier;
+}
+
+static gint
+compare_uint32 (gconstpointer a,
+                gconstpointer b)
+{
+  guint32 ia = *(const guint32 *) a;
+  guint32 ib = *(const guint32 *) b;
+
+  return (ia > ib) - (ia < ib);
+}
+
+/*
+ * Orders cities by tier, keeping the order of the cities file within
+ * each tier, and renumbers the rows in the token index to match. Must
+ * be called before anything else refers to cities by their row.
+ */
+static void
+sort_cities_into_tiers (CityData *data)
+{
+  guint32 offsets[G_N_ELEMENTS (tier_min_populations) + 1] = { 0, };
+  g_autofree guint32 *new_rows = NULL;
+  GArray *cities;
+  GPtrArray *city_names;
+  GPtrArray *city_file_names;
+  GHashTableIter iter;
+  GArray *rows;
+  guint i, j;
+
+  for (i = 0; i < data->cities->len; i++)
+    offsets[get_tier (g_array_index (data->cities, City, i).population) + 1]++;
+
+  for (i = 1; i < G_N_ELEMENTS (offsets); i++)
+    offsets[i] += offsets[i - 1];
+
+  new_rows = g_new (guint32, data->cities->len);
+  cities = g_array_sized_new (FALSE, FALSE, sizeof (City), data->cities->len);
+  g_array_set_size (cities, data->cities->len);
+  city_names = g_ptr_array_new_full (data->cities->len, g_free);
+  g_ptr_array_set_size (city_names, data->cities->len);
+  city_file_names = g_ptr_array_new_full (data->cities->len, g_free);
+  g_ptr_array_set_size (city_file_names, data->cities->len);
+
+  for (i = 0; i < data->cities->len; i++)
+    {
+      const City *city = &g_array_index (data->cities, City, i);
+
+      new_rows[i] = offsets[get_tier (city->population)]++;
+      g_array_index (cities, City, new_rows[i]) = *city;
+      g_ptr_array_index (city_names, new_rows[i]) = g_steal_pointer (&g_ptr_array_index (data->city_names, i));
+      g_ptr_array_index (city_file_names, new_rows[i]) = g_steal_pointer (&g_ptr_array_index (data->city_file_names, i));
+    }
+
+  g_array_unref (data->cities);
+  data->cities = cities;
+  g_ptr_array_unref (data->city_names);
+  data->city_names = city_names;
+  g_ptr_array_unref (data->city_file_names);
+  data->city_file_names = city_file_names;
+
+  g_hash_table_iter_init (&iter, data->tokens);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &rows))
+    {
+      for (j = 0; j < rows->len; j++)
+        g_array_index (rows, guint32, j) = new_rows[g_array_index (rows, guint32, j)];
+
+      g_array_sort (rows, compare_uint32);
+    }
+}
+
+/* Writes the first row, minimum and largest population of each non-empty tier */
+static void
+add_tier_table (CityData        *data,
+                GVariantBuilder *builder)
+{
+  g_autoptr(GArray) offsets = NULL;
+  g_autoptr(GArray) min_populations = NULL;
+  g_autoptr(GArray) populations = NULL;
+  guint32 n_cities = data->cities->len;
+  guint32 i;
+
+  offsets = g_array_new (FALSE, FALSE, sizeof (guint32));
+  min_populations = g_array_new (FALSE, FALSE, sizeof (guint32));
+  populations = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  for (i = 0; i < n_cities; i++)
+    {
+      const City *city = &g_array_index (data->cities, City, i);
+      guint tier = get_tier (city->population);
+
+      if (i == 0 || tier != get_tier ((city - 1)->population))
+        {
+          g_array_append_val (offsets, i);
+          g_array_append_val (min_populations, tier_min_populations[tier]);
+          g_array_append_val (populations, city->population);
+        }
+      else if (city->population > g_array_index (populations, guint32, populations->len - 1))
+        {
+          g_array_index (populations, guint32, populations->len - 1) = city->population;
+        }
+    }
+
+  g_array_append_val (offsets, n_cities);
+
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_TIER_OFFSETS,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, offsets->data,
+                                                    offsets->len, sizeof (guint32)));
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_TIER_MIN_POPULATIONS,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, min_populations->data,
+                                                    min_populations->len, sizeof (guint32)));
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_TIER_POPULATIONS,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, populations->data,
+                                                    populations->len, sizeof (guint32)));
+}
+
+/*
+ * Returns the keys of table in sorted order and sets indices to a
+ * table mapping each key to its position.
+ */
+static gchar **
+sort_keys (GHashTable  *table,
+           guint       *n_keys,
+           GHashTable **indices)
+{
+  gchar **keys;
+  guint i;
+
+  keys = (gchar **) g_hash_table_get_keys_as_array (table, n_keys);
+  qsort (keys, *n_keys, sizeof (gchar *), compare_strings);
+
+  *indices = g_hash_table_new (g_str_hash, g_str_equal);
+  for (i = 0; i < *n_keys; i++)
+    g_hash_table_insert (*indices, keys[i], GUINT_TO_POINTER (i));
+
+  return keys;
+}
+
+/*
+ * Writes the states and countries tables, with the geonames id, English
+ * name and name in the admin1 or countries file of each of them.
+ */
+static void
+add_state_and_country_tables (CityData        *data,
+                              GVariantBuilder *builder)
+{
+  g_autofree const gchar **ids = NULL;
+  g_autofree const gchar **names = NULL;
+  g_autoptr(GPtrArray) file_names = NULL;
+  guint i;
+
+  ids = g_new (const gchar *, MAX (data->n_states, data->n_countries));
+  names = g_new (const gchar *, MAX (data->n_states, data->n_countries));
+  file_names = g_ptr_array_new_with_free_func (g_free);
+
+  for (i = 0; i < data->n_states; i++)
+    {
+      ids[i] = g_hash_table_lookup (data->admin1, data->states[i]);
+      names[i] = get_english_translation (data, ids[i]);
+      g_ptr_array_add (file_names, get_file_name (data, ids[i], g_hash_table_lookup (data->english_names, ids[i])));
+    }
+
+  add_string_table (data, builder, GEONAMES_DB_KEY_STATES, (const gchar * const *) data->states, data->n_states);
+  add_string_table (data, builder, GEONAMES_DB_KEY_STATE_IDS, ids, data->n_states);
+  add_string_table (data, builder, GEONAMES_DB_KEY_STATE_NAMES, names, data->n_states);
+  add_string_table (data, builder, GEONAMES_DB_KEY_STATE_FILE_NAMES,
+                    (const gchar * const *) file_names->pdata, data->n_states);
+
+  g_ptr_array_set_size (file_names, 0);
+
+  for (i = 0; i < data->n_countries; i++)
+    {
+      ids[i] = g_hash_table_lookup (data->countries, data->country_codes[i]);
+      names[i] = get_english_translation (data, ids[i]);
+      g_ptr_array_add (file_names, get_file_name (data, ids[i], g_hash_table_lookup (data->english_names, ids[i])));
+    }
+
+  add_string_table (data, builder, GEONAMES_DB_KEY_COUNTRIES, (const gchar * const *) data->country_codes, data->n_countries);
+  add_string_table (data, builder, GEONAMES_DB_KEY_COUNTRY_IDS, ids, data->n_countries);
+  add_string_table (data, builder, GEONAMES_DB_KEY_COUNTRY_NAMES, names, data->n_countries);
+  add_string_table (data, builder, GEONAMES_DB_KEY_COUNTRY_FILE_NAMES,
+                    (const gchar * const *) file_names->pdata, data->n_countries);
+}
+
+static void
+add_timezone_table (CityData        *data,
+                    GVariantBuilder *builder)
+{
+  g_autofree const gchar **timezones = NULL;
+  GHashTableIter iter;
+  gpointer timezone, index;
+
+  timezones = g_new (const gchar *, g_hash_table_size (data->timezones));
+
+  g_hash_table_iter_init (&iter, data->timezones);
+  while (g_hash_table_iter_next (&iter, &timezone, &index))
+    timezones[GPOINTER_TO_UINT (index)] = timezone;
+
+  add_string_table (data, builder, GEONAMES_DB_KEY_TIMEZONES, timezones, g_hash_table_size (data->timezones));
+}
+
+typedef struct
+{
+  GArray *offsets;
+  GArray *keys;
+  GArray *values;
+  GArray *sources;
+} TranslationTable;
+
+static void
+translation_table_init (TranslationTable *table)
+{
+  const guint32 zero = 0;
+
+  table->offsets = g_array_new (FALSE, FALSE, sizeof (guint32));
+  table->keys = g_array_new (FALSE, FALSE, sizeof (guint32));
+  table->values = g_array_new (FALSE, FALSE, sizeof (guint32));
+  table->sources = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  g_array_append_val (table->offsets, zero);
+}
+
+static void
+translation_table_add (TranslationTable *table,
+                       guint32           key,
+                       guint32           value,
+                       const Alternate  *alternate)
+{
+  guint32 source = alternate->id;
+
+  if (alternate->preferred)
+    source |= GEONAMES_DB_SOURCE_PREFERRED;
+
+  g_array_append_val (table->keys, key);
+  g_array_append_val (table->values, value);
+  g_array_append_val (table->sources, source);
+}
+
+/* Ends the translations of the current language */
+static void
+translation_table_end_language (TranslationTable *table)
+{
+  g_array_append_val (table->offsets, table->keys->len);
+}
+
+static void
+translation_table_write (TranslationTable *table,
+                         GVariantBuilder  *builder,
+                         const gchar      *offsets_key,
+                         const gchar      *keys_key,
+                         const gchar      *values_key,
+                         const gchar      *sources_key)
+{
+  g_variant_builder_add (builder, "{sv}", offsets_key,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, table->offsets->data,
+                                                    table->offsets->len, sizeof (guint32)));
+  g_variant_builder_add (builder, "{sv}", keys_key,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, table->keys->data,
+                                                    table->keys->len, sizeof (guint32)));
+  g_variant_builder_add (builder, "{sv}", values_key,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, table->values->data,
+                                                    table->values->len, sizeof (guint32)));
+  g_variant_builder_add (builder, "{sv}", sources_key,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, table->sources->data,
+                                                    table->sources->len, sizeof (guint32)));
+
+  g_array_unref (table->offsets);
+  g_array_unref (table->keys);
+  g_array_unref (table->values);
+  g_array_unref (table->sources);
+}
+
+/*
+ * Returns the translation of the place with geonames id in lang, or
+ * NULL if lang doesn't have a translation or it's the same as in the
+ * base language of lang (for example, "fr" for "fr_CA").
+ */
+static const Alternate *
+lookup_translation (CityData    *data,
+                    const gchar *lang,
+                    GHashTable  *places,
+                    const gchar *id)
+{
+  const Alternate *translation;
+  const gchar *underscore;
+
+  translation = g_hash_table_lookup (places, id);
+  if (translation == NULL)
+    return NULL;
+
+  underscore = strchr (lang, '_');
+  if (underscore != NULL)
+    {
+      g_autofree gchar *base_lang_name = g_strndup (lang, underscore - lang);
+      GHashTable *base_lang = g_hash_table_lookup (data->alternates, base_lang_name);
+      const Alternate *base_translation = base_lang ? g_hash_table_lookup (base_lang, id) : NULL;
+
+      if (base_translation && g_str_equal (base_translation->name, translation->name))
+        return NULL;
+    }
+
+  return translation;
+}
+
+/* A translation of the place with index key in its table */
+typedef struct
+{
+  guint32 key;
+  const Alternate *alternate;
+} PlaceTranslation;
+
+static gint
+compare_place_translations (gconstpointer a,
+                            gconstpointer b)
+{
+  guint32 key_a = ((const PlaceTranslation *) a)->key;
+  guint32 key_b = ((const PlaceTranslation *) b)->key;
+
+  return (key_a > key_b) - (key_a < key_b);
+}
+
+/* Adds the translation of the place with id to translations, if index has it */
+static void
+add_place_translation (CityData    *data,
+                       const gchar *lang,
+                       GHashTable  *places,
+                       const gchar *id,
+                       GHashTable  *index,
+                       GArray      *translations)
+{
+  PlaceTranslation translation;
+  gpointer key;
+
+  if (!g_hash_table_lookup_extended (index, id, NULL, &key))
+    return;
+
+  translation.key = GPOINTER_TO_UINT (key);
+  translation.alternate = lookup_translation (data, lang, places, id);
+  if (translation.alternate)
+    g_array_append_val (translations, translation);
+}
+
+/*
+ * Writes the per-language translation tables of cities, states and
+ * countries. The tables of a language are built from its alternate
+ * names, which are only kept for places in the database, so that
+ * languages with few names don't cost a pass over all places.
+ */
+static void
+add_translation_tables (CityData        *data,
+                        GHashTable      *name_ids,
+                        GVariantBuilder *builder)
+{
+  g_autofree gchar **languages = NULL;
+  g_autoptr(GByteArray) language_names = NULL;
+  g_autoptr(GArray) language_offsets = NULL;
+  g_autoptr(GHashTable) city_rows = NULL;
+  g_autoptr(GHashTable) state_rows = NULL;
+  g_autoptr(GHashTable) country_rows = NULL;
+  g_autoptr(GArray) cities = NULL;
+  g_autoptr(GArray) states = NULL;
+  g_autoptr(GArray) countries = NULL;
+  TranslationTable city_translations;
+  TranslationTable state_translations;
+  TranslationTable country_translations;
+  guint n_languages;
+  guint i;
+
+  languages = (gchar **) g_hash_table_get_keys_as_array (data->alternates, &n_languages);
+  qsort (languages, n_languages, sizeof (gchar *), compare_strings);
+
+  /* geonames id -> index of each place, in the table of its kind */
+  city_rows = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  for (i = 0; i < data->cities->len; i++)
+    {
+      const City *city = &g_array_index (data->cities, City, i);
+
+      g_hash_table_insert (city_rows, g_strdup ((const gchar *) data->string_data->data + city->id),
+                           GUINT_TO_POINTER (i));
+    }
+
+  state_rows = g_hash_table_new (g_str_hash, g_str_equal);
+  for (i = 0; i < data->n_states; i++)
+    g_hash_table_insert (state_rows, g_hash_table_lookup (data->admin1, data->states[i]), GUINT_TO_POINTER (i));
+
+  country_rows = g_hash_table_new (g_str_hash, g_str_equal);
+  for (i = 0; i < data->n_countries; i++)
+    g_hash_table_insert (country_rows, g_hash_table_lookup (data->countries, data->country_codes[i]), GUINT_TO_POINTER (i));
+
+  language_names = g_byte_array_new ();
+  language_offsets = g_array_new (FALSE, FALSE, sizeof (guint32));
+  cities = g_array_new (FALSE, FALSE, sizeof (PlaceTranslation));
+  states = g_array_new (FALSE, FALSE, sizeof (PlaceTranslation));
+  countries = g_array_new (FALSE, FALSE, sizeof (PlaceTranslation));
+  translation_table_init (&city_translations);
+  translation_table_init (&state_translations);
+  translation_table_init (&country_translations);
+
+  for (i = 0; i < n_languages; i++)
+    {
+      GHashTable *places = g_hash_table_lookup (data->alternates, languages[i]);
+      GHashTableIter iter;
+      const gchar *id;
+      guint n_entries;
+      guint32 offset;
+      guint j;
+
+      n_entries = city_translations.keys->len + state_translations.keys->len + country_translations.keys->len;
+
+      g_array_set_size (cities, 0);
+      g_array_set_size (states, 0);
+      g_array_set_size (countries, 0);
+
+      g_hash_table_iter_init (&iter, places);
+      while (g_hash_table_iter_next (&iter, (gpointer *) &id, NULL))
+        {
+          add_place_translation (data, languages[i], places, id, city_rows, cities);
+          add_place_translation (data, languages[i], places, id, state_rows, states);
+          add_place_translation (data, languages[i], places, id, country_rows, countries);
+        }
+
+      /* sorted, so that strings are added in the same order every time */
+      g_array_sort (cities, compare_place_translations);
+      g_array_sort (states, compare_place_translations);
+      g_array_sort (countries, compare_place_translations);
+
+      for (j = 0; j < cities->len; j++)
+        {
+          const PlaceTranslation *translation = &g_array_index (cities, PlaceTranslation, j);
+          gpointer name;
+
+          if (g_hash_table_lookup_extended (name_ids, translation->alternate->name, NULL, &name))
+            translation_table_add (&city_translations, translation->key, GPOINTER_TO_UINT (name), translation->alternate);
+        }
+
+      for (j = 0; j < states->len; j++)
+        {
+          const PlaceTranslation *translation = &g_array_index (states, PlaceTranslation, j);
+
+          translation_table_add (&state_translations, translation->key,
+                                 add_string (data, translation->alternate->name), translation->alternate);
+        }
+
+      for (j = 0; j < countries->len; j++)
+        {
+          const PlaceTranslation *translation = &g_array_index (countries, PlaceTranslation, j);
+
+          translation_table_add (&country_translations, translation->key,
+                                 add_string (data, translation->alternate->name), translation->alternate);
+        }
+
+      /* skip languages that don't translate any of the places */
+      if (n_entries == city_translations.keys->len + state_translations.keys->len + country_translations.keys->len)
+        continue;
+
+      offset = language_names->len;
+      g_array_append_val (language_offsets, offset);
+      g_byte_array_append (language_names, (const guint8 *) languages[i], strlen (languages[i]) + 1);
+
+      translation_table_end_language (&city_translations);
+      translation_table_end_language (&state_translations);
+      translation_table_end_language (&country_translations);
+    }
+
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_LANGUAGES,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, language_names->data,
+                                                    language_names->len, 1));
+  g_variant_builder_add (builder, "{sv}", GEONAMES_DB_KEY_LANGUAGE_OFFSETS,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, language_offsets->data,
+                                                    language_offsets->len, sizeof (guint32)));
+
+  translation_table_write (&city_translations, builder,
+                           GEONAMES_DB_KEY_CITY_TRANSLATION_OFFSETS,
+                           GEONAMES_DB_KEY_CITY_TRANSLATION_KEYS,
+                           GEONAMES_DB_KEY_CITY_TRANSLATION_VALUES,
+                           GEONAMES_DB_KEY_CITY_TRANSLATION_SOURCES);
+  translation_table_write (&state_translations, builder,
+                           GEONAMES_DB_KEY_STATE_TRANSLATION_OFFSETS,
+                           GEONAMES_DB_KEY_STATE_TRANSLATION_KEYS,
+                           GEONAMES_DB_KEY_STATE_TRANSLATION_VALUES,
+                           GEONAMES_DB_KEY_STATE_TRANSLATION_SOURCES);
+  translation_table_write (&country_translations, builder,
+                           GEONAMES_DB_KEY_COUNTRY_TRANSLATION_OFFSETS,
+                           GEONAMES_DB_KEY_COUNTRY_TRANSLATION_KEYS,
+                           GEONAMES_DB_KEY_COUNTRY_TRANSLATION_VALUES,
+                           GEONAMES_DB_KEY_COUNTRY_TRANSLATION_SOURCES);
+}
+
+/* Cities refer to states and countries by their index in these tables */
+static gboolean
+index_states_and_countries (CityData  *data,
+                            GError   **error)
+{
+  data->states = sort_keys (data->admin1, &data->n_states, &data->state_indices);
+  data->country_codes = sort_keys (data->countries, &data->n_countries, &data->country_indices);
+  if (data->n_states > G_MAXUINT16 + 1 || data->n_countries > G_MAXUINT16 + 1)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Too many states or countries");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/*
+ * Returns the population that places in the cities file at cities_path
+ * have at least. geonames' citiesN.txt contain capitals and places with
+ * more than N inhabitants, other files (like allCountries.txt) are not
+ * filtered by population.
+ */
+static guint32
+get_cities_file_min_population (const gchar *cities_path)
+{
+  g_autofree gchar *basename = NULL;
+  const gchar *number;
+  gchar *end;
+  guint64 n;
+
+  basename = g_path_get_basename (cities_path);
+  if (!g_str_has_prefix (basename, "cities"))
+    return 0;
+
+  number = basename + strlen ("cities");
+  n = g_ascii_strtoull (number, &end, 10);
+  if (end == number || !g_str_equal (end, ".txt") || n >= G_MAXUINT32)
+    return 0;
+
+  return n + 1;
+}
+
+/* Reads the full dumps in dir, with the cities in cities_path (relative to dir) */
+static gboolean
+read_dumps (CityData     *data,
+            GFile        *dir,
+            const gchar  *cities_path,
+            guint         n_jobs,
+            GError      **error)
 {
-  g_autoptr(GFile) dir = NULL;
   g_autoptr(GFile) admin1_file = NULL;
   g_autoptr(GFile) countries_file = NULL;
   g_autoptr(GFile) cities_file = NULL;
   g_autoptr(GFile) alternates_file = NULL;
+
+  admin1_file = g_file_get_child (dir, "admin1Codes.txt");
+  countries_file = g_file_get_child (dir, "countryInfo.txt");
+  cities_file = g_file_resolve_relative_path (dir, cities_path);
+  alternates_file = g_file_get_child (dir, "alternateNames.txt");
+
+  if (!parse_geo_names_file (admin1_file, 4, handle_admin1_line, data, error))
+    {
+      g_prefix_error (error, "Unable to read admin file: ");
+      return FALSE;
+    }
+
+  if (!parse_geo_names_file (countries_file, 19, handle_country_line, data, error))
+    {
+      g_prefix_error (error, "Unable to read countries file: ");
+      return FALSE;
+    }
+
+  if (!index_states_and_countries (data, error))
+    return FALSE;
+
+  /* Only keep the alternate names of places that end up in the
+   * database, so that memory use doesn't grow with alternateNames.txt.
+   * That means knowing which cities are included before reading them.
+   */
+  if (!parse_geo_names_file (cities_file, 19, handle_city_id_line, data, error))
+    {
+      g_prefix_error (error, "Unable to read cities file: ");
+      return FALSE;
+    }
+
+  if (!parse_alternates_file (data, alternates_file, n_jobs, error))
+    {
+      g_prefix_error (error, "Unable to read alternates file: ");
+      return FALSE;
+    }
+
+  /* alternate names take precedence */
+  add_english_names (data);
+
+  if (!parse_geo_names_file (cities_file, 19, handle_city_line, data, error))
+    {
+      g_prefix_error (error, "Unable to read cities file: ");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+enum
+{
+  DELETES_ID = 0,
+  DELETES_NAME,
+  DELETES_COMMENT
+};
+
+enum
+{
+  ALTERNATE_DELETES_ID = 0,
+  ALTERNATE_DELETES_CITY_ID,
+  ALTERNATE_DELETES_NAME,
+  ALTERNATE_DELETES_COMMENT
+};
+
+/*
+ * geonames publishes the changes to its dumps every day, in files that
+ * are named after the kind of change and the date:
+ *
+ *   modifications-YYYY-MM-DD.txt: new and changed places, in the
+ *     format of the cities file
+ *   deletes-YYYY-MM-DD.txt: ids of deleted places
+ *   alternateNamesModifications-YYYY-MM-DD.txt: new and changed
+ *     alternate names, in the format of alternateNames.txt
+ *   alternateNamesDeletes-YYYY-MM-DD.txt: ids of deleted alternate
+ *     names
+ *
+ * With --update, the cities, states, countries and translations of an
+ * existing database are read back into a CityData, these files are
+ * applied to them, and the database is written again like one that was
+ * compiled from the full dumps.
+ *
+ * The database only contains the translation that was chosen for each
+ * place and language, along with the id of its alternate name. When
+ * that alternate name is changed or deleted, names that it had been
+ * chosen over aren't known anymore, so a place can end up without a
+ * translation that it would have when compiled from the full dumps.
+ */
+typedef struct
+{
+  CityData *data;
+  GPtrArray *rows;          /* fields of every city, in the format of the cities file, NULL if deleted */
+  GHashTable *row_indices;  /* geonames id -> index into rows */
+} Update;
+
+static void
+set_field (gchar       **row,
+           guint         column,
+           const gchar  *value)
+{
+  g_free (row[column]);
+  row[column] = g_strdup (value);
+}
+
+/* Adds row to update, replacing the row of the same city if there is one */
+static void
+set_row (Update  *update,
+         gchar  **row)
+{
+  gpointer index;
+
+  if (g_hash_table_lookup_extended (update->row_indices, row[CITIES_ID], NULL, &index))
+    {
+      g_strfreev (g_ptr_array_index (update->rows, GPOINTER_TO_UINT (index)));
+      g_ptr_array_index (update->rows, GPOINTER_TO_UINT (index)) = row;
+    }
+  else
+    {
+      g_hash_table_insert (update->row_indices, g_strdup (row[CITIES_ID]), GUINT_TO_POINTER (update->rows->len));
+      g_ptr_array_add (update->rows, row);
+    }
+}
+
+/* Recreates the row of the cities file that city i of db came from */
+static gchar **
+get_city_row (GeonamesDb *db,
+              guint       i)
+{
+  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+  const gchar *state;
+  const gchar *dot;
+  gchar **row;
+  guint j;
+
+  row = g_new (gchar *, CITIES_MODIFICATION_DATE + 2);
+  for (j = 0; j <= CITIES_MODIFICATION_DATE; j++)
+    row[j] = g_strdup ("");
+  row[j] = NULL;
+
+  /* states are "<country code>.<admin1 code>" */
+  state = geonames_db_get_string (db, db->states[db->city_states[i]]);
+  dot = strchr (state, '.');
+
+  set_field (row, CITIES_ID, geonames_db_get_string (db, db->city_ids[i]));
+  if (db->city_file_names[i] != GEONAMES_DB_NO_TRANSLATION)
+    set_field (row, CITIES_NAME, geonames_db_get_string (db, db->city_file_names[i]));
+  else
+    set_field (row, CITIES_NAME, geonames_db_get_name (db, db->city_names[i]));
+  set_field (row, CITIES_LATITUDE, g_ascii_dtostr (buf, sizeof buf, db->city_latitudes[i]));
+  set_field (row, CITIES_LONGITUDE, g_ascii_dtostr (buf, sizeof buf, db->city_longitudes[i]));
+  set_field (row, CITIES_FEATURE_CLASS, "P");
+  set_field (row, CITIES_FEATURE_CODE, geonames_db_get_string (db, db->city_feature_codes[i]));
+  g_free (row[CITIES_COUNTRY_CODE]);
+  row[CITIES_COUNTRY_CODE] = dot ? g_strndup (state, dot - state) : g_strdup (state);
+  set_field (row, CITIES_ADMIN1, dot ? dot + 1 : "");
+  g_free (row[CITIES_POPULATION]);
+  row[CITIES_POPULATION] = g_strdup_printf ("%u", db->city_populations[i]);
+  set_field (row, CITIES_TIMEZONE, geonames_db_get_string (db, db->timezones[db->city_timezones[i]]));
+
+  return row;
+}
+
+/*
+ * Adds the translations of language in translations to places. ids are
+ * the geonames ids of the keys, value() returns the translation of a
+ * value. English names that didn't come from alternate names are left
+ * out, handle_city_line() and add_english_names() add them again from
+ * the current names of the places.
+ */
+static void
+load_translations (GeonamesDb              *db,
+                   GeonamesDbTranslations  *translations,
+                   guint32                  language,
+                   const guint32           *ids,
+                   gsize                    n_ids,
+                   const gchar           *(*value) (GeonamesDb *, guint32),
+                   GHashTable              *places)
+{
+  guint32 i;
+
+  for (i = translations->offsets[language]; i < translations->offsets[language + 1]; i++)
+    {
+      guint32 source = translations->sources[i];
+
+      if (translations->keys[i] < n_ids && source != GEONAMES_DB_SOURCE_NONE)
+        g_hash_table_insert (places, g_strdup (geonames_db_get_string (db, ids[translations->keys[i]])),
+                             alternate_new (g_strdup (value (db, translations->values[i])),
+                                            source & ~GEONAMES_DB_SOURCE_PREFERRED,
+                                            (source & GEONAMES_DB_SOURCE_PREFERRED) != 0));
+    }
+}
+
+static GeonamesDb *
+open_database (const gchar  *path,
+               GError      **error)
+{
+  g_autoptr(GMappedFile) mapped = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+
+  mapped = g_mapped_file_new (path, FALSE, error);
+  if (mapped == NULL)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mapped);
+
+  return geonames_db_new (bytes, error);
+}
+
+/*
+ * Reads db into update. States, countries and timezones keep their
+ * indices, so that a database that is written again without changes
+ * is equivalent to the one that was read (but not byte for byte the
+ * same, because strings are added to the string table in a different
+ * order).
+ *
+ * The tokens of all names are taken from the name table of db, because
+ * tokenizing them again is what takes longest. data->name_tokens points
+ * into db, so db must outlive it.
+ */
+static gboolean
+load_database (Update      *update,
+               GeonamesDb  *db,
+               GError     **error)
+{
+  CityData *data = update->data;
+  guint i;
+
+  /* unless --min-population says otherwise */
+  if (data->min_population == 0)
+    data->min_population = db->min_population;
+
+  for (i = 0; i < db->n_cities; i++)
+    {
+      if (db->city_states[i] >= db->n_states ||
+          db->city_countries[i] >= db->n_countries ||
+          db->city_timezones[i] >= db->n_timezones)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "database contains invalid cities");
+          return FALSE;
+        }
+    }
+
+  for (i = 0; i < db->n_states; i++)
+    {
+      const gchar *code = geonames_db_get_string (db, db->states[i]);
+      const gchar *id = geonames_db_get_string (db, db->state_ids[i]);
+      const gchar *name;
+
+      name = geonames_db_get_string (db, db->state_file_names[i] != GEONAMES_DB_NO_TRANSLATION ?
+                                         db->state_file_names[i] : db->state_names[i]);
+
+      g_hash_table_insert (data->english_names, g_strdup (id), g_strdup (name));
+      g_hash_table_insert (data->admin1, g_strdup (code), g_strdup (id));
+      g_hash_table_insert (data->admin1_ids, g_strdup (id), g_strdup (code));
+    }
+
+  for (i = 0; i < db->n_countries; i++)
+    {
+      const gchar *code = geonames_db_get_string (db, db->countries[i]);
+      const gchar *id = geonames_db_get_string (db, db->country_ids[i]);
+      const gchar *name;
+
+      name = geonames_db_get_string (db, db->country_file_names[i] != GEONAMES_DB_NO_TRANSLATION ?
+                                         db->country_file_names[i] : db->country_names[i]);
+
+      g_hash_table_insert (data->english_names, g_strdup (id), g_strdup (name));
+      g_hash_table_insert (data->countries, g_strdup (code), g_strdup (id));
+      g_hash_table_insert (data->countries_ids, g_strdup (id), g_strdup (code));
+    }
+
+  for (i = 0; i < db->n_timezones; i++)
+    g_hash_table_insert (data->timezones, g_strdup (geonames_db_get_string (db, db->timezones[i])), GUINT_TO_POINTER (i));
+
+  for (i = 0; i < db->n_languages; i++)
+    {
+      GHashTable *places;
+
+      places = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, alternate_free);
+      g_hash_table_insert (data->alternates, g_strdup (db->languages + db->language_offsets[i]), places);
+
+      load_translations (db, &db->city_translations, i, db->city_ids, db->n_cities, geonames_db_get_name, places);
+      load_translations (db, &db->state_translations, i, db->state_ids, db->n_states, geonames_db_get_string, places);
+      load_translations (db, &db->country_translations, i, db->country_ids, db->n_countries, geonames_db_get_string, places);
+    }
+
+  data->name_tokens = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+  for (i = 0; i < db->n_names; i++)
+    {
+      const gchar **tokens;
+      guint32 n_tokens = 0;
+      guint32 j;
+
+      tokens = g_new (const gchar *, 2 * (db->name_token_offsets[i + 1] - db->name_token_offsets[i]) + 1);
+      for (j = db->name_token_offsets[i]; j < db->name_token_offsets[i + 1]; j++)
+        {
+          tokens[n_tokens++] = geonames_db_get_token (db, db->name_tokens[j]);
+          if (db->name_ascii_tokens[j] != GEONAMES_DB_NO_TOKEN)
+            tokens[n_tokens++] = geonames_db_get_token (db, db->name_ascii_tokens[j]);
+        }
+      tokens[n_tokens] = NULL;
+
+      g_hash_table_insert (data->name_tokens, (gpointer) geonames_db_get_name (db, i), tokens);
+    }
+
+  for (i = 0; i < db->n_cities; i++)
+    set_row (update, get_city_row (db, i));
+
+  return TRUE;
+}
+
+static void
+handle_modification_line (gchar    **fields,
+                          gpointer   user_data,
+                          GError   **error)
+{
+  Update *update = user_data;
+
+  /* Modifications contain all kinds of places. Only add those that
+   * would be in the cities file the database was compiled from,
+   * handle_city_line() filters the rest. Cities that are already in the
+   * database are always updated, so that they are removed if they
+   * don't qualify anymore.
+   */
+  if (!g_hash_table_contains (update->row_indices, fields[CITIES_ID]) &&
+      !has_min_population (update->data, fields))
+    return;
+
+  set_row (update, g_strdupv (fields));
+}
+
+/* The ids are in the first column of both kinds of alternate names files */
+static void
+handle_alternate_id_line (gchar    **fields,
+                          gpointer   user_data,
+                          GError   **error)
+{
+  GHashTable *ids = user_data;
+
+  g_hash_table_add (ids, GUINT_TO_POINTER (strtoul (fields[ALTERNATES_ID], NULL, 10)));
+}
+
+/* Removes the translations that come from the alternate names in ids */
+static void
+remove_alternates (CityData   *data,
+                   GHashTable *ids)
+{
+  GHashTableIter iter;
+  GHashTable *places;
+
+  g_hash_table_iter_init (&iter, data->alternates);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &places))
+    {
+      GHashTableIter place_iter;
+      Alternate *alternate;
+
+      g_hash_table_iter_init (&place_iter, places);
+      while (g_hash_table_iter_next (&place_iter, NULL, (gpointer *) &alternate))
+        {
+          if (g_hash_table_contains (ids, GUINT_TO_POINTER (alternate->id)))
+            g_hash_table_iter_remove (&place_iter);
+        }
+    }
+}
+
+/*
+ * Applies an alternateNamesModifications or (if deletes is set)
+ * alternateNamesDeletes file. The translations that come from the
+ * alternate names in the file are removed first, so that changed names
+ * compete with the others like new ones.
+ */
+static gboolean
+apply_alternates_file (CityData  *data,
+                       GFile     *file,
+                       gboolean   deletes,
+                       guint      n_jobs,
+                       GError   **error)
+{
+  g_autoptr(GHashTable) ids = NULL;
+
+  ids = g_hash_table_new (NULL, NULL);
+  if (!parse_geo_names_file (file, deletes ? 4 : 8, handle_alternate_id_line, ids, error))
+    return FALSE;
+
+  remove_alternates (data, ids);
+
+  return deletes || parse_alternates_file (data, file, n_jobs, error);
+}
+
+static void
+handle_delete_line (gchar    **fields,
+                    gpointer   user_data,
+                    GError   **error)
+{
+  Update *update = user_data;
+  gpointer index;
+
+  if (g_hash_table_lookup_extended (update->row_indices, fields[DELETES_ID], NULL, &index))
+    {
+      g_strfreev (g_ptr_array_index (update->rows, GPOINTER_TO_UINT (index)));
+      g_ptr_array_index (update->rows, GPOINTER_TO_UINT (index)) = NULL;
+      g_hash_table_remove (update->row_indices, fields[DELETES_ID]);
+    }
+}
+
+/*
+ * Reads the database at database and applies the change files in
+ * files to it, in order.
+ */
+static gboolean
+read_update (CityData     *data,
+             const gchar  *database,
+             gchar       **files,
+             guint         n_jobs,
+             GError      **error)
+{
+  g_autoptr(GPtrArray) rows = NULL;
+  g_autoptr(GHashTable) row_indices = NULL;
+  g_autoptr(GPtrArray) alternates_files = NULL;
+  g_autoptr(GeonamesDb) db = NULL;
+  Update update;
+  guint i;
+
+  rows = g_ptr_array_new_with_free_func ((GDestroyNotify) g_strfreev);
+  row_indices = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  alternates_files = g_ptr_array_new ();
+
+  update.data = data;
+  update.rows = rows;
+  update.row_indices = row_indices;
+
+  db = open_database (database, error);
+  if (db == NULL || !load_database (&update, db, error))
+    {
+      g_prefix_error (error, "Unable to read database: ");
+      return FALSE;
+    }
+
+  if (!index_states_and_countries (data, error))
+    return FALSE;
+
+  /* Which alternate names are kept depends on which cities end up in
+   * the database, so apply the changes to cities of all files first.
+   */
+  for (i = 0; files[i]; i++)
+    {
+      g_autofree gchar *basename = NULL;
+      g_autoptr(GFile) file = NULL;
+      gboolean success = TRUE;
+
+      basename = g_path_get_basename (files[i]);
+      file = g_file_new_for_path (files[i]);
+
+      if (g_str_has_prefix (basename, "alternateNamesModifications") ||
+          g_str_has_prefix (basename, "alternateNamesDeletes"))
+        g_ptr_array_add (alternates_files, files[i]);
+      else if (g_str_has_prefix (basename, "modifications"))
+        success = parse_geo_names_file (file, 19, handle_modification_line, &update, error);
+      else if (g_str_has_prefix (basename, "deletes"))
+        success = parse_geo_names_file (file, 3, handle_delete_line, &update, error);
+      else
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "unknown kind of changes");
+          success = FALSE;
+        }
+
+      if (!success)
+        {
+          g_prefix_error (error, "Unable to read %s: ", files[i]);
+          return FALSE;
+        }
+    }
+
+  for (i = 0; i < rows->len; i++)
+    {
+      gchar **row = g_ptr_array_index (rows, i);
+
+      if (row)
+        handle_city_id_line (row, data, NULL);
+    }
+
+  for (i = 0; i < alternates_files->len; i++)
+    {
+      const gchar *path = g_ptr_array_index (alternates_files, i);
+      g_autofree gchar *basename = NULL;
+      g_autoptr(GFile) file = NULL;
+
+      basename = g_path_get_basename (path);
+      file = g_file_new_for_path (path);
+
+      if (!apply_alternates_file (data, file, g_str_has_prefix (basename, "alternateNamesDeletes"), n_jobs, error))
+        {
+          g_prefix_error (error, "Unable to read %s: ", path);
+          return FALSE;
+        }
+    }
+
+  add_english_names (data);
+
+  for (i = 0; i < rows->len; i++)
+    {
+      gchar **row = g_ptr_array_index (rows, i);
+
+      if (row)
+        {
+          handle_city_line (row, data, error);
+          if (error && *error)
+            break;
+        }
+    }
+
+  /* points into db */
+  g_clear_pointer (&data->name_tokens, g_hash_table_unref);
+
+  return i == rows->len;
+}
+
+int
+main (int argc, char **argv)
+{
+  g_autoptr(GFile) dir = NULL;
   g_autoptr(GError) error = NULL;
   g_autoptr(GVariant) v = NULL;
+  g_autoptr(GHashTable) token_ids = NULL;
+  g_autoptr(GHashTable) name_ids = NULL;
+  g_autoptr(GOptionContext) context = NULL;
+  GVariantBuilder builder;
+  g_autofree gchar *update_database = NULL;
+  g_autofree gchar *cities_path = NULL;
   CityData data;
+  gint n_jobs = 0;
+  gint min_population = 0;
+  gboolean success;
+
+  const GOptionEntry entries[] = {
+    { "jobs", 'j', 0, G_OPTION_ARG_INT, &n_jobs, "Use N threads (default: one per processor)", "N" },
+    { "update", 'u', 0, G_OPTION_ARG_FILENAME, &update_database,
+      "Apply the daily change files given as arguments to DATABASE instead of reading the full dumps", "DATABASE" },
+    { "cities", 'c', 0, G_OPTION_ARG_FILENAME, &cities_path,
+      "Read cities from FILE in DIRECTORY (default: cities15000.txt), for example cities500.txt or allCountries.txt", "FILE" },
+    { "min-population", 'p', 0, G_OPTION_ARG_INT, &min_population,
+      "Only include capitals and places with at least N inhabitants (default: as in the cities file, or the database that is updated)", "N" },
+    { NULL }
+  };
 
   setlocale (LC_ALL, "");
 
-  dir = g_file_new_for_path (argc == 2 ? argv[1] : ".");
-  admin1_file = g_file_get_child (dir, "admin1Codes.txt");
-  countries_file = g_file_get_child (dir, "countryInfo.txt");
-  cities_file = g_file_get_child (dir, "cities15000.txt");
-  alternates_file = g_file_get_child (dir, "alternateNames.txt");
+  context = g_option_context_new ("[DIRECTORY | FILE...] - compile the geonames database");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  if (n_jobs <= 0)
+    n_jobs = g_get_num_processors ();
 
   data.admin1 = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
   data.admin1_ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
   data.countries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
   data.countries_ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  data.timezones = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
   data.cities_ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  data.english_names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
   data.alternates = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
                                            (GDestroyNotify)g_hash_table_unref);
-  g_variant_builder_init (&data.builder, G_VARIANT_TYPE ("a(sssssssudd)"));
-
-  if (!parse_geo_names_file (alternates_file, 8, handle_alternates_line, &data, &error))
-    {
-      g_printerr ("Unable to read alternates file: %s\n", error->message);
-      return 1;
-    }
-
-  if (!parse_geo_names_file (admin1_file, 4, handle_admin1_line, &data, &error))
+  data.tokens = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_array_unref);
+  data.names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  data.name_tokens = NULL;
+  data.city_names = g_ptr_array_new_with_free_func (g_free);
+  data.city_file_names = g_ptr_array_new_with_free_func (g_free);
+  data.strings = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  data.string_data = g_byte_array_new ();
+  data.cities = g_array_new (FALSE, FALSE, sizeof (City));
+  data.min_population = MAX (min_population, 0);
+
+  if (update_database)
+    success = read_update (&data, update_database, argv + 1, n_jobs, &error);
+  else
     {
-      g_printerr ("Unable to read admin file: %s\n", error->message);
-      return 1;
-    }
+      if (cities_path == NULL)
+        cities_path = g_strdup ("cities15000.txt");
+      if (data.min_population == 0)
+        data.min_population = get_cities_file_min_population (cities_path);
 
-  if (!parse_geo_names_file (countries_file, 19, handle_country_line, &data, &error))
-    {
-      g_printerr ("Unable to read countries file: %s\n", error->message);
-      return 1;
+      dir = g_file_new_for_path (argc == 2 ? argv[1] : ".");
+      success = read_dumps (&data, dir, cities_path, n_jobs, &error);
     }
 
-  if (!parse_geo_names_file (cities_file, 19, handle_city_line, &data, &error))
+  if (!success)
     {
-      g_printerr ("Unable to read cities file: %s\n", error->message);
+      g_printerr ("%s\n", error->message);
       return 1;
     }
 
-  v = g_variant_new ("a(sssssssudd)", &data.builder);
+  sort_cities_into_tiers (&data);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&builder, "{sv}", GEONAMES_DB_KEY_VERSION, g_variant_new_uint32 (GEONAMES_DB_VERSION));
+  g_variant_builder_add (&builder, "{sv}", GEONAMES_DB_KEY_MIN_POPULATION, g_variant_new_uint32 (data.min_population));
+  add_city_columns (&data, &builder);
+  add_state_and_country_tables (&data, &builder);
+  add_timezone_table (&data, &builder);
+  add_spatial_index (&data, &builder);
+  add_grid_index (&data, &builder);
+  add_tier_table (&data, &builder);
+  token_ids = add_token_index (&data, &builder);
+  name_ids = add_name_table (&data, token_ids, &builder);
+  add_translation_tables (&data, name_ids, &builder);
+
+  /* last, because the functions above add strings */
+  g_variant_builder_add (&builder, "{sv}", GEONAMES_DB_KEY_STRINGS,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, data.string_data->data,
+                                                    data.string_data->len, 1));
+  v = g_variant_ref_sink (g_variant_builder_end (&builder));
 
   if (!g_file_set_contents ("cities.compiled", g_variant_get_data (v), g_variant_get_size (v), &error))
     {
@@ -446,14 +2519,25 @@ main (int argc, char **argv)
       return 1;
     }
 
-  write_po_files (&data);
-
   g_hash_table_unref (data.admin1);
   g_hash_table_unref (data.admin1_ids);
   g_hash_table_unref (data.countries);
   g_hash_table_unref (data.countries_ids);
+  g_free (data.states);
+  g_hash_table_unref (data.state_indices);
+  g_free (data.country_codes);
+  g_hash_table_unref (data.country_indices);
+  g_hash_table_unref (data.timezones);
   g_hash_table_unref (data.cities_ids);
+  g_hash_table_unref (data.english_names);
   g_hash_table_unref (data.alternates);
+  g_hash_table_unref (data.tokens);
+  g_hash_table_unref (data.names);
+  g_ptr_array_unref (data.city_names);
+  g_ptr_array_unref (data.city_file_names);
+  g_hash_table_unref (data.strings);
+  g_byte_array_unref (data.string_data);
+  g_array_unref (data.cities);
 
   return 0;
 }
@@ -19,167 +19,1844 @@
 
 typedef struct
 {
-  gint index;
+  guint32 index;
   gdouble weight;
 } Match;
 
-static Match *
-match_new (gint    index,
-           gdouble weight)
+/*
+ * Counters for geonames_query_get_stats(). They are only ever increased
+ * (atomically) and may be read at any time.
+ */
+static struct
 {
-  Match *match;
+  gsize n_queries;
+  gsize n_rows_scanned;
+  gsize n_candidates_scored;
+  gsize n_matches;
+  gsize n_results;
+  gsize query_time;
+  gint max_query_time;
+} stats;
 
-  match = g_slice_new (Match);
-  match->index = index;
-  match->weight = weight;
-
-  return match;
+static inline void
+stats_add (gsize *counter,
+           gsize  value)
+{
+  g_atomic_pointer_add (counter, value);
 }
 
+/*
+ * Records n_queries queries that were started together at start and
+ * have finished now. They are assumed to have taken the same time for
+ * the maximum query time.
+ */
 static void
-match_free (gpointer data)
+stats_add_queries (gint64 start,
+                   guint  n_queries,
+                   gsize  n_results)
+{
+  gint64 total = g_get_monotonic_time () - start;
+  gint elapsed = (gint) MIN (total / MAX (n_queries, 1), G_MAXINT);
+  gint max;
+
+  stats_add (&stats.n_queries, n_queries);
+  stats_add (&stats.n_results, n_results);
+  stats_add (&stats.query_time, total);
+
+  do
+    max = g_atomic_int_get (&stats.max_query_time);
+  while (elapsed > max && !g_atomic_int_compare_and_exchange (&stats.max_query_time, max, elapsed));
+}
+
+/*
+ * Fills in the query counters of stats: all of them except those of
+ * the query cache and the load time of the database.
+ */
+void
+geonames_query_get_stats (GeonamesStats *out)
+{
+  out->n_queries = (gsize) g_atomic_pointer_get (&stats.n_queries);
+  out->n_rows_scanned = (gsize) g_atomic_pointer_get (&stats.n_rows_scanned);
+  out->n_candidates_scored = (gsize) g_atomic_pointer_get (&stats.n_candidates_scored);
+  out->n_matches = (gsize) g_atomic_pointer_get (&stats.n_matches);
+  out->n_results = (gsize) g_atomic_pointer_get (&stats.n_results);
+  out->query_time_us = (gsize) g_atomic_pointer_get (&stats.query_time);
+  out->max_query_time_us = g_atomic_int_get (&stats.max_query_time);
+}
+
+static gint
+compare_rows (gconstpointer a,
+              gconstpointer b)
 {
-  g_slice_free (Match, data);
+  guint32 row_a = *(const guint32 *) a;
+  guint32 row_b = *(const guint32 *) b;
+
+  return (row_a > row_b) - (row_a < row_b);
 }
 
+/*
+ * Orders matches by descending weight. Matches with (almost) the same
+ * weight are ordered by index, so that results don't depend on the
+ * order in which they were found.
+ *
+ * Weights are compared in steps of 1e-5 rather than by their distance,
+ * because the latter wouldn't be transitive: sorting or merging the
+ * same matches in a different order could yield a different result.
+ */
 static gint
 compare_matches (gconstpointer a,
-                 gconstpointer b,
-                 gpointer      user_data)
+                 gconstpointer b)
 {
   const Match *match_a = a;
   const Match *match_b = b;
-  gdouble delta;
+  gdouble step_a = floor (match_a->weight * 1e5);
+  gdouble step_b = floor (match_b->weight * 1e5);
 
-  delta = match_b->weight - match_a->weight;
-
-  if (delta < -1e-5)
+  if (step_a > step_b)
     return -1;
-  else if (delta > 1e-5)
+  else if (step_a < step_b)
     return 1;
   else
-    return 0;
+    return compare_rows (&match_a->index, &match_b->index);
+}
+
+static void
+swap_matches (Match *a,
+              Match *b)
+{
+  Match tmp = *a;
+
+  *a = *b;
+  *b = tmp;
+}
+
+/*
+ * Adds a match to matches. If max_results is not 0, matches is kept as
+ * a binary heap of at most max_results elements with the worst match
+ * at the root, which is replaced whenever a better match comes along.
+ */
+static void
+add_match (GArray  *matches,
+           guint    max_results,
+           guint32  index,
+           gdouble  weight)
+{
+  Match match = { index, weight };
+  Match *heap;
+  guint i;
+
+  if (max_results == 0)
+    {
+      g_array_append_val (matches, match);
+      return;
+    }
+
+  if (matches->len < max_results)
+    {
+      g_array_append_val (matches, match);
+      heap = (Match *) matches->data;
+
+      for (i = matches->len - 1; i > 0 && compare_matches (&heap[(i - 1) / 2], &heap[i]) < 0; i = (i - 1) / 2)
+        swap_matches (&heap[(i - 1) / 2], &heap[i]);
+
+      return;
+    }
+
+  heap = (Match *) matches->data;
+  if (compare_matches (&match, &heap[0]) >= 0)
+    return;
+
+  heap[0] = match;
+
+  i = 0;
+  for (;;)
+    {
+      guint worst = i;
+      guint child;
+
+      for (child = 2 * i + 1; child <= 2 * i + 2 && child < matches->len; child++)
+        if (compare_matches (&heap[child], &heap[worst]) > 0)
+          worst = child;
+
+      if (worst == i)
+        break;
+
+      swap_matches (&heap[i], &heap[worst]);
+      i = worst;
+    }
+}
+
+/*
+ * The first GEONAMES_DB_TOKEN_PREFIX_SIZE bytes of a query token and a
+ * mask of the bytes that are part of it. A name token can only start
+ * with the query token if its prefix equals value in all masked bytes.
+ * If exact is set, the query token is not longer than that, and the
+ * converse is true as well.
+ */
+typedef struct
+{
+  guint64 value;
+  guint64 mask;
+  gboolean exact;
+} TokenPrefix;
+
+static TokenPrefix *
+token_prefixes_new (gchar **query_tokens)
+{
+  TokenPrefix *prefixes;
+  guint i;
+
+  prefixes = g_new (TokenPrefix, g_strv_length (query_tokens));
+
+  for (i = 0; query_tokens[i]; i++)
+    {
+      gsize len = strlen (query_tokens[i]);
+
+      prefixes[i].value = geonames_db_token_prefix (query_tokens[i]);
+      prefixes[i].mask = 0;
+      memset (&prefixes[i].mask, 0xff, MIN (len, GEONAMES_DB_TOKEN_PREFIX_SIZE));
+      prefixes[i].exact = len <= GEONAMES_DB_TOKEN_PREFIX_SIZE;
+    }
+
+  return prefixes;
+}
+
+static inline gboolean
+prefix_matches (guint64            prefix,
+                const TokenPrefix *query)
+{
+  return ((prefix ^ query->value) & query->mask) == 0;
+}
+
+/*
+ * Returns the position of the first name token from first up to (but
+ * not including) last whose prefix or whose ASCII transliteration's
+ * prefix matches query, or last if there is none.
+ */
+typedef guint32 (* FindPrefixFunc) (const guint64     *prefixes,
+                                    const guint64     *ascii_prefixes,
+                                    guint32            first,
+                                    guint32            last,
+                                    const TokenPrefix *query);
+
+static guint32
+find_prefix_scalar (const guint64     *prefixes,
+                    const guint64     *ascii_prefixes,
+                    guint32            first,
+                    guint32            last,
+                    const TokenPrefix *query)
+{
+  guint32 i;
+
+  for (i = first; i < last; i++)
+    if (prefix_matches (prefixes[i], query) || prefix_matches (ascii_prefixes[i], query))
+      break;
+
+  return i;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+#define HAVE_X86_INTRINSICS 1
+
+/* compares two prefixes at a time */
+__attribute__((target ("sse2")))
+static guint32
+find_prefix_sse2 (const guint64     *prefixes,
+                  const guint64     *ascii_prefixes,
+                  guint32            first,
+                  guint32            last,
+                  const TokenPrefix *query)
+{
+  const __m128i value = _mm_set1_epi64x (query->value);
+  const __m128i mask = _mm_set1_epi64x (query->mask);
+  const __m128i zero = _mm_setzero_si128 ();
+  guint32 i;
+
+  for (i = first; i + 2 <= last; i += 2)
+    {
+      __m128i a = _mm_loadu_si128 ((const __m128i *) (prefixes + i));
+      __m128i b = _mm_loadu_si128 ((const __m128i *) (ascii_prefixes + i));
+      guint bits_a, bits_b;
+
+      /* one bit per byte that is equal in the masked bytes */
+      bits_a = _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_and_si128 (_mm_xor_si128 (a, value), mask), zero));
+      bits_b = _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_and_si128 (_mm_xor_si128 (b, value), mask), zero));
+
+      if ((bits_a & 0x00ff) == 0x00ff || (bits_b & 0x00ff) == 0x00ff)
+        return i;
+      if ((bits_a & 0xff00) == 0xff00 || (bits_b & 0xff00) == 0xff00)
+        return i + 1;
+    }
+
+  return find_prefix_scalar (prefixes, ascii_prefixes, i, last, query);
+}
+
+/* compares four prefixes at a time */
+__attribute__((target ("avx2")))
+static guint32
+find_prefix_avx2 (const guint64     *prefixes,
+                  const guint64     *ascii_prefixes,
+                  guint32            first,
+                  guint32            last,
+                  const TokenPrefix *query)
+{
+  const __m256i value = _mm256_set1_epi64x (query->value);
+  const __m256i mask = _mm256_set1_epi64x (query->mask);
+  const __m256i zero = _mm256_setzero_si256 ();
+  guint32 i;
+
+  for (i = first; i + 4 <= last; i += 4)
+    {
+      __m256i a = _mm256_loadu_si256 ((const __m256i *) (prefixes + i));
+      __m256i b = _mm256_loadu_si256 ((const __m256i *) (ascii_prefixes + i));
+      __m256i equal;
+      guint bits;
+
+      equal = _mm256_or_si256 (_mm256_cmpeq_epi64 (_mm256_and_si256 (_mm256_xor_si256 (a, value), mask), zero),
+                               _mm256_cmpeq_epi64 (_mm256_and_si256 (_mm256_xor_si256 (b, value), mask), zero));
+
+      bits = _mm256_movemask_pd (_mm256_castsi256_pd (equal));
+      if (bits)
+        return i + __builtin_ctz (bits);
+    }
+
+  return find_prefix_scalar (prefixes, ascii_prefixes, i, last, query);
+}
+#endif
+
+static FindPrefixFunc
+get_find_prefix_func (void)
+{
+  static gsize func;
+
+  if (g_once_init_enter (&func))
+    {
+      FindPrefixFunc f = find_prefix_scalar;
+
+#ifdef HAVE_X86_INTRINSICS
+      __builtin_cpu_init ();
+      if (__builtin_cpu_supports ("avx2"))
+        f = find_prefix_avx2;
+      else if (__builtin_cpu_supports ("sse2"))
+        f = find_prefix_sse2;
+#endif
+
+      g_once_init_leave (&func, (gsize) f);
+    }
+
+  return (FindPrefixFunc) func;
 }
 
+/*
+ * Returns TRUE if the name token at position i in the name token table
+ * of db, or its ASCII transliteration, starts with the query token
+ * token, whose prefix is prefix.
+ */
 static gboolean
-str_prefix_matches (const gchar *str,
-                    const gchar *prefix)
+token_prefix_matches (GeonamesDb        *db,
+                      guint32            i,
+                      const gchar       *token,
+                      const TokenPrefix *prefix)
 {
-  if (g_str_has_prefix (str, prefix))
+  guint32 ascii;
+
+  if (prefix_matches (db->name_token_prefixes[i], prefix) &&
+      (prefix->exact || g_str_has_prefix (geonames_db_get_token (db, db->name_tokens[i]), token)))
+    return TRUE;
+
+  ascii = db->name_ascii_tokens[i];
+  if (ascii != GEONAMES_DB_NO_TOKEN && prefix_matches (db->name_ascii_token_prefixes[i], prefix) &&
+      (prefix->exact || g_str_has_prefix (geonames_db_get_token (db, ascii), token)))
     return TRUE;
 
-  if (!g_str_is_ascii (str))
+  return FALSE;
+}
+
+/*
+ * Returns the number of typos with which the name token at position i
+ * in the name token table of db, or its ASCII transliteration, starts
+ * with a query token whose similar tokens are similar, or -1 if it
+ * doesn't.
+ */
+static gint
+find_similar_token (GeonamesDb *db,
+                    GArray     *similar,
+                    guint32     i)
+{
+  const GeonamesDbSimilarToken *tokens = (const GeonamesDbSimilarToken *) similar->data;
+  guint32 name_tokens[2] = { db->name_tokens[i], db->name_ascii_tokens[i] };
+  gint typos = -1;
+  guint k;
+
+  for (k = 0; k < G_N_ELEMENTS (name_tokens) && name_tokens[k] != GEONAMES_DB_NO_TOKEN; k++)
     {
-      g_autofree gchar *ascii;
+      guint lo = 0;
+      guint hi = similar->len;
+
+      while (lo < hi)
+        {
+          guint mid = lo + (hi - lo) / 2;
+
+          if (tokens[mid].token < name_tokens[k])
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
 
-      ascii = g_str_to_ascii (str, NULL);
-      if (g_str_has_prefix (ascii, prefix))
-        return TRUE;
+      if (lo < similar->len && tokens[lo].token == name_tokens[k] &&
+          (typos < 0 || tokens[lo].distance < (guint) typos))
+        typos = tokens[lo].distance;
     }
 
-  return FALSE;
+  return typos;
 }
 
+/*
+ * Matches the query tokens against the name tokens first up to (but
+ * not including) last. In fuzzy queries (if similar isn't NULL), query
+ * tokens may also match with typos, which lowers the weight of that
+ * token and sets fuzzy.
+ */
 static gdouble
-match_query (gchar       **query_tokens,
-             const gchar  *potential_hit,
-             gboolean     *all_prefix_match)
+match_tokens (GeonamesDb        *db,
+              gchar            **query_tokens,
+              const TokenPrefix *prefixes,
+              GPtrArray         *similar,
+              guint32            first,
+              guint32            last,
+              gboolean          *fuzzy)
 {
-  g_auto(GStrv) tokens = NULL;
   gint i;
   gdouble weight = 0.0;
 
-  *all_prefix_match = TRUE;
+  *fuzzy = FALSE;
 
-  tokens = g_str_tokenize_and_fold (potential_hit, NULL, NULL);
   for (i = 0; query_tokens[i]; i++)
     {
-      if (tokens[i] == 0) {
-        *all_prefix_match = FALSE;
+      gdouble ratio;
+
+      if (first + i >= last)
         return 0.0;
-      }
 
-      if (str_prefix_matches (tokens[i], query_tokens[i]))
-        {
-          weight += (gdouble) strlen (query_tokens[i]) / strlen (tokens[i]);
-        }
-      else
+      /* at most 1, even if the query matched a longer transliteration */
+      ratio = MIN ((gdouble) strlen (query_tokens[i]) / strlen (geonames_db_get_token (db, db->name_tokens[first + i])), 1.0);
+
+      if (!token_prefix_matches (db, first + i, query_tokens[i], &prefixes[i]))
         {
-          const gdouble aux = match_query(query_tokens, &potential_hit[strlen (tokens[i])], all_prefix_match);
-          *all_prefix_match = FALSE;
-          return aux;
+          gint typos;
+
+          if (similar == NULL)
+            return 0.0;
+
+          typos = find_similar_token (db, g_ptr_array_index (similar, i), first + i);
+          if (typos < 0)
+            return 0.0;
+
+          ratio *= 1.0 - (gdouble) typos / g_utf8_strlen (query_tokens[i], -1);
+          *fuzzy = TRUE;
         }
+
+      weight += ratio;
     }
 
   return weight / i;
 }
 
-static void
-collect_indices (gpointer data,
-                 gpointer user_data)
+/*
+ * Matches the query tokens against consecutive tokens of the name with
+ * index name, starting at the first token for which all of them match.
+ * all_prefix_match is set when that is the first token of the name,
+ * and fuzzy when some query tokens only matched with typos.
+ *
+ * Unless the query is fuzzy, positions at which the first query token
+ * can't match are skipped by comparing fixed-size prefixes only,
+ * several at a time.
+ */
+static gdouble
+match_query (GeonamesDb        *db,
+             gchar            **query_tokens,
+             const TokenPrefix *prefixes,
+             GPtrArray         *similar,
+             guint32            name,
+             gboolean          *all_prefix_match,
+             gboolean          *fuzzy)
 {
-  Match *match = data;
-  GArray *indices = user_data;
+  FindPrefixFunc find_prefix = get_find_prefix_func ();
+  guint32 first = db->name_token_offsets[name];
+  guint32 last = db->name_token_offsets[name + 1];
+  guint32 i;
+
+  for (i = first; i < last; i++)
+    {
+      gdouble weight;
+
+      if (similar == NULL)
+        {
+          i = find_prefix (db->name_token_prefixes, db->name_ascii_token_prefixes, i, last, &prefixes[0]);
+          if (i == last)
+            break;
+        }
+
+      weight = match_tokens (db, query_tokens, prefixes, similar, i, last, fuzzy);
+      if (weight > 0.0)
+        {
+          *all_prefix_match = i == first;
+          return weight;
+        }
+    }
 
-  g_array_append_val (indices, match->index);
+  *all_prefix_match = FALSE;
+  *fuzzy = FALSE;
+  return 0.0;
 }
 
 static gdouble
-calculate_weight (GStrv query_tokens,
-                  const gchar *name,
-                  guint population,
-                  gdouble best_weight)
+calculate_weight (GeonamesDb        *db,
+                  GStrv              query_tokens,
+                  const TokenPrefix *prefixes,
+                  GPtrArray         *similar,
+                  guint32            name,
+                  guint              population,
+                  gdouble            best_weight)
 {
   gdouble weight;
   gboolean all_prefix_match;
+  gboolean fuzzy;
 
-  weight = match_query (query_tokens, name, &all_prefix_match);
+  weight = match_query (db, query_tokens, prefixes, similar, name, &all_prefix_match, &fuzzy);
   weight *= (gdouble) CLAMP (population, 1, 1000000) / 1000000;
+
+  /* matches with typos rank below exact ones at the start of a name */
   if (all_prefix_match)
-    weight += 1;
+    weight += fuzzy ? 0.5 : 1;
 
   return MAX (weight, best_weight);
 }
 
-GArray *
-geonames_query_cities_db (GVariant    *db,
-                          const gchar *query)
+/* Number of typos tolerated in a query token of a fuzzy query */
+static guint
+get_max_typos (const gchar *token)
 {
-  g_auto(GStrv) query_tokens = NULL;
-  g_autoptr(GSequence) matches = NULL;
-  gsize n_cities;
-  gsize i;
-  GArray *indices;
+  glong n_chars = g_utf8_strlen (token, -1);
 
-  g_return_val_if_fail (g_variant_is_of_type (db, G_VARIANT_TYPE ("a(sssssssudd)")), NULL);
-  g_return_val_if_fail (query != NULL, NULL);
+  if (n_chars >= 9)
+    return 2;
+  else if (n_chars >= 5)
+    return 1;
+  else
+    return 0;
+}
 
-  query_tokens = g_str_tokenize_and_fold (query, NULL, NULL);
-  matches = g_sequence_new (match_free);
+/*
+ * Looks up the tokens that each query token matches with typos in a
+ * fuzzy query, as arrays of GeonamesDbSimilarToken.
+ */
+static GPtrArray *
+similar_tokens_new (GeonamesDb  *db,
+                    gchar      **query_tokens)
+{
+  GPtrArray *similar;
+  gint i;
+
+  similar = g_ptr_array_new_with_free_func ((GDestroyNotify) g_array_unref);
+
+  for (i = 0; query_tokens[i]; i++)
+    {
+      guint max_typos = get_max_typos (query_tokens[i]);
+
+      if (max_typos > 0)
+        g_ptr_array_add (similar, geonames_db_lookup_similar (db, query_tokens[i], max_typos));
+      else
+        g_ptr_array_add (similar, g_array_new (FALSE, FALSE, sizeof (GeonamesDbSimilarToken)));
+    }
+
+  return similar;
+}
+
+/*
+ * Finds the query token that the fewest cities have a token starting
+ * with (or, in fuzzy queries, a token similar to it), and sets first
+ * and last to the range of those tokens in the token index. Any city
+ * that matches the whole query has one of them, or one of the similar
+ * tokens of that query token.
+ *
+ * Returns the position of that query token, or -1 if query_tokens is
+ * empty.
+ */
+static gint
+find_rarest_token (GeonamesDb  *db,
+                   gchar      **query_tokens,
+                   GPtrArray   *similar,
+                   gsize       *first,
+                   gsize       *last)
+{
+  gint best = -1;
+  gsize best_count = G_MAXSIZE;
+  gint i;
+
+  *first = 0;
+  *last = 0;
 
-  n_cities = g_variant_n_children (db);
-  for (i = 0; i < n_cities; i++)
+  for (i = 0; query_tokens[i]; i++)
     {
-      const gchar *id;
-      const gchar *en_name;
-      const gchar *translation;
-      guint population;
-      gdouble best_weight = 0;
+      gsize token_first, token_last, count;
+
+      count = geonames_db_lookup_prefix (db, query_tokens[i], &token_first, &token_last);
 
-      g_variant_get_child (db, i, "(&s&s&s&s&s&s&sudd)", &id, &en_name, NULL, NULL, NULL, NULL, NULL, &population, NULL, NULL);
+      if (similar)
+        {
+          GArray *tokens = g_ptr_array_index (similar, i);
+          guint j;
 
-      best_weight = calculate_weight (query_tokens, en_name, population, best_weight);
+          for (j = 0; j < tokens->len; j++)
+            {
+              guint32 t = g_array_index (tokens, GeonamesDbSimilarToken, j).token;
 
-      translation = g_dgettext (PACKAGE, id);
-      if (g_strcmp0 (translation, id) != 0)
-        best_weight = calculate_weight (query_tokens, translation, population, best_weight);
+              if (t < token_first || t >= token_last)
+                count += db->posting_offsets[t + 1] - db->posting_offsets[t];
+            }
+        }
 
-      if (best_weight > 0.0)
-        g_sequence_insert_sorted (matches, match_new (i, best_weight), compare_matches, NULL);
+      if (count < best_count)
+        {
+          best = i;
+          *first = token_first;
+          *last = token_last;
+          best_count = count;
+        }
     }
 
-  indices = g_array_new (FALSE, FALSE, sizeof (gint));
-  g_sequence_foreach (matches, collect_indices, indices);
+  return best;
+}
 
-  return indices;
+/* Returns the position of the first element of rows[first .. last] that is not less than row */
+static guint
+lower_bound (const guint32 *rows,
+             guint          first,
+             guint          last,
+             guint32        row)
+{
+  while (first < last)
+    {
+      guint mid = first + (last - first) / 2;
+
+      if (rows[mid] < row)
+        first = mid + 1;
+      else
+        last = mid;
+    }
+
+  return first;
+}
+
+/* Appends the cities of tier that have token t to candidates */
+static void
+append_postings (GeonamesDb *db,
+                 gsize       t,
+                 guint       tier,
+                 GArray     *candidates)
+{
+  guint first, last;
+
+  /* postings are sorted, so the cities of a tier are a contiguous range of them */
+  first = lower_bound (db->postings, db->posting_offsets[t], db->posting_offsets[t + 1], db->tier_offsets[tier]);
+  last = lower_bound (db->postings, first, db->posting_offsets[t + 1], db->tier_offsets[tier + 1]);
+
+  g_array_append_vals (candidates, db->postings + first, last - first);
+}
+
+/*
+ * Collects all cities of tier which have one of the tokens first_token
+ * up to (but not including) last_token, or one of the tokens in similar
+ * (if it isn't NULL). The returned indices are sorted in ascending
+ * order.
+ */
+static GArray *
+lookup_candidates (GeonamesDb *db,
+                   gsize       first_token,
+                   gsize       last_token,
+                   GArray     *similar,
+                   guint       tier)
+{
+  GArray *candidates;
+  guint n_lists;
+  gsize t;
+  guint j;
+
+  candidates = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  for (t = first_token; t < last_token; t++)
+    append_postings (db, t, tier, candidates);
+
+  n_lists = last_token - first_token;
+
+  /* similar tokens starting with the query token were added above already */
+  for (j = 0; similar && j < similar->len; j++)
+    {
+      t = g_array_index (similar, GeonamesDbSimilarToken, j).token;
+
+      if (t < first_token || t >= last_token)
+        {
+          append_postings (db, t, tier, candidates);
+          n_lists++;
+        }
+    }
+
+  stats_add (&stats.n_rows_scanned, candidates->len);
+
+  /* postings of a single token are sorted and unique already */
+  if (n_lists > 1)
+    {
+      guint32 *rows = (guint32 *) candidates->data;
+      guint n = 0;
+      guint j;
+
+      g_array_sort (candidates, compare_rows);
+
+      for (j = 0; j < candidates->len; j++)
+        if (n == 0 || rows[n - 1] != rows[j])
+          rows[n++] = rows[j];
+
+      g_array_set_size (candidates, n);
+    }
+
+  return candidates;
+}
+
+/*
+ * Returns whether a city of tier could still be one of the top
+ * max_results matches, given the matches of the tiers before it. The
+ * best weight it could get is that of a prefix match of all query
+ * tokens in full (see calculate_weight()) by the most populous city of
+ * the tier, and the first row of the tier wins ties.
+ *
+ * Cities of later tiers have fewer inhabitants than the minimum of this
+ * one, so if the tier can't improve the results, neither can they.
+ */
+static gboolean
+tier_may_improve (GeonamesDb *db,
+                  GArray     *results,
+                  guint       max_results,
+                  guint       tier)
+{
+  Match best;
+  guint32 population;
+
+  if (max_results == 0 || results->len < max_results)
+    return TRUE;
+
+  population = db->tier_populations[tier];
+  if (tier > 0)
+    population = MIN (population, db->tier_min_populations[tier - 1] - 1);
+
+  best.index = db->tier_offsets[tier];
+  best.weight = (gdouble) CLAMP (population, 1, 1000000) / 1000000 + 1;
+
+  /* results is a heap with the worst match at the root */
+  return compare_matches (&best, &g_array_index (results, Match, 0)) < 0;
+}
+
+GeonamesQueryMatches *
+geonames_query_matches_ref (GeonamesQueryMatches *matches)
+{
+  g_atomic_int_inc (&matches->ref_count);
+
+  return matches;
+}
+
+void
+geonames_query_matches_unref (GeonamesQueryMatches *matches)
+{
+  if (g_atomic_int_dec_and_test (&matches->ref_count))
+    {
+      g_strfreev (matches->tokens);
+      g_array_unref (matches->rows);
+      g_slice_free (GeonamesQueryMatches, matches);
+    }
+}
+
+/*
+ * Returns TRUE if every city matching query_tokens also matches the
+ * query of previous, i.e., the last token of previous was extended or
+ * more tokens were added to it.
+ */
+static gboolean
+query_extends (GeonamesQueryMatches  *previous,
+               gchar                **query_tokens,
+               GeonamesDbLocale      *locale)
+{
+  guint n_previous;
+  guint i;
+
+  /* translations depend on the language */
+  if (previous->locale != locale)
+    return FALSE;
+
+  n_previous = g_strv_length (previous->tokens);
+  if (n_previous == 0 || g_strv_length (query_tokens) < n_previous)
+    return FALSE;
+
+  for (i = 0; i + 1 < n_previous; i++)
+    if (!g_str_equal (previous->tokens[i], query_tokens[i]))
+      return FALSE;
+
+  return g_str_has_prefix (query_tokens[i], previous->tokens[i]);
+}
+
+/* number of candidates scored between checks of the cancellable */
+#define CANCELLATION_INTERVAL 256
+
+/* default for the minimum number of candidates scored by one thread */
+#define DEFAULT_MIN_SHARD_SIZE 4096
+
+static gint max_threads = 0;
+static gint min_shard_size = DEFAULT_MIN_SHARD_SIZE;
+
+/*
+ * A contiguous range of candidates that is scored by one thread, with
+ * its own top max_results matches and list of matching rows.
+ *
+ * Batches score queries that share their candidates in one pass over
+ * them: the shards of those queries are linked through next_query from
+ * the one that owns the candidates, and have no candidates themselves.
+ */
+typedef struct _Shard Shard;
+
+struct _Shard
+{
+  GeonamesDb *db;
+  gchar **query_tokens;
+  TokenPrefix *prefixes;
+  GPtrArray *similar;
+  GeonamesDbLocale *locale;
+  GArray *candidates;
+  guint first;
+  guint last;
+  guint max_results;
+  GCancellable *cancellable;
+
+  GArray *results;
+  GArray *rows;
+  guint n_matches;
+  gboolean cancelled;
+
+  GMutex *lock;
+  GCond *done;
+  guint *n_pending;
+
+  Shard *next_query;
+};
+
+static void
+score_shard (Shard *shard)
+{
+  GeonamesDb *db = shard->db;
+  Shard *query;
+  guint i;
+
+  for (i = shard->first; i < shard->last; i++)
+    {
+      guint32 row = g_array_index (shard->candidates, guint32, i);
+      guint population = db->city_populations[row];
+      guint32 translation = geonames_db_get_city_translation (db, shard->locale, row);
+
+      if ((i - shard->first) % CANCELLATION_INTERVAL == 0 &&
+          g_cancellable_is_cancelled (shard->cancellable))
+        {
+          for (query = shard; query; query = query->next_query)
+            query->cancelled = TRUE;
+          return;
+        }
+
+      for (query = shard; query; query = query->next_query)
+        {
+          gdouble best_weight = 0;
+
+          best_weight = calculate_weight (db, query->query_tokens, query->prefixes, query->similar,
+                                          db->city_names[row], population, best_weight);
+
+          if (translation != GEONAMES_DB_NO_TRANSLATION)
+            best_weight = calculate_weight (db, query->query_tokens, query->prefixes, query->similar,
+                                            translation, population, best_weight);
+
+          if (best_weight > 0.0)
+            {
+              add_match (query->results, query->max_results, row, best_weight);
+              query->n_matches++;
+              if (query->rows)
+                g_array_append_val (query->rows, row);
+            }
+        }
+    }
+
+  for (query = shard; query; query = query->next_query)
+    {
+      stats_add (&stats.n_candidates_scored, shard->last - shard->first);
+      stats_add (&stats.n_matches, query->n_matches);
+    }
+}
+
+static void
+score_shard_in_thread (gpointer data,
+                       gpointer user_data)
+{
+  Shard *shard = data;
+
+  score_shard (shard);
+
+  g_mutex_lock (shard->lock);
+  if (--*shard->n_pending == 0)
+    g_cond_signal (shard->done);
+  g_mutex_unlock (shard->lock);
+}
+
+static GThreadPool *
+get_thread_pool (void)
+{
+  static GThreadPool *pool;
+
+  if (g_once_init_enter (&pool))
+    g_once_init_leave (&pool, g_thread_pool_new (score_shard_in_thread, NULL,
+                                                 g_get_num_processors (), FALSE, NULL));
+
+  return pool;
+}
+
+static guint
+get_max_threads (void)
+{
+  guint n_threads;
+
+  n_threads = g_atomic_int_get (&max_threads);
+  if (n_threads == 0)
+    n_threads = g_get_num_processors ();
+
+  return n_threads;
+}
+
+/*
+ * Sets the maximum number of threads a single query is scored on. If
+ * n_threads is 0, the number of available processors is used.
+ */
+void
+geonames_query_set_max_threads (guint n_threads)
+{
+  g_atomic_int_set (&max_threads, n_threads);
+}
+
+/*
+ * Sets the minimum number of candidates each thread scores, so that
+ * queries with few candidates are not split up.
+ */
+void
+geonames_query_set_min_shard_size (guint n_candidates)
+{
+  g_atomic_int_set (&min_shard_size, MAX (n_candidates, 1));
+}
+
+/*
+ * Scores all shards and returns when they are done. Unless threading
+ * is disabled, the first shard is scored on this thread while the
+ * others are scored in the thread pool.
+ */
+static void
+score_shards (Shard *shards,
+              guint  n_shards)
+{
+  guint n_pending;
+  GMutex lock;
+  GCond done;
+  guint i;
+
+  if (n_shards == 0)
+    return;
+
+  if (get_max_threads () == 1)
+    {
+      for (i = 0; i < n_shards; i++)
+        score_shard (&shards[i]);
+      return;
+    }
+
+  g_mutex_init (&lock);
+  g_cond_init (&done);
+  n_pending = n_shards - 1;
+
+  for (i = 1; i < n_shards; i++)
+    {
+      shards[i].lock = &lock;
+      shards[i].done = &done;
+      shards[i].n_pending = &n_pending;
+      g_thread_pool_push (get_thread_pool (), &shards[i], NULL);
+    }
+
+  score_shard (&shards[0]);
+
+  g_mutex_lock (&lock);
+  while (n_pending > 0)
+    g_cond_wait (&done, &lock);
+  g_mutex_unlock (&lock);
+
+  g_cond_clear (&done);
+  g_mutex_clear (&lock);
+}
+
+/*
+ * Scores candidates first up to (but not including) last, splitting
+ * them into shards that are scored on separate threads if there are
+ * enough of them. The top max_results matches of each shard are merged
+ * into results, which must be empty or a heap of matches as built by
+ * add_match(). Matching rows are appended to rows (if it isn't NULL) in
+ * the order of candidates, exactly as when scoring them in one go.
+ *
+ * Returns FALSE if cancellable was cancelled.
+ */
+static gboolean
+score_candidates (GeonamesDb       *db,
+                  gchar           **query_tokens,
+                  TokenPrefix      *prefixes,
+                  GPtrArray        *similar,
+                  GeonamesDbLocale *locale,
+                  GArray           *candidates,
+                  guint             first,
+                  guint             last,
+                  guint             max_results,
+                  GArray           *results,
+                  GArray           *rows,
+                  GCancellable     *cancellable)
+{
+  g_autofree Shard *shards = NULL;
+  guint n_shards;
+  gboolean cancelled = FALSE;
+  guint i, j;
+
+  n_shards = CLAMP ((last - first) / (guint) g_atomic_int_get (&min_shard_size), 1, get_max_threads ());
+
+  shards = g_new0 (Shard, n_shards);
+  for (i = 0; i < n_shards; i++)
+    {
+      shards[i].db = db;
+      shards[i].query_tokens = query_tokens;
+      shards[i].prefixes = prefixes;
+      shards[i].similar = similar;
+      shards[i].locale = locale;
+      shards[i].candidates = candidates;
+      shards[i].first = first + (guint64) (last - first) * i / n_shards;
+      shards[i].last = first + (guint64) (last - first) * (i + 1) / n_shards;
+      shards[i].max_results = max_results;
+      shards[i].cancellable = cancellable;
+      shards[i].results = i > 0 ? g_array_new (FALSE, FALSE, sizeof (Match)) : results;
+      shards[i].rows = (rows && i > 0) ? g_array_new (FALSE, FALSE, sizeof (guint32)) : rows;
+    }
+
+  score_shards (shards, n_shards);
+
+  for (i = 0; i < n_shards; i++)
+    {
+      cancelled |= shards[i].cancelled;
+
+      if (i == 0)
+        continue;
+
+      for (j = 0; j < shards[i].results->len; j++)
+        {
+          Match *match = &g_array_index (shards[i].results, Match, j);
+          add_match (results, max_results, match->index, match->weight);
+        }
+
+      if (rows)
+        {
+          g_array_append_vals (rows, shards[i].rows->data, shards[i].rows->len);
+          g_array_unref (shards[i].rows);
+        }
+
+      g_array_unref (shards[i].results);
+    }
+
+  return !cancelled;
+}
+
+static GArray *
+matches_to_indices (GArray *results)
+{
+  GArray *indices;
+  guint i;
+
+  g_array_sort (results, compare_matches);
+
+  indices = g_array_sized_new (FALSE, FALSE, sizeof (gint), results->len);
+  g_array_set_size (indices, results->len);
+  for (i = 0; i < results->len; i++)
+    g_array_index (indices, gint, i) = g_array_index (results, Match, i).index;
+
+  return indices;
+}
+
+/*
+ * Returns the indices of all cities matching query, best match first.
+ * If max_results is not 0, only that many of the best matches are
+ * returned.
+ *
+ * If previous is not NULL and query extends the query of previous, only
+ * the cities in previous are considered. If matches is not NULL, it is
+ * set to all cities matching query, for use as previous in a later
+ * call.
+ *
+ * Returns NULL and sets error if cancellable was cancelled before the
+ * query finished.
+ */
+GArray *
+geonames_query_cities_db (GeonamesDb            *db,
+                          const gchar           *query,
+                          GeonamesQueryFlags     flags,
+                          guint                  max_results,
+                          GeonamesQueryMatches  *previous,
+                          GeonamesQueryMatches **matches,
+                          GCancellable          *cancellable,
+                          GError               **error)
+{
+  g_auto(GStrv) query_tokens = NULL;
+  g_autofree TokenPrefix *prefixes = NULL;
+  g_autoptr(GPtrArray) similar = NULL;
+  GeonamesDbLocale *locale;
+  g_autoptr(GArray) results = NULL;
+  g_autoptr(GArray) rows = NULL;
+  GArray *previous_rows = NULL;
+  guint32 previous_end = 0;
+  GArray *rarest_similar = NULL;
+  gsize first_token, last_token;
+  gint rarest;
+  guint32 end = 0;
+  GArray *indices;
+  gint64 start;
+  guint tier;
+
+  g_return_val_if_fail (db != NULL, NULL);
+  g_return_val_if_fail (query != NULL, NULL);
+
+  start = g_get_monotonic_time ();
+
+  query_tokens = g_str_tokenize_and_fold (query, NULL, NULL);
+  locale = geonames_db_get_locale (db, g_get_language_names ());
+  prefixes = token_prefixes_new (query_tokens);
+  results = g_array_new (FALSE, FALSE, sizeof (Match));
+
+  if (flags & GEONAMES_QUERY_FUZZY)
+    similar = similar_tokens_new (db, query_tokens);
+
+  if (matches)
+    rows = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  /* Fuzzy queries tolerate fewer typos in shorter tokens, so they can
+   * match cities that a shorter query didn't. */
+  if (previous && similar == NULL && query_extends (previous, query_tokens, locale))
+    {
+      previous_rows = previous->rows;
+      previous_end = previous->end;
+    }
+
+  rarest = find_rarest_token (db, query_tokens, similar, &first_token, &last_token);
+  if (rarest >= 0 && similar)
+    rarest_similar = g_ptr_array_index (similar, rarest);
+
+  /* an empty query doesn't match anything */
+  tier = rarest >= 0 ? 0 : db->n_tiers;
+
+  /* Most populous cities first. Unless max_results is 0, the results
+   * are often complete before reaching the tiers with most cities.
+   */
+  for (; tier < db->n_tiers && tier_may_improve (db, results, max_results, tier); tier++)
+    {
+      g_autoptr(GArray) candidates = NULL;
+      guint first, last;
+
+      if (previous_rows && db->tier_offsets[tier + 1] <= previous_end)
+        {
+          candidates = g_array_ref (previous_rows);
+          first = lower_bound ((guint32 *) candidates->data, 0, candidates->len, db->tier_offsets[tier]);
+          last = lower_bound ((guint32 *) candidates->data, first, candidates->len, db->tier_offsets[tier + 1]);
+        }
+      else
+        {
+          candidates = lookup_candidates (db, first_token, last_token, rarest_similar, tier);
+          first = 0;
+          last = candidates->len;
+        }
+
+      if (!score_candidates (db, query_tokens, prefixes, similar, locale, candidates, first, last,
+                             max_results, results, rows, cancellable))
+        {
+          g_cancellable_set_error_if_cancelled (cancellable, error);
+          return NULL;
+        }
+
+      end = db->tier_offsets[tier + 1];
+    }
+
+  indices = matches_to_indices (results);
+
+  if (matches)
+    {
+      *matches = g_slice_new (GeonamesQueryMatches);
+      (*matches)->ref_count = 1;
+      (*matches)->tokens = g_steal_pointer (&query_tokens);
+      (*matches)->locale = locale;
+      (*matches)->rows = g_steal_pointer (&rows);
+      (*matches)->end = end;
+    }
+
+  stats_add_queries (start, 1, indices->len);
+
+  return indices;
+}
+
+/*
+ * Like geonames_query_cities_db(), but runs n_queries queries at once
+ * and returns an array with the indices of each of them, in the same
+ * order as queries.
+ *
+ * The locale is looked up once, queries that consist of the same tokens
+ * are only scored once, and the candidates for a token are collected
+ * and scanned only once for all queries using it, scoring each of them
+ * against all those queries. The scans are run concurrently.
+ */
+GPtrArray *
+geonames_query_cities_batch_db (GeonamesDb          *db,
+                                const gchar * const *queries,
+                                guint                n_queries,
+                                GeonamesQueryFlags   flags,
+                                guint                max_results,
+                                GCancellable        *cancellable,
+                                GError             **error)
+{
+  g_autoptr(GHashTable) distinct = NULL;
+  g_autoptr(GHashTable) cache = NULL;
+  g_autoptr(GArray) shards = NULL;
+  g_autoptr(GPtrArray) distinct_indices = NULL;
+  g_autofree guint *slots = NULL;
+  g_autofree const gchar **rarest_tokens = NULL;
+  g_autofree GArray **rarest_similar = NULL;
+  g_autofree gsize *first_tokens = NULL;
+  g_autofree gsize *last_tokens = NULL;
+  GeonamesDbLocale *locale;
+  GPtrArray *results = NULL;
+  gboolean cancelled = FALSE;
+  gsize n_results = 0;
+  gint64 start;
+  guint tier;
+  guint i;
+
+  g_return_val_if_fail (db != NULL, NULL);
+  g_return_val_if_fail (queries != NULL || n_queries == 0, NULL);
+
+  start = g_get_monotonic_time ();
+
+  locale = geonames_db_get_locale (db, g_get_language_names ());
+
+  distinct = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  cache = g_hash_table_new (g_str_hash, g_str_equal);
+  shards = g_array_new (FALSE, TRUE, sizeof (Shard));
+  slots = g_new (guint, n_queries);
+  rarest_tokens = g_new (const gchar *, n_queries);
+  rarest_similar = g_new (GArray *, n_queries);
+  first_tokens = g_new (gsize, n_queries);
+  last_tokens = g_new (gsize, n_queries);
+
+  for (i = 0; i < n_queries; i++)
+    {
+      gchar **query_tokens;
+      gchar *key;
+      gpointer slot;
+      gint rarest;
+      Shard shard = { 0, };
+
+      query_tokens = g_str_tokenize_and_fold (queries[i], NULL, NULL);
+      key = g_strjoinv (" ", query_tokens);
+
+      if (g_hash_table_lookup_extended (distinct, key, NULL, &slot))
+        {
+          slots[i] = GPOINTER_TO_UINT (slot);
+          g_strfreev (query_tokens);
+          g_free (key);
+          continue;
+        }
+
+      if (flags & GEONAMES_QUERY_FUZZY)
+        shard.similar = similar_tokens_new (db, query_tokens);
+
+      rarest = find_rarest_token (db, query_tokens, shard.similar,
+                                  &first_tokens[shards->len], &last_tokens[shards->len]);
+      rarest_tokens[shards->len] = rarest >= 0 ? query_tokens[rarest] : NULL;
+      rarest_similar[shards->len] = (rarest >= 0 && shard.similar) ? g_ptr_array_index (shard.similar, rarest) : NULL;
+
+      shard.db = db;
+      shard.query_tokens = query_tokens;
+      shard.prefixes = token_prefixes_new (query_tokens);
+      shard.locale = locale;
+      shard.max_results = max_results;
+      shard.cancellable = cancellable;
+      shard.results = g_array_new (FALSE, FALSE, sizeof (Match));
+
+      slots[i] = shards->len;
+      g_hash_table_insert (distinct, key, GUINT_TO_POINTER (shards->len));
+      g_array_append_val (shards, shard);
+    }
+
+  /* like geonames_query_cities_db(), tier by tier, until none of the
+   * queries can be improved by the next one */
+  for (tier = 0; tier < db->n_tiers && !cancelled; tier++)
+    {
+      gboolean more = FALSE;
+
+      /* candidates are collected and scanned once per tier for all
+       * queries with the same rarest token */
+      g_hash_table_remove_all (cache);
+
+      for (i = 0; i < shards->len; i++)
+        {
+          Shard *shard = &g_array_index (shards, Shard, i);
+          Shard *owner;
+
+          g_clear_pointer (&shard->candidates, g_array_unref);
+          shard->first = 0;
+          shard->last = 0;
+          shard->next_query = NULL;
+
+          if (rarest_tokens[i] == NULL || !tier_may_improve (db, shard->results, max_results, tier))
+            continue;
+
+          owner = g_hash_table_lookup (cache, rarest_tokens[i]);
+          if (owner)
+            {
+              shard->next_query = owner->next_query;
+              owner->next_query = shard;
+              continue;
+            }
+
+          shard->candidates = lookup_candidates (db, first_tokens[i], last_tokens[i], rarest_similar[i], tier);
+          shard->last = shard->candidates->len;
+          g_hash_table_insert (cache, (gpointer) rarest_tokens[i], shard);
+          more = TRUE;
+        }
+
+      if (!more)
+        break;
+
+      score_shards ((Shard *) shards->data, shards->len);
+
+      for (i = 0; i < shards->len; i++)
+        cancelled |= g_array_index (shards, Shard, i).cancelled;
+    }
+
+  distinct_indices = g_ptr_array_new_with_free_func ((GDestroyNotify) g_array_unref);
+  for (i = 0; i < shards->len; i++)
+    {
+      Shard *shard = &g_array_index (shards, Shard, i);
+
+      if (!cancelled)
+        g_ptr_array_add (distinct_indices, matches_to_indices (shard->results));
+
+      g_clear_pointer (&shard->candidates, g_array_unref);
+      g_strfreev (shard->query_tokens);
+      g_free (shard->prefixes);
+      g_clear_pointer (&shard->similar, g_ptr_array_unref);
+      g_array_unref (shard->results);
+    }
+
+  if (cancelled)
+    {
+      g_cancellable_set_error_if_cancelled (cancellable, error);
+      return NULL;
+    }
+
+  /* every query gets its own copy, so that callers can take them over */
+  results = g_ptr_array_new_full (n_queries, (GDestroyNotify) g_array_unref);
+  for (i = 0; i < n_queries; i++)
+    {
+      GArray *indices = g_ptr_array_index (distinct_indices, slots[i]);
+      GArray *copy;
+
+      copy = g_array_sized_new (FALSE, FALSE, sizeof (gint), indices->len);
+      g_array_append_vals (copy, indices->data, indices->len);
+      g_ptr_array_add (results, copy);
+
+      n_results += copy->len;
+    }
+
+  stats_add_queries (start, n_queries, n_results);
+
+  return results;
+}
+
+typedef struct
+{
+  guint32 index;
+  gdouble distance;
+} Neighbour;
+
+/* Orders neighbours by ascending distance, then by index */
+static gint
+compare_neighbours (gconstpointer a,
+                    gconstpointer b)
+{
+  const Neighbour *neighbour_a = a;
+  const Neighbour *neighbour_b = b;
+
+  if (neighbour_a->distance != neighbour_b->distance)
+    return neighbour_a->distance < neighbour_b->distance ? -1 : 1;
+
+  return compare_rows (&neighbour_a->index, &neighbour_b->index);
+}
+
+static void
+swap_neighbours (Neighbour *a,
+                 Neighbour *b)
+{
+  Neighbour tmp = *a;
+
+  *a = *b;
+  *b = tmp;
+}
+
+/*
+ * Adds a neighbour to the binary heap neighbours, which holds at most
+ * max_results elements with the farthest one at the root.
+ */
+static void
+add_neighbour (GArray  *neighbours,
+               guint    max_results,
+               guint32  index,
+               gdouble  distance)
+{
+  Neighbour neighbour = { index, distance };
+  Neighbour *heap;
+  guint i;
+
+  if (neighbours->len < max_results)
+    {
+      g_array_append_val (neighbours, neighbour);
+      heap = (Neighbour *) neighbours->data;
+
+      for (i = neighbours->len - 1; i > 0 && compare_neighbours (&heap[(i - 1) / 2], &heap[i]) < 0; i = (i - 1) / 2)
+        swap_neighbours (&heap[(i - 1) / 2], &heap[i]);
+
+      return;
+    }
+
+  heap = (Neighbour *) neighbours->data;
+  if (compare_neighbours (&neighbour, &heap[0]) >= 0)
+    return;
+
+  heap[0] = neighbour;
+
+  i = 0;
+  for (;;)
+    {
+      guint farthest = i;
+      guint child;
+
+      for (child = 2 * i + 1; child <= 2 * i + 2 && child < neighbours->len; child++)
+        if (compare_neighbours (&heap[child], &heap[farthest]) > 0)
+          farthest = child;
+
+      if (farthest == i)
+        break;
+
+      swap_neighbours (&heap[i], &heap[farthest]);
+      i = farthest;
+    }
+}
+
+static gdouble
+squared_distance (const gdouble *a,
+                  const gdouble *b)
+{
+  gdouble dx = a[0] - b[0];
+  gdouble dy = a[1] - b[1];
+  gdouble dz = a[2] - b[2];
+
+  return dx * dx + dy * dy + dz * dz;
+}
+
+/*
+ * Searches the subtree of the spatial index that consists of the nodes
+ * first up to (but not including) last.
+ */
+static void
+search_nearest (GeonamesDb    *db,
+                guint32        first,
+                guint32        last,
+                guint          depth,
+                const gdouble *point,
+                GArray        *neighbours,
+                guint          max_results)
+{
+  guint32 mid;
+  const gdouble *node;
+  gdouble delta;
+
+  if (first >= last)
+    return;
+
+  mid = first + (last - first) / 2;
+  node = db->spatial_points + 3 * mid;
+
+  add_neighbour (neighbours, max_results, db->spatial_rows[mid], squared_distance (point, node));
+
+  /* descend into the side of the splitting plane that contains point
+   * first, and only visit the other side if it can contain any closer
+   * cities than the ones found so far */
+  delta = point[depth % 3] - node[depth % 3];
+  if (delta < 0)
+    search_nearest (db, first, mid, depth + 1, point, neighbours, max_results);
+  else
+    search_nearest (db, mid + 1, last, depth + 1, point, neighbours, max_results);
+
+  if (neighbours->len < max_results ||
+      delta * delta <= g_array_index (neighbours, Neighbour, 0).distance)
+    {
+      if (delta < 0)
+        search_nearest (db, mid + 1, last, depth + 1, point, neighbours, max_results);
+      else
+        search_nearest (db, first, mid, depth + 1, point, neighbours, max_results);
+    }
+}
+
+/*
+ * Returns the indices of the max_results cities closest to latitude
+ * and longitude, closest first. If max_results is 0, all cities are
+ * returned.
+ */
+GArray *
+geonames_query_nearest_db (GeonamesDb *db,
+                           gdouble     latitude,
+                           gdouble     longitude,
+                           guint       max_results)
+{
+  g_autoptr(GArray) neighbours = NULL;
+  gdouble point[3];
+  GArray *indices;
+  guint i;
+
+  g_return_val_if_fail (db != NULL, NULL);
+
+  if (max_results == 0 || max_results > db->n_cities)
+    max_results = db->n_cities;
+
+  geonames_db_point_from_coordinates (latitude, longitude, point);
+
+  neighbours = g_array_sized_new (FALSE, FALSE, sizeof (Neighbour), max_results);
+  search_nearest (db, 0, db->n_cities, 0, point, neighbours, max_results);
+
+  g_array_sort (neighbours, compare_neighbours);
+
+  indices = g_array_sized_new (FALSE, FALSE, sizeof (gint), neighbours->len);
+  g_array_set_size (indices, neighbours->len);
+  for (i = 0; i < neighbours->len; i++)
+    g_array_index (indices, gint, i) = g_array_index (neighbours, Neighbour, i).index;
+
+  return indices;
+}
+
+/* mean radius of the earth in kilometers */
+#define EARTH_RADIUS 6371.0
+
+/*
+ * A bounding box of latitudes and longitudes in degrees, optionally
+ * restricted to the points within a maximum (squared chord) distance
+ * from center. If min_longitude is greater than max_longitude, the
+ * box crosses the antimeridian.
+ */
+typedef struct
+{
+  gdouble min_latitude;
+  gdouble max_latitude;
+  gdouble min_longitude;
+  gdouble max_longitude;
+  gdouble center[3];
+  gdouble max_distance;
+} Area;
+
+static gboolean
+area_contains (GeonamesDb *db,
+               const Area *area,
+               guint32     row)
+{
+  gdouble latitude = db->city_latitudes[row];
+  gdouble longitude = db->city_longitudes[row];
+
+  if (latitude < area->min_latitude || latitude > area->max_latitude)
+    return FALSE;
+
+  if (area->min_longitude <= area->max_longitude)
+    {
+      if (longitude < area->min_longitude || longitude > area->max_longitude)
+        return FALSE;
+    }
+  else
+    {
+      if (longitude < area->min_longitude && longitude > area->max_longitude)
+        return FALSE;
+    }
+
+  if (area->max_distance >= 0)
+    {
+      gdouble point[3];
+
+      geonames_db_point_from_coordinates (latitude, longitude, point);
+      return squared_distance (point, area->center) <= area->max_distance;
+    }
+
+  return TRUE;
+}
+
+/* the part of a grid cell that hasn't been visited yet */
+typedef struct
+{
+  guint32 position;
+  guint32 end;
+} Cursor;
+
+/*
+ * Returns whether the next city of a has a larger population than the
+ * next city of b, using the row to break ties.
+ */
+static gboolean
+cursor_precedes (GeonamesDb   *db,
+                 const Cursor *a,
+                 const Cursor *b)
+{
+  guint32 row_a = db->grid_rows[a->position];
+  guint32 row_b = db->grid_rows[b->position];
+
+  if (db->city_populations[row_a] != db->city_populations[row_b])
+    return db->city_populations[row_a] > db->city_populations[row_b];
+
+  return row_a < row_b;
+}
+
+static void
+sift_down_cursor (GeonamesDb *db,
+                  GArray     *cursors,
+                  guint       i)
+{
+  Cursor *heap = (Cursor *) cursors->data;
+
+  for (;;)
+    {
+      guint left = 2 * i + 1;
+      guint right = left + 1;
+      guint first = i;
+      Cursor tmp;
+
+      if (left < cursors->len && cursor_precedes (db, &heap[left], &heap[first]))
+        first = left;
+      if (right < cursors->len && cursor_precedes (db, &heap[right], &heap[first]))
+        first = right;
+
+      if (first == i)
+        break;
+
+      tmp = heap[i];
+      heap[i] = heap[first];
+      heap[first] = tmp;
+      i = first;
+    }
+}
+
+static void
+add_cell_cursors (GeonamesDb *db,
+                  GArray     *cursors,
+                  guint       latitude_cell,
+                  guint       first_longitude_cell,
+                  guint       n_longitude_cells,
+                  guint       min_population)
+{
+  guint i;
+
+  for (i = 0; i < n_longitude_cells; i++)
+    {
+      guint longitude_cell = (first_longitude_cell + i) % GEONAMES_DB_GRID_LONGITUDE_CELLS;
+      guint cell = latitude_cell * GEONAMES_DB_GRID_LONGITUDE_CELLS + longitude_cell;
+      Cursor cursor = { db->grid_offsets[cell], db->grid_offsets[cell + 1] };
+
+      if (cursor.position < cursor.end &&
+          db->city_populations[db->grid_rows[cursor.position]] >= min_population)
+        g_array_append_val (cursors, cursor);
+    }
+}
+
+/*
+ * Returns the indices of the cities in area with a population of at
+ * least min_population, largest population first.
+ *
+ * The cities of each grid cell are stored by descending population.
+ * This merges the cells overlapping area, so that it can stop as soon
+ * as max_results cities have been found or the next largest city is
+ * too small, without looking at the other cities in those cells.
+ */
+static GArray *
+search_area (GeonamesDb    *db,
+             const Area    *area,
+             guint          min_population,
+             guint          max_results,
+             GCancellable  *cancellable,
+             GError       **error)
+{
+  g_autoptr(GArray) cursors = NULL;
+  GArray *indices;
+  guint first_longitude_cell;
+  guint last_longitude_cell;
+  guint n_longitude_cells;
+  guint i, n_visited;
+
+  first_longitude_cell = geonames_db_grid_longitude_cell (area->min_longitude);
+  last_longitude_cell = geonames_db_grid_longitude_cell (area->max_longitude);
+
+  if (area->min_longitude > area->max_longitude && first_longitude_cell == last_longitude_cell)
+    n_longitude_cells = GEONAMES_DB_GRID_LONGITUDE_CELLS;
+  else
+    n_longitude_cells = (last_longitude_cell + GEONAMES_DB_GRID_LONGITUDE_CELLS - first_longitude_cell) %
+                        GEONAMES_DB_GRID_LONGITUDE_CELLS + 1;
+
+  cursors = g_array_new (FALSE, FALSE, sizeof (Cursor));
+  for (i = geonames_db_grid_latitude_cell (area->min_latitude);
+       i <= geonames_db_grid_latitude_cell (area->max_latitude);
+       i++)
+    add_cell_cursors (db, cursors, i, first_longitude_cell, n_longitude_cells, min_population);
+
+  for (i = cursors->len / 2; i > 0; i--)
+    sift_down_cursor (db, cursors, i - 1);
+
+  indices = g_array_new (FALSE, FALSE, sizeof (gint));
+
+  for (n_visited = 0; cursors->len > 0; n_visited++)
+    {
+      Cursor *top = &g_array_index (cursors, Cursor, 0);
+      guint32 row = db->grid_rows[top->position];
+
+      if (n_visited % CANCELLATION_INTERVAL == 0 &&
+          g_cancellable_set_error_if_cancelled (cancellable, error))
+        {
+          g_array_unref (indices);
+          return NULL;
+        }
+
+      /* all remaining cities are at most as large as this one */
+      if (db->city_populations[row] < min_population)
+        break;
+
+      if (area_contains (db, area, row))
+        {
+          gint index = row;
+
+          g_array_append_val (indices, index);
+          if (indices->len == max_results)
+            break;
+        }
+
+      top->position++;
+      if (top->position == top->end)
+        {
+          *top = g_array_index (cursors, Cursor, cursors->len - 1);
+          g_array_set_size (cursors, cursors->len - 1);
+        }
+
+      sift_down_cursor (db, cursors, 0);
+    }
+
+  return indices;
+}
+
+/*
+ * Returns the indices of the cities between the latitudes south and
+ * north and the longitudes west and east (in degrees), with a
+ * population of at least min_population, largest population first.
+ * If west is greater than east, the box crosses the antimeridian. If
+ * max_results is not 0, only that many cities are returned.
+ *
+ * Returns NULL and sets error if cancellable was cancelled before the
+ * query finished.
+ */
+GArray *
+geonames_query_bbox_db (GeonamesDb    *db,
+                        gdouble        south,
+                        gdouble        west,
+                        gdouble        north,
+                        gdouble        east,
+                        guint          min_population,
+                        guint          max_results,
+                        GCancellable  *cancellable,
+                        GError       **error)
+{
+  Area area = { 0, };
+
+  g_return_val_if_fail (db != NULL, NULL);
+
+  area.min_latitude = south;
+  area.max_latitude = north;
+  area.min_longitude = west;
+  area.max_longitude = east;
+  area.max_distance = -1;
+
+  if (south > north)
+    return g_array_new (FALSE, FALSE, sizeof (gint));
+
+  return search_area (db, &area, min_population, max_results, cancellable, error);
+}
+
+/*
+ * Like geonames_query_bbox_db(), but returns the cities within radius
+ * kilometers of latitude and longitude.
+ */
+GArray *
+geonames_query_radius_db (GeonamesDb    *db,
+                          gdouble        latitude,
+                          gdouble        longitude,
+                          gdouble        radius,
+                          guint          min_population,
+                          guint          max_results,
+                          GCancellable  *cancellable,
+                          GError       **error)
+{
+  Area area;
+  gdouble angle;
+  gdouble chord;
+
+  g_return_val_if_fail (db != NULL, NULL);
+
+  if (radius < 0)
+    return g_array_new (FALSE, FALSE, sizeof (gint));
+
+  angle = MIN (radius / EARTH_RADIUS, G_PI);
+  chord = 2 * sin (angle / 2);
+
+  geonames_db_point_from_coordinates (latitude, longitude, area.center);
+  area.max_distance = chord * chord;
+
+  area.min_latitude = latitude - angle * 180 / G_PI;
+  area.max_latitude = latitude + angle * 180 / G_PI;
+
+  if (area.min_latitude <= -90 || area.max_latitude >= 90)
+    {
+      /* the circle contains a pole */
+      area.min_longitude = -180;
+      area.max_longitude = 180;
+    }
+  else
+    {
+      gdouble delta = asin (sin (angle) / cos (latitude * G_PI / 180)) * 180 / G_PI;
+
+      area.min_longitude = longitude - delta;
+      area.max_longitude = longitude + delta;
+
+      if (area.min_longitude < -180)
+        area.min_longitude += 360;
+      if (area.max_longitude > 180)
+        area.max_longitude -= 360;
+    }
+
+  return search_area (db, &area, min_population, max_results, cancellable, error);
 }
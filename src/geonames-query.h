@@ -20,9 +20,75 @@
 #ifndef GEONAMES_QUERY
 #define GEONAMES_QUERY
 
-#include <gio/gio.h>
+#include "geonames-db.h"
+#include "geonames.h"
 
-GArray *                geonames_query_cities_db                        (GVariant    *db,
-                                                                         const gchar *query);
+/*
+ * The set of all cities matching a query, regardless of how many of
+ * them were returned. Queries that extend that query can only match a
+ * subset of those cities.
+ *
+ * Queries stop at the first tier that can't improve their results, so
+ * rows only contains the matching cities before row end.
+ */
+typedef struct
+{
+  gint ref_count;
+  gchar **tokens;
+  GeonamesDbLocale *locale;
+  GArray *rows;
+  guint32 end;
+} GeonamesQueryMatches;
+
+GeonamesQueryMatches *  geonames_query_matches_ref                      (GeonamesQueryMatches  *matches);
+
+void                    geonames_query_matches_unref                    (GeonamesQueryMatches  *matches);
+
+void                    geonames_query_get_stats                        (GeonamesStats         *stats);
+
+void                    geonames_query_set_max_threads                  (guint                  n_threads);
+
+void                    geonames_query_set_min_shard_size               (guint                  n_candidates);
+
+GArray *                geonames_query_cities_db                        (GeonamesDb            *db,
+                                                                         const gchar           *query,
+                                                                         GeonamesQueryFlags     flags,
+                                                                         guint                  max_results,
+                                                                         GeonamesQueryMatches  *previous,
+                                                                         GeonamesQueryMatches **matches,
+                                                                         GCancellable          *cancellable,
+                                                                         GError               **error);
+
+GPtrArray *             geonames_query_cities_batch_db                  (GeonamesDb            *db,
+                                                                         const gchar * const   *queries,
+                                                                         guint                  n_queries,
+                                                                         GeonamesQueryFlags     flags,
+                                                                         guint                  max_results,
+                                                                         GCancellable          *cancellable,
+                                                                         GError               **error);
+
+GArray *                geonames_query_nearest_db                       (GeonamesDb            *db,
+                                                                         gdouble                latitude,
+                                                                         gdouble                longitude,
+                                                                         guint                  max_results);
+
+GArray *                geonames_query_bbox_db                          (GeonamesDb            *db,
+                                                                         gdouble                south,
+                                                                         gdouble                west,
+                                                                         gdouble                north,
+                                                                         gdouble                east,
+                                                                         guint                  min_population,
+                                                                         guint                  max_results,
+                                                                         GCancellable          *cancellable,
+                                                                         GError               **error);
+
+GArray *                geonames_query_radius_db                        (GeonamesDb            *db,
+                                                                         gdouble                latitude,
+                                                                         gdouble                longitude,
+                                                                         gdouble                radius,
+                                                                         guint                  min_population,
+                                                                         guint                  max_results,
+                                                                         GCancellable          *cancellable,
+                                                                         GError               **error);
 
 #endif
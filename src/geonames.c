@@ -16,6 +16,7 @@
 
 #include "geonames.h"
 #include "geonames-query.h"
+#include <string.h>
 
 /**
  * SECTION: geonames
@@ -25,58 +26,410 @@
  *
  * This library provides access to a local copy of a subset of the city
  * and country data of geonames.org.
+ *
+ * The database is embedded into the library. If it was configured
+ * with --enable-mapped-database, the database installed into the
+ * package's data directory is memory-mapped instead. Setting the
+ * GEONAMES_DATABASE environment variable to the path of a database
+ * built by geonames-mkdb overrides both. A database file that is
+ * missing or invalid is reported with a warning, and the embedded
+ * database is used instead.
+ *
+ * Names are returned in the language of the environment, as returned
+ * by g_get_language_names() from the LANGUAGE, LC_ALL, LC_MESSAGES and
+ * LANG variables. Calling setlocale() with an explicit locale name
+ * does not change it.
  */
 
-static GVariant *geonames_data = NULL;
+static GeonamesDb *geonames_db = NULL;
+static gint64 geonames_db_load_time = 0;
 
-enum {
-  DATA_FIELD_CITIES,
-  DATA_FIELD_STATES,
-  DATA_FIELD_COUNTRIES,
-};
+/*
+ * Maps the database file at path, so that it's shared between all
+ * processes using it and doesn't need to be read at startup. Returns
+ * NULL with a warning if it can't be loaded.
+ */
+static GeonamesDb *
+map_database (const gchar *path)
+{
+  g_autoptr(GMappedFile) file = NULL;
+  g_autoptr(GBytes) data = NULL;
+  g_autoptr(GError) error = NULL;
+  GeonamesDb *db;
 
-enum {
-  CITY_FIELD_ID,
-  CITY_FIELD_NAME_EN,
-  CITY_FIELD_STATE_CODE,
-  CITY_FIELD_STATE_NAME_EN,
-  CITY_FIELD_COUNTRY_CODE,
-  CITY_FIELD_COUNTRY_NAME_EN,
-  CITY_FIELD_TIMEZONE,
-  CITY_FIELD_POPULATION,
-  CITY_FIELD_LATITUDE,
-  CITY_FIELD_LONGITUDE,
-};
+  file = g_mapped_file_new (path, FALSE, &error);
+  if (file == NULL)
+    {
+      g_warning ("unable to load geonames database: %s", error->message);
+      return NULL;
+    }
+
+  data = g_mapped_file_get_bytes (file);
+
+  db = geonames_db_new (data, &error);
+  if (db == NULL)
+    g_warning ("unable to load geonames database '%s': %s", path, error->message);
+
+  return db;
+}
+
+/*
+ * The database in the file named by GEONAMES_DATABASE or installed
+ * into the package's data directory is preferred. If that can't be
+ * loaded, the copy embedded into the library is used instead.
+ */
+static GeonamesDb *
+load_database (void)
+{
+  g_autoptr(GBytes) data = NULL;
+  g_autoptr(GError) error = NULL;
+  const gchar *path;
+  GeonamesDb *db = NULL;
+
+  path = g_getenv ("GEONAMES_DATABASE");
+  if (path)
+    db = map_database (path);
+
+#ifdef GEONAMES_DATABASE_PATH
+  if (db == NULL)
+    db = map_database (GEONAMES_DATABASE_PATH);
+#endif
+
+  if (db == NULL)
+    {
+      data = g_resources_lookup_data ("/com/ubuntu/geonames/cities.compiled", G_RESOURCE_LOOKUP_FLAGS_NONE, NULL);
+      g_assert (data);
+
+      db = geonames_db_new (data, &error);
+      if (db == NULL)
+        g_error ("unable to load the embedded geonames database: %s", error->message);
+    }
+
+  return db;
+}
 
 static void
 ensure_geonames_data (void)
 {
-  if (g_once_init_enter (&geonames_data))
+  if (g_once_init_enter (&geonames_db))
     {
-      g_autoptr(GBytes) data;
-      GVariant *v;
+      GeonamesDb *db;
+      gint64 start;
 
-      data = g_resources_lookup_data ("/com/ubuntu/geonames/cities.compiled", G_RESOURCE_LOOKUP_FLAGS_NONE, NULL);
-      g_assert (data);
+      start = g_get_monotonic_time ();
+
+      db = load_database ();
+
+      geonames_db_load_time = g_get_monotonic_time () - start;
 
-      v = g_variant_new_from_bytes (G_VARIANT_TYPE ("a(sssssssudd)"), data, TRUE);
+      g_once_init_leave (&geonames_db, db);
+    }
+}
+
+/**
+ * GeonamesQuerySession:
+ *
+ * A query session runs at most one query at a time. Submitting a query
+ * with geonames_query_session_query_cities() cancels the one that is
+ * still running, which is useful for search-as-you-type, where results
+ * for earlier keystrokes aren't needed anymore.
+ *
+ * A session also remembers which cities matched the last query. When
+ * the next query extends it (for example, because another letter was
+ * typed), only those cities are searched again.
+ */
+struct _GeonamesQuerySession
+{
+  gint ref_count;
+  GCancellable *cancellable;
 
-      g_once_init_leave (&geonames_data, v);
+  GMutex lock;
+  GeonamesQueryMatches *matches;
+};
+
+static GeonamesQuerySession *
+geonames_query_session_ref (GeonamesQuerySession *session)
+{
+  g_atomic_int_inc (&session->ref_count);
+
+  return session;
+}
+
+static void
+geonames_query_session_unref (GeonamesQuerySession *session)
+{
+  if (g_atomic_int_dec_and_test (&session->ref_count))
+    {
+      g_clear_object (&session->cancellable);
+      g_clear_pointer (&session->matches, geonames_query_matches_unref);
+      g_mutex_clear (&session->lock);
+      g_slice_free (GeonamesQuerySession, session);
     }
 }
 
+/* default number of query results kept in the query cache */
+#define DEFAULT_QUERY_CACHE_SIZE 128
+
+typedef struct
+{
+  gchar *key;
+  GArray *indices;
+} QueryCacheEntry;
+
+/*
+ * Results of recent queries by name, keyed by query_cache_key(). The
+ * hash table maps keys to links in query_cache_lru, which is ordered
+ * from most to least recently used.
+ */
+static GMutex query_cache_lock;
+static GHashTable *query_cache;
+static GQueue query_cache_lru = G_QUEUE_INIT;
+static guint query_cache_size = DEFAULT_QUERY_CACHE_SIZE;
+static guint64 query_cache_hits;
+static guint64 query_cache_misses;
+
+static GArray *
+copy_index_array (GArray *indices)
+{
+  GArray *copy;
+
+  copy = g_array_sized_new (FALSE, FALSE, sizeof (gint), indices->len);
+  g_array_append_vals (copy, indices->data, indices->len);
+
+  return copy;
+}
+
+static void
+query_cache_entry_free (QueryCacheEntry *entry)
+{
+  g_free (entry->key);
+  g_array_unref (entry->indices);
+  g_slice_free (QueryCacheEntry, entry);
+}
+
+/*
+ * Returns the key of a query in the query cache. Queries that consist
+ * of the same folded tokens have the same results, as long as they are
+ * run for the same language. Locales are never freed, so their address
+ * identifies the language.
+ */
+static gchar *
+query_cache_key (const gchar        *query,
+                 GeonamesQueryFlags  flags,
+                 guint               max_results)
+{
+  g_auto(GStrv) tokens = NULL;
+  g_autofree gchar *joined = NULL;
+  GeonamesDbLocale *locale;
+
+  tokens = g_str_tokenize_and_fold (query, NULL, NULL);
+  joined = g_strjoinv (" ", tokens);
+  locale = geonames_db_get_locale (geonames_db, g_get_language_names ());
+
+  return g_strdup_printf ("%p %u %u %s", (gpointer) locale, flags, max_results, joined);
+}
+
+/* must be called with query_cache_lock held */
+static void
+query_cache_trim (void)
+{
+  while (query_cache_lru.length > query_cache_size)
+    {
+      QueryCacheEntry *entry = g_queue_pop_tail (&query_cache_lru);
+
+      g_hash_table_remove (query_cache, entry->key);
+      query_cache_entry_free (entry);
+    }
+}
+
+/*
+ * Returns a copy of the cached results for key and marks them as the
+ * most recently used, or NULL if there are none.
+ */
+static GArray *
+query_cache_lookup (const gchar *key)
+{
+  GList *link = NULL;
+  GArray *indices = NULL;
+
+  g_mutex_lock (&query_cache_lock);
+
+  if (query_cache)
+    link = g_hash_table_lookup (query_cache, key);
+
+  if (link)
+    {
+      QueryCacheEntry *entry = link->data;
+
+      g_queue_unlink (&query_cache_lru, link);
+      g_queue_push_head_link (&query_cache_lru, link);
+
+      indices = copy_index_array (entry->indices);
+      query_cache_hits++;
+    }
+  else
+    {
+      query_cache_misses++;
+    }
+
+  g_mutex_unlock (&query_cache_lock);
+
+  return indices;
+}
+
+static void
+query_cache_insert (const gchar *key,
+                    GArray      *indices)
+{
+  g_mutex_lock (&query_cache_lock);
+
+  if (query_cache == NULL)
+    query_cache = g_hash_table_new (g_str_hash, g_str_equal);
+
+  /* another thread might have run the same query in the meantime */
+  if (query_cache_size > 0 && !g_hash_table_contains (query_cache, key))
+    {
+      QueryCacheEntry *entry;
+
+      entry = g_slice_new (QueryCacheEntry);
+      entry->key = g_strdup (key);
+      entry->indices = copy_index_array (indices);
+
+      g_queue_push_head (&query_cache_lru, entry);
+      g_hash_table_insert (query_cache, entry->key, query_cache_lru.head);
+
+      query_cache_trim ();
+    }
+
+  g_mutex_unlock (&query_cache_lock);
+}
+
+/*
+ * Like geonames_query_cities_db(), but returns cached results if the
+ * same query was run recently. matches is not set in that case.
+ */
+static GArray *
+query_cities (const gchar           *query,
+              GeonamesQueryFlags     flags,
+              guint                  max_results,
+              GeonamesQueryMatches  *previous,
+              GeonamesQueryMatches **matches,
+              GCancellable          *cancellable,
+              GError               **error)
+{
+  g_autofree gchar *key = NULL;
+  GArray *indices;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return NULL;
+
+  if (g_atomic_int_get (&query_cache_size) > 0)
+    {
+      key = query_cache_key (query, flags, max_results);
+
+      indices = query_cache_lookup (key);
+      if (indices)
+        return indices;
+    }
+
+  indices = geonames_query_cities_db (geonames_db, query, flags, max_results, previous, matches, cancellable, error);
+
+  if (indices && key)
+    query_cache_insert (key, indices);
+
+  return indices;
+}
+
+typedef struct
+{
+  gchar *query;
+  GeonamesQueryFlags flags;
+  guint max_results;
+  GeonamesQuerySession *session;
+} QueryData;
+
+static void
+query_data_free (gpointer data)
+{
+  QueryData *query_data = data;
+
+  g_free (query_data->query);
+  g_clear_pointer (&query_data->session, geonames_query_session_unref);
+  g_slice_free (QueryData, query_data);
+}
+
 static void
 task_func (GTask        *task,
            gpointer      source_object,
            gpointer      task_data,
            GCancellable *cancellable)
 {
-  gchar *query = task_data;
+  QueryData *data = task_data;
+  GeonamesQueryMatches *previous = NULL;
+  GeonamesQueryMatches *matches = NULL;
   GArray *indices;
+  GError *error = NULL;
+
+  if (data->session == NULL)
+    {
+      indices = query_cities (data->query, data->flags, data->max_results,
+                              NULL, NULL, cancellable, &error);
+    }
+  else
+    {
+      g_mutex_lock (&data->session->lock);
+      if (data->session->matches)
+        previous = geonames_query_matches_ref (data->session->matches);
+      g_mutex_unlock (&data->session->lock);
 
-  indices = geonames_query_cities_db (geonames_data, query);
+      indices = query_cities (data->query, data->flags, data->max_results,
+                              previous, &matches, cancellable, &error);
 
-  g_task_return_pointer (task, indices, (GDestroyNotify) g_array_unref);
+      /* don't replace the matches of a newer query, and keep the
+       * previous ones when the results came from the cache */
+      if (matches && !g_cancellable_is_cancelled (cancellable))
+        {
+          g_mutex_lock (&data->session->lock);
+          g_clear_pointer (&data->session->matches, geonames_query_matches_unref);
+          data->session->matches = g_steal_pointer (&matches);
+          g_mutex_unlock (&data->session->lock);
+        }
+
+      g_clear_pointer (&previous, geonames_query_matches_unref);
+      g_clear_pointer (&matches, geonames_query_matches_unref);
+    }
+
+  if (indices)
+    g_task_return_pointer (task, indices, (GDestroyNotify) g_array_unref);
+  else
+    g_task_return_error (task, error);
+}
+
+static void
+run_query (const gchar          *query,
+           GeonamesQueryFlags    flags,
+           guint                 max_results,
+           GeonamesQuerySession *session,
+           GCancellable         *cancellable,
+           GAsyncReadyCallback   callback,
+           gpointer              user_data)
+{
+  GTask *task;
+  QueryData *data;
+
+  ensure_geonames_data ();
+
+  data = g_slice_new (QueryData);
+  data->query = g_strdup (query);
+  data->flags = flags;
+  data->max_results = max_results;
+  data->session = session ? geonames_query_session_ref (session) : NULL;
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_task_data (task, data, query_data_free);
+
+  g_task_run_in_thread (task, task_func);
+  g_object_unref (task);
 }
 
 /**
@@ -93,62 +446,690 @@ task_func (GTask        *task,
  * from. Call geonames_query_cities_finish() from @callback to retrieve
  * the list of results.
  *
- * Results are weighted by how well and how many tokens match a
- * particular city, as well as importance of a city.
+ * Results are weighted by how well and how many tokens match a
+ * particular city, as well as importance of a city.
+ *
+ * If @query is empty, no results are returned.
+ */
+void
+geonames_query_cities (const gchar         *query,
+                       GeonamesQueryFlags   flags,
+                       GCancellable        *cancellable,
+                       GAsyncReadyCallback  callback,
+                       gpointer             user_data)
+{
+  geonames_query_cities_full (query, flags, 0, cancellable, callback, user_data);
+}
+
+/**
+ * geonames_query_cities_full:
+ * @query: the search string
+ * @flags: #GeonamesQueryFlags
+ * @max_results: the maximum number of results, or 0 for no limit
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: (nullable): a #GAsyncReadyCallback
+ * @user_data: user data passed into @callback
+ *
+ * Like geonames_query_cities(), but only returns the @max_results best
+ * matches. This is considerably faster than truncating the full list
+ * of results for short queries, which match a lot of cities.
+ *
+ * Call geonames_query_cities_finish() from @callback to retrieve the
+ * list of results.
+ */
+void
+geonames_query_cities_full (const gchar         *query,
+                            GeonamesQueryFlags   flags,
+                            guint                max_results,
+                            GCancellable        *cancellable,
+                            GAsyncReadyCallback  callback,
+                            gpointer             user_data)
+{
+  run_query (query, flags, max_results, NULL, cancellable, callback, user_data);
+}
+
+static gint *
+free_index_array (GArray *array,
+                  guint  *length)
+{
+  const gint sentinel = -1;
+
+  if (length)
+    *length = array->len;
+
+  /* append sentinel after taking the length */
+  g_array_append_val (array, sentinel);
+
+  return (gint *) g_array_free (array, FALSE);
+}
+
+/**
+ * geonames_query_cities_finish:
+ * @result: the #GAsyncResult from the callback passed to
+ *   geonames_query_cities()
+ * @length: (out) (optional): optional location for storing the number
+ *   of returned cities
+ * @error: a #GError
+ *
+ * Finishes an operation started with geonames_query_cities() and
+ * returns the resulting matches.
+ *
+ * Returns: (array length=@length): The list of cities matching the
+ * search query, as indices that can be passed into cities with
+ * geonames_get_city().
+ */
+gint *
+geonames_query_cities_finish (GAsyncResult        *result,
+                              guint               *length,
+                              GError             **error)
+{
+  GArray *array;
+
+  g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+
+  array = g_task_propagate_pointer (G_TASK (result), error);
+  if (array == NULL)
+    return NULL;
+
+  return free_index_array (array, length);
+}
+
+/**
+ * geonames_query_cities_sync:
+ * @query: the search string
+ * @flags: #GeonamesQueryFlags
+ * @cancellable: (nullable): a #GCancellable
+ * @length: (out) (optional): optional location for storing the number
+ *   of returned cities
+ * @error: a #GError
+ *
+ * Synchronous version of geonames_query_cities().
+ *
+ * Returns: (array length=@length): The list of cities matching the
+ * search query, as indices that can be passed into cities with
+ * geonames_get_city(), or %NULL if @cancellable was cancelled.
+ */
+gint *
+geonames_query_cities_sync (const gchar         *query,
+                            GeonamesQueryFlags   flags,
+                            guint               *length,
+                            GCancellable        *cancellable,
+                            GError             **error)
+{
+  return geonames_query_cities_full_sync (query, flags, 0, length, cancellable, error);
+}
+
+/**
+ * geonames_query_cities_full_sync:
+ * @query: the search string
+ * @flags: #GeonamesQueryFlags
+ * @max_results: the maximum number of results, or 0 for no limit
+ * @length: (out) (optional): optional location for storing the number
+ *   of returned cities
+ * @cancellable: (nullable): a #GCancellable
+ * @error: a #GError
+ *
+ * Synchronous version of geonames_query_cities_full().
+ *
+ * Returns: (array length=@length): The @max_results best matches for
+ * the search query, as indices that can be passed into
+ * geonames_get_city(), or %NULL if @cancellable was cancelled.
+ */
+gint *
+geonames_query_cities_full_sync (const gchar         *query,
+                                 GeonamesQueryFlags   flags,
+                                 guint                max_results,
+                                 guint               *length,
+                                 GCancellable        *cancellable,
+                                 GError             **error)
+{
+  GArray *indices;
+
+  ensure_geonames_data ();
+
+  indices = query_cities (query, flags, max_results, NULL, NULL, cancellable, error);
+  if (indices == NULL)
+    return NULL;
+
+  return free_index_array (indices, length);
+}
+
+/**
+ * geonames_query_cities_batch:
+ * @queries: (array zero-terminated=1): a %NULL-terminated array of
+ *   search strings
+ * @flags: #GeonamesQueryFlags
+ * @max_results: the maximum number of results per query, or 0 for no
+ *   limit
+ * @cancellable: (nullable): a #GCancellable
+ * @error: a #GError
+ *
+ * Runs all of @queries, with the same results as calling
+ * geonames_query_cities_full_sync() for each of them. This is much
+ * faster than separate calls when geocoding many strings: work that
+ * several queries have in common (like looking up the cities for a
+ * common word, or identical queries) is only done once, and the
+ * queries are run concurrently.
+ *
+ * Each element of the returned array is terminated by -1. Free them
+ * and the array itself with g_free().
+ *
+ * Returns: (array zero-terminated=1) (transfer full): The results of
+ * each query, in the same order as @queries, or %NULL if @cancellable
+ * was cancelled.
+ */
+gint **
+geonames_query_cities_batch (const gchar * const *queries,
+                             GeonamesQueryFlags   flags,
+                             guint                max_results,
+                             GCancellable        *cancellable,
+                             GError             **error)
+{
+  g_autoptr(GPtrArray) results = NULL;
+  gint **indices;
+  guint i;
+
+  g_return_val_if_fail (queries != NULL, NULL);
+
+  ensure_geonames_data ();
+
+  results = geonames_query_cities_batch_db (geonames_db, queries, g_strv_length ((gchar **) queries),
+                                            flags, max_results, cancellable, error);
+  if (results == NULL)
+    return NULL;
+
+  /* the arrays are taken over below */
+  g_ptr_array_set_free_func (results, NULL);
+
+  indices = g_new (gint *, results->len + 1);
+  for (i = 0; i < results->len; i++)
+    indices[i] = free_index_array (g_ptr_array_index (results, i), NULL);
+  indices[i] = NULL;
+
+  return indices;
+}
+
+/**
+ * geonames_query_session_new:
+ *
+ * Creates a new query session.
+ *
+ * Returns: (transfer full): a new #GeonamesQuerySession
+ */
+GeonamesQuerySession *
+geonames_query_session_new (void)
+{
+  GeonamesQuerySession *session;
+
+  session = g_slice_new0 (GeonamesQuerySession);
+  session->ref_count = 1;
+  g_mutex_init (&session->lock);
+
+  return session;
+}
+
+/**
+ * geonames_query_session_free:
+ * @session: a #GeonamesQuerySession
+ *
+ * Cancels the running query of @session, if any, and frees @session.
+ */
+void
+geonames_query_session_free (GeonamesQuerySession *session)
+{
+  g_return_if_fail (session != NULL);
+
+  geonames_query_session_cancel (session);
+  geonames_query_session_unref (session);
+}
+
+/**
+ * geonames_query_session_cancel:
+ * @session: a #GeonamesQuerySession
+ *
+ * Cancels the running query of @session, if any. Its callback is still
+ * called, and geonames_query_cities_finish() returns
+ * %G_IO_ERROR_CANCELLED.
+ */
+void
+geonames_query_session_cancel (GeonamesQuerySession *session)
+{
+  g_return_if_fail (session != NULL);
+
+  if (session->cancellable)
+    {
+      g_cancellable_cancel (session->cancellable);
+      g_clear_object (&session->cancellable);
+    }
+}
+
+/**
+ * geonames_query_session_query_cities:
+ * @session: a #GeonamesQuerySession
+ * @query: the search string
+ * @flags: #GeonamesQueryFlags
+ * @max_results: the maximum number of results, or 0 for no limit
+ * @callback: (nullable): a #GAsyncReadyCallback
+ * @user_data: user data passed into @callback
+ *
+ * Like geonames_query_cities_full(), but cancels the query that was
+ * previously submitted to @session if it hasn't finished yet. If
+ * @query extends the last query that finished in @session, only the
+ * cities that matched that query are searched.
+ *
+ * Call geonames_query_cities_finish() from @callback to retrieve the
+ * list of results.
+ */
+void
+geonames_query_session_query_cities (GeonamesQuerySession *session,
+                                     const gchar          *query,
+                                     GeonamesQueryFlags    flags,
+                                     guint                 max_results,
+                                     GAsyncReadyCallback   callback,
+                                     gpointer              user_data)
+{
+  g_return_if_fail (session != NULL);
+
+  geonames_query_session_cancel (session);
+  session->cancellable = g_cancellable_new ();
+
+  run_query (query, flags, max_results, session, session->cancellable, callback, user_data);
+}
+
+typedef struct
+{
+  gdouble latitude;
+  gdouble longitude;
+  guint max_results;
+} NearestData;
+
+static void
+nearest_data_free (gpointer data)
+{
+  g_slice_free (NearestData, data);
+}
+
+static void
+nearest_task_func (GTask        *task,
+                   gpointer      source_object,
+                   gpointer      task_data,
+                   GCancellable *cancellable)
+{
+  NearestData *data = task_data;
+  GArray *indices;
+
+  indices = geonames_query_nearest_db (geonames_db, data->latitude, data->longitude, data->max_results);
+
+  g_task_return_pointer (task, indices, (GDestroyNotify) g_array_unref);
+}
+
+/**
+ * geonames_query_nearest:
+ * @latitude: latitude in degrees
+ * @longitude: longitude in degrees
+ * @max_results: the maximum number of results, or 0 for all cities
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: (nullable): a #GAsyncReadyCallback
+ * @user_data: user data passed into @callback
+ *
+ * Asynchronously looks up the @max_results cities that are closest to
+ * @latitude and @longitude. When the operation is finished, @callback
+ * is called from the thread-default main context you are calling this
+ * method from. Call geonames_query_nearest_finish() from @callback to
+ * retrieve the list of results.
+ */
+void
+geonames_query_nearest (gdouble              latitude,
+                        gdouble              longitude,
+                        guint                max_results,
+                        GCancellable        *cancellable,
+                        GAsyncReadyCallback  callback,
+                        gpointer             user_data)
+{
+  GTask *task;
+  NearestData *data;
+
+  ensure_geonames_data ();
+
+  data = g_slice_new (NearestData);
+  data->latitude = latitude;
+  data->longitude = longitude;
+  data->max_results = max_results;
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_task_data (task, data, nearest_data_free);
+
+  g_task_run_in_thread (task, nearest_task_func);
+  g_object_unref (task);
+}
+
+/**
+ * geonames_query_nearest_finish:
+ * @result: the #GAsyncResult from the callback passed to
+ *   geonames_query_nearest()
+ * @length: (out) (optional): optional location for storing the number
+ *   of returned cities
+ * @error: a #GError
+ *
+ * Finishes an operation started with geonames_query_nearest() and
+ * returns the resulting cities.
+ *
+ * Returns: (array length=@length): The list of cities, closest first,
+ * as indices that can be passed into geonames_get_city().
+ */
+gint *
+geonames_query_nearest_finish (GAsyncResult  *result,
+                               guint         *length,
+                               GError       **error)
+{
+  GArray *array;
+
+  g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+
+  array = g_task_propagate_pointer (G_TASK (result), error);
+  if (array == NULL)
+    return NULL;
+
+  return free_index_array (array, length);
+}
+
+/**
+ * geonames_query_nearest_sync:
+ * @latitude: latitude in degrees
+ * @longitude: longitude in degrees
+ * @max_results: the maximum number of results, or 0 for all cities
+ * @length: (out) (optional): optional location for storing the number
+ *   of returned cities
+ * @cancellable: (nullable): a #GCancellable
+ * @error: a #GError
+ *
+ * Synchronous version of geonames_query_nearest().
+ *
+ * Returns: (array length=@length): The list of cities, closest first,
+ * as indices that can be passed into geonames_get_city(), or %NULL if
+ * @cancellable was cancelled.
+ */
+gint *
+geonames_query_nearest_sync (gdouble        latitude,
+                             gdouble        longitude,
+                             guint          max_results,
+                             guint         *length,
+                             GCancellable  *cancellable,
+                             GError       **error)
+{
+  GArray *indices;
+
+  ensure_geonames_data ();
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return NULL;
+
+  indices = geonames_query_nearest_db (geonames_db, latitude, longitude, max_results);
+
+  return free_index_array (indices, length);
+}
+
+typedef struct
+{
+  gdouble south;
+  gdouble west;
+  gdouble north;
+  gdouble east;
+  guint min_population;
+  guint max_results;
+} BboxData;
+
+static void
+bbox_data_free (gpointer data)
+{
+  g_slice_free (BboxData, data);
+}
+
+static void
+bbox_task_func (GTask        *task,
+                gpointer      source_object,
+                gpointer      task_data,
+                GCancellable *cancellable)
+{
+  BboxData *data = task_data;
+  GArray *indices;
+  GError *error = NULL;
+
+  indices = geonames_query_bbox_db (geonames_db, data->south, data->west, data->north, data->east,
+                                    data->min_population, data->max_results, cancellable, &error);
+
+  if (indices)
+    g_task_return_pointer (task, indices, (GDestroyNotify) g_array_unref);
+  else
+    g_task_return_error (task, error);
+}
+
+/**
+ * geonames_query_bbox:
+ * @south: southern latitude of the box in degrees
+ * @west: western longitude of the box in degrees
+ * @north: northern latitude of the box in degrees
+ * @east: eastern longitude of the box in degrees
+ * @min_population: the minimum population of returned cities
+ * @max_results: the maximum number of results, or 0 for no limit
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: (nullable): a #GAsyncReadyCallback
+ * @user_data: user data passed into @callback
+ *
+ * Asynchronously looks up the cities inside a bounding box that have
+ * a population of at least @min_population. If @west is greater than
+ * @east, the box crosses the antimeridian.
+ *
+ * The cities are returned largest first, so that a map showing a large
+ * area can ask for the @max_results most important ones without
+ * looking at all the others.
+ *
+ * When the operation is finished, @callback is called from the
+ * thread-default main context you are calling this method from. Call
+ * geonames_query_bbox_finish() from @callback to retrieve the list of
+ * results.
+ */
+void
+geonames_query_bbox (gdouble              south,
+                     gdouble              west,
+                     gdouble              north,
+                     gdouble              east,
+                     guint                min_population,
+                     guint                max_results,
+                     GCancellable        *cancellable,
+                     GAsyncReadyCallback  callback,
+                     gpointer             user_data)
+{
+  GTask *task;
+  BboxData *data;
+
+  ensure_geonames_data ();
+
+  data = g_slice_new (BboxData);
+  data->south = south;
+  data->west = west;
+  data->north = north;
+  data->east = east;
+  data->min_population = min_population;
+  data->max_results = max_results;
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_task_data (task, data, bbox_data_free);
+
+  g_task_run_in_thread (task, bbox_task_func);
+  g_object_unref (task);
+}
+
+/**
+ * geonames_query_bbox_finish:
+ * @result: the #GAsyncResult from the callback passed to
+ *   geonames_query_bbox()
+ * @length: (out) (optional): optional location for storing the number
+ *   of returned cities
+ * @error: a #GError
+ *
+ * Finishes an operation started with geonames_query_bbox() and returns
+ * the resulting cities.
+ *
+ * Returns: (array length=@length): The list of cities, largest first,
+ * as indices that can be passed into geonames_get_city().
+ */
+gint *
+geonames_query_bbox_finish (GAsyncResult  *result,
+                            guint         *length,
+                            GError       **error)
+{
+  GArray *array;
+
+  g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+
+  array = g_task_propagate_pointer (G_TASK (result), error);
+  if (array == NULL)
+    return NULL;
+
+  return free_index_array (array, length);
+}
+
+/**
+ * geonames_query_bbox_sync:
+ * @south: southern latitude of the box in degrees
+ * @west: western longitude of the box in degrees
+ * @north: northern latitude of the box in degrees
+ * @east: eastern longitude of the box in degrees
+ * @min_population: the minimum population of returned cities
+ * @max_results: the maximum number of results, or 0 for no limit
+ * @length: (out) (optional): optional location for storing the number
+ *   of returned cities
+ * @cancellable: (nullable): a #GCancellable
+ * @error: a #GError
+ *
+ * Synchronous version of geonames_query_bbox().
+ *
+ * Returns: (array length=@length): The list of cities, largest first,
+ * as indices that can be passed into geonames_get_city(), or %NULL if
+ * @cancellable was cancelled.
+ */
+gint *
+geonames_query_bbox_sync (gdouble        south,
+                          gdouble        west,
+                          gdouble        north,
+                          gdouble        east,
+                          guint          min_population,
+                          guint          max_results,
+                          guint         *length,
+                          GCancellable  *cancellable,
+                          GError       **error)
+{
+  GArray *indices;
+
+  ensure_geonames_data ();
+
+  indices = geonames_query_bbox_db (geonames_db, south, west, north, east,
+                                    min_population, max_results, cancellable, error);
+  if (indices == NULL)
+    return NULL;
+
+  return free_index_array (indices, length);
+}
+
+typedef struct
+{
+  gdouble latitude;
+  gdouble longitude;
+  gdouble radius;
+  guint min_population;
+  guint max_results;
+} RadiusData;
+
+static void
+radius_data_free (gpointer data)
+{
+  g_slice_free (RadiusData, data);
+}
+
+static void
+radius_task_func (GTask        *task,
+                  gpointer      source_object,
+                  gpointer      task_data,
+                  GCancellable *cancellable)
+{
+  RadiusData *data = task_data;
+  GArray *indices;
+  GError *error = NULL;
+
+  indices = geonames_query_radius_db (geonames_db, data->latitude, data->longitude, data->radius,
+                                      data->min_population, data->max_results, cancellable, &error);
+
+  if (indices)
+    g_task_return_pointer (task, indices, (GDestroyNotify) g_array_unref);
+  else
+    g_task_return_error (task, error);
+}
+
+/**
+ * geonames_query_radius:
+ * @latitude: latitude of the center in degrees
+ * @longitude: longitude of the center in degrees
+ * @radius: the radius in kilometers
+ * @min_population: the minimum population of returned cities
+ * @max_results: the maximum number of results, or 0 for no limit
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: (nullable): a #GAsyncReadyCallback
+ * @user_data: user data passed into @callback
+ *
+ * Like geonames_query_bbox(), but looks up the cities that are within
+ * @radius kilometers of @latitude and @longitude.
  *
- * If @query is empty, no results are returned.
+ * Call geonames_query_radius_finish() from @callback to retrieve the
+ * list of results.
  */
 void
-geonames_query_cities (const gchar         *query,
-                       GeonamesQueryFlags   flags,
+geonames_query_radius (gdouble              latitude,
+                       gdouble              longitude,
+                       gdouble              radius,
+                       guint                min_population,
+                       guint                max_results,
                        GCancellable        *cancellable,
                        GAsyncReadyCallback  callback,
                        gpointer             user_data)
 {
   GTask *task;
+  RadiusData *data;
 
   ensure_geonames_data ();
 
-  task = g_task_new (NULL, cancellable, callback, user_data);
-  g_task_set_task_data (task, g_strdup (query), g_free);
-
-  g_task_run_in_thread (task, task_func);
-}
-
-static gint *
-free_index_array (GArray *array,
-                  guint  *length)
-{
-  const gint sentinel = -1;
-
-  if (length)
-    *length = array->len;
+  data = g_slice_new (RadiusData);
+  data->latitude = latitude;
+  data->longitude = longitude;
+  data->radius = radius;
+  data->min_population = min_population;
+  data->max_results = max_results;
 
-  /* append sentinel after taking the length */
-  g_array_append_val (array, sentinel);
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_task_data (task, data, radius_data_free);
 
-  return (gint *) g_array_free (array, FALSE);
+  g_task_run_in_thread (task, radius_task_func);
+  g_object_unref (task);
 }
 
 /**
- * geonames_query_cities_finish:
+ * geonames_query_radius_finish:
  * @result: the #GAsyncResult from the callback passed to
- *   geonames_query_cities()
+ *   geonames_query_radius()
  * @length: (out) (optional): optional location for storing the number
  *   of returned cities
  * @error: a #GError
  *
- * Finishes an operation started with geonames_query_cities() and
- * returns the resulting matches.
+ * Finishes an operation started with geonames_query_radius() and
+ * returns the resulting cities.
  *
- * Returns: (array length=@length): The list of cities matching the
- * search query, as indices that can be passed into cities with
- * geonames_get_city().
+ * Returns: (array length=@length): The list of cities, largest first,
+ * as indices that can be passed into geonames_get_city().
  */
 gint *
-geonames_query_cities_finish (GAsyncResult        *result,
-                              guint               *length,
-                              GError             **error)
+geonames_query_radius_finish (GAsyncResult  *result,
+                              guint         *length,
+                              GError       **error)
 {
   GArray *array;
 
@@ -162,36 +1143,164 @@ geonames_query_cities_finish (GAsyncResult        *result,
 }
 
 /**
- * geonames_query_cities_sync:
- * @query: the search string
- * @flags: #GeonamesQueryFlags
- * @cancellable: (nullable): a #GCancellable
+ * geonames_query_radius_sync:
+ * @latitude: latitude of the center in degrees
+ * @longitude: longitude of the center in degrees
+ * @radius: the radius in kilometers
+ * @min_population: the minimum population of returned cities
+ * @max_results: the maximum number of results, or 0 for no limit
  * @length: (out) (optional): optional location for storing the number
  *   of returned cities
+ * @cancellable: (nullable): a #GCancellable
  * @error: a #GError
  *
- * Synchronous version of geonames_query_cities().
+ * Synchronous version of geonames_query_radius().
  *
- * Returns: (array length=@length): The list of cities matching the
- * search query, as indices that can be passed into cities with
- * geonames_get_city().
+ * Returns: (array length=@length): The list of cities, largest first,
+ * as indices that can be passed into geonames_get_city(), or %NULL if
+ * @cancellable was cancelled.
  */
 gint *
-geonames_query_cities_sync (const gchar         *query,
-                            GeonamesQueryFlags   flags,
-                            guint               *length,
-                            GCancellable        *cancellable,
-                            GError             **error)
+geonames_query_radius_sync (gdouble        latitude,
+                            gdouble        longitude,
+                            gdouble        radius,
+                            guint          min_population,
+                            guint          max_results,
+                            guint         *length,
+                            GCancellable  *cancellable,
+                            GError       **error)
 {
   GArray *indices;
 
   ensure_geonames_data ();
 
-  indices = geonames_query_cities_db (geonames_data, query);
+  indices = geonames_query_radius_db (geonames_db, latitude, longitude, radius,
+                                      min_population, max_results, cancellable, error);
+  if (indices == NULL)
+    return NULL;
 
   return free_index_array (indices, length);
 }
 
+/**
+ * geonames_set_max_query_threads:
+ * @n_threads: the maximum number of threads, or 0 for the number of
+ *   available processors
+ *
+ * Sets the maximum number of threads that the candidates of a single
+ * query by name are scored on. Setting it to 1 scores all of them on
+ * the thread that runs the query. The results don't depend on this
+ * setting.
+ *
+ * The default is the number of available processors.
+ */
+void
+geonames_set_max_query_threads (guint n_threads)
+{
+  geonames_query_set_max_threads (n_threads);
+}
+
+/**
+ * geonames_set_min_query_shard_size:
+ * @n_candidates: the minimum number of candidates per thread
+ *
+ * Sets the minimum number of candidates that each thread scores when a
+ * query by name is split up between threads, so that queries with few
+ * candidates are not slowed down by handing them to other threads.
+ *
+ * The default is 4096.
+ */
+void
+geonames_set_min_query_shard_size (guint n_candidates)
+{
+  geonames_query_set_min_shard_size (n_candidates);
+}
+
+/**
+ * geonames_set_query_cache_size:
+ * @n_entries: the maximum number of cached queries, or 0 to disable
+ *   the cache
+ *
+ * Sets how many results of queries by name are kept, so that running
+ * the same query again returns them right away. Queries are the same
+ * if they consist of the same words (ignoring case and accents), have
+ * the same @max_results and flags, and are run with the same language.
+ * The least recently used results are dropped first.
+ *
+ * The default is 128.
+ */
+void
+geonames_set_query_cache_size (guint n_entries)
+{
+  g_mutex_lock (&query_cache_lock);
+
+  g_atomic_int_set (&query_cache_size, n_entries);
+  if (query_cache)
+    query_cache_trim ();
+
+  g_mutex_unlock (&query_cache_lock);
+}
+
+/**
+ * geonames_get_query_cache_size:
+ *
+ * Returns: the maximum number of cached queries, as set with
+ *   geonames_set_query_cache_size()
+ */
+guint
+geonames_get_query_cache_size (void)
+{
+  return g_atomic_int_get (&query_cache_size);
+}
+
+/**
+ * geonames_get_query_cache_stats:
+ * @hits: (out) (optional): location for the number of queries that
+ *   were answered from the cache
+ * @misses: (out) (optional): location for the number of queries that
+ *   were not
+ *
+ * Retrieves how often the query cache was used since the program
+ * started, to help choose a size with geonames_set_query_cache_size().
+ * Queries run while the cache is disabled are not counted.
+ */
+void
+geonames_get_query_cache_stats (guint64 *hits,
+                                guint64 *misses)
+{
+  g_mutex_lock (&query_cache_lock);
+
+  if (hits)
+    *hits = query_cache_hits;
+  if (misses)
+    *misses = query_cache_misses;
+
+  g_mutex_unlock (&query_cache_lock);
+}
+
+/**
+ * geonames_get_stats:
+ * @stats: (out caller-allocates): a #GeonamesStats
+ *
+ * Retrieves statistics about the queries that were run since the
+ * program started. Keeping them up to date is cheap, so they are
+ * always collected.
+ */
+void
+geonames_get_stats (GeonamesStats *stats)
+{
+  g_return_if_fail (stats != NULL);
+
+  memset (stats, 0, sizeof (GeonamesStats));
+
+  geonames_query_get_stats (stats);
+  geonames_get_query_cache_stats (&stats->n_cache_hits, &stats->n_cache_misses);
+
+  /* written before geonames_db is set */
+  if (g_atomic_pointer_get (&geonames_db))
+    stats->load_time_us = geonames_db_load_time;
+}
+
 /**
  * geonames_get_n_cities:
  *
@@ -204,7 +1313,82 @@ geonames_get_n_cities (void)
 {
   ensure_geonames_data ();
 
-  return g_variant_n_children (geonames_data);
+  return geonames_db_get_n_cities (geonames_db);
+}
+
+/*
+ * A #GeonamesCity is a uint32 variant holding the index of the city in
+ * the columns of geonames_db.
+ */
+static guint32
+city_get_index (GeonamesCity *city)
+{
+  return g_variant_get_uint32 (city);
+}
+
+/*
+ * The locale get_locale() returned last on a thread, and the language
+ * list it was for. g_get_language_names() returns the same array until
+ * the environment changes. Its names are compared as well, because a
+ * new array can be allocated where a freed one was.
+ */
+typedef struct
+{
+  const gchar * const *languages;
+  gchar **names;
+  GeonamesDbLocale *locale;
+} LocaleCache;
+
+static void
+locale_cache_free (gpointer data)
+{
+  LocaleCache *cache = data;
+
+  g_strfreev (cache->names);
+  g_slice_free (LocaleCache, cache);
+}
+
+static GPrivate locale_cache = G_PRIVATE_INIT (locale_cache_free);
+
+static gboolean
+locale_cache_matches (LocaleCache         *cache,
+                      const gchar * const *languages)
+{
+  guint i;
+
+  if (cache->languages != languages)
+    return FALSE;
+
+  for (i = 0; languages[i] && cache->names[i]; i++)
+    if (!g_str_equal (languages[i], cache->names[i]))
+      return FALSE;
+
+  return languages[i] == NULL && cache->names[i] == NULL;
+}
+
+/* translations for the current language */
+static GeonamesDbLocale *
+get_locale (void)
+{
+  const gchar * const *languages = g_get_language_names ();
+  LocaleCache *cache;
+
+  cache = g_private_get (&locale_cache);
+  if (cache == NULL)
+    {
+      cache = g_slice_new0 (LocaleCache);
+      g_private_set (&locale_cache, cache);
+    }
+
+  if (!locale_cache_matches (cache, languages))
+    {
+      g_strfreev (cache->names);
+      cache->languages = languages;
+      cache->names = g_strdupv ((gchar **) languages);
+      cache->locale = geonames_db_get_locale (geonames_db, languages);
+    }
+
+  return cache->locale;
 }
 
 /**
@@ -220,9 +1404,9 @@ geonames_get_city (gint index)
 {
   ensure_geonames_data ();
 
-  g_return_val_if_fail (index < g_variant_n_children (geonames_data), NULL);
+  g_return_val_if_fail (index >= 0 && index < geonames_db_get_n_cities (geonames_db), NULL);
 
-  return g_variant_get_child_value (geonames_data, index);
+  return g_variant_ref_sink (g_variant_new_uint32 (index));
 }
 
 /**
@@ -237,6 +1421,59 @@ geonames_city_free (GeonamesCity *city)
   g_variant_unref (city);
 }
 
+static const gchar *
+city_name (GeonamesDbLocale *locale,
+           guint32           i)
+{
+  guint32 name;
+
+  name = geonames_db_get_city_translation (geonames_db, locale, i);
+  if (name == GEONAMES_DB_NO_TRANSLATION)
+    name = geonames_db->city_names[i];
+
+  return geonames_db_get_name (geonames_db, name);
+}
+
+static const gchar *
+city_state (GeonamesDbLocale *locale,
+            guint32           i)
+{
+  guint16 state = geonames_db->city_states[i];
+  guint32 name;
+
+  name = geonames_db_get_state_translation (geonames_db, locale, state);
+  if (name == GEONAMES_DB_NO_TRANSLATION)
+    name = geonames_db->state_names[state];
+
+  return geonames_db_get_string (geonames_db, name);
+}
+
+static const gchar *
+city_country (GeonamesDbLocale *locale,
+              guint32           i)
+{
+  guint16 country = geonames_db->city_countries[i];
+  guint32 name;
+
+  name = geonames_db_get_country_translation (geonames_db, locale, country);
+  if (name == GEONAMES_DB_NO_TRANSLATION)
+    name = geonames_db->country_names[country];
+
+  return geonames_db_get_string (geonames_db, name);
+}
+
+static const gchar *
+city_country_code (guint32 i)
+{
+  return geonames_db_get_string (geonames_db, geonames_db->countries[geonames_db->city_countries[i]]);
+}
+
+static const gchar *
+city_timezone (guint32 i)
+{
+  return geonames_db_get_string (geonames_db, geonames_db->timezones[geonames_db->city_timezones[i]]);
+}
+
 /**
  * geonames_city_get_name:
  * @city: a #GeonamesCity
@@ -246,16 +1483,7 @@ geonames_city_free (GeonamesCity *city)
 const gchar *
 geonames_city_get_name (GeonamesCity *city)
 {
-  const gchar *name;
-  const gchar *id;
-
-  g_variant_get_child (city, CITY_FIELD_ID, "&s", &id);
-
-  name = g_dgettext (PACKAGE, id);
-  if (g_strcmp0 (name, id) == 0)
-    g_variant_get_child (city, CITY_FIELD_NAME_EN, "&s", &name);
-
-  return name;
+  return city_name (get_locale (), city_get_index (city));
 }
 
 /**
@@ -267,20 +1495,7 @@ geonames_city_get_name (GeonamesCity *city)
 const gchar *
 geonames_city_get_state (GeonamesCity *city)
 {
-  const gchar *state;
-  const gchar *state_code;
-  const gchar *country_code;
-  g_autofree gchar *index;
-
-  g_variant_get_child (city, CITY_FIELD_STATE_CODE, "&s", &state_code);
-  g_variant_get_child (city, CITY_FIELD_COUNTRY_CODE, "&s", &country_code);
-  index = g_strdup_printf ("%s.%s", country_code, state_code);
-
-  state = g_dgettext (PACKAGE, index);
-  if (g_strcmp0 (state, index) == 0)
-    g_variant_get_child (city, CITY_FIELD_STATE_NAME_EN, "&s", &state);
-
-  return state;
+  return city_state (get_locale (), city_get_index (city));
 }
 
 /**
@@ -292,16 +1507,7 @@ geonames_city_get_state (GeonamesCity *city)
 const gchar *
 geonames_city_get_country (GeonamesCity *city)
 {
-  const gchar *country;
-  const gchar *code;
-
-  g_variant_get_child (city, CITY_FIELD_COUNTRY_CODE, "&s", &code);
-
-  country = g_dgettext (PACKAGE, code);
-  if (g_strcmp0 (country, code) == 0)
-    g_variant_get_child (city, CITY_FIELD_COUNTRY_NAME_EN, "&s", &country);
-
-  return country;
+  return city_country (get_locale (), city_get_index (city));
 }
 
 /**
@@ -313,11 +1519,7 @@ geonames_city_get_country (GeonamesCity *city)
 const gchar *
 geonames_city_get_country_code (GeonamesCity *city)
 {
-  const gchar *country_code;
-
-  g_variant_get_child (city, CITY_FIELD_COUNTRY_CODE, "&s", &country_code);
-
-  return country_code;
+  return city_country_code (city_get_index (city));
 }
 
 /**
@@ -329,11 +1531,7 @@ geonames_city_get_country_code (GeonamesCity *city)
 const gchar *
 geonames_city_get_timezone (GeonamesCity *city)
 {
-  const gchar *timezone;
-
-  g_variant_get_child (city, CITY_FIELD_TIMEZONE, "&s", &timezone);
-
-  return timezone;
+  return city_timezone (city_get_index (city));
 }
 
 /**
@@ -345,11 +1543,7 @@ geonames_city_get_timezone (GeonamesCity *city)
 gdouble
 geonames_city_get_latitude (GeonamesCity *city)
 {
-  gdouble latitude;
-
-  g_variant_get_child (city, CITY_FIELD_LATITUDE, "d", &latitude);
-
-  return latitude;
+  return geonames_db->city_latitudes[city_get_index (city)];
 }
 
 /**
@@ -361,11 +1555,7 @@ geonames_city_get_latitude (GeonamesCity *city)
 gdouble
 geonames_city_get_longitude (GeonamesCity *city)
 {
-  gdouble longitude;
-
-  g_variant_get_child (city, CITY_FIELD_LONGITUDE, "d", &longitude);
-
-  return longitude;
+  return geonames_db->city_longitudes[city_get_index (city)];
 }
 
 
@@ -378,9 +1568,176 @@ geonames_city_get_longitude (GeonamesCity *city)
 guint
 geonames_city_get_population (GeonamesCity *city)
 {
-  guint population;
+  return geonames_db->city_populations[city_get_index (city)];
+}
+
+static gboolean
+is_valid_index (gint index)
+{
+  ensure_geonames_data ();
+
+  return index >= 0 && index < geonames_db_get_n_cities (geonames_db);
+}
+
+/**
+ * geonames_get_city_name:
+ * @index: the index of a city
+ *
+ * Like geonames_city_get_name(), but takes the index of the city
+ * directly instead of a #GeonamesCity.
+ *
+ * Returns: the name of the city at @index, in the current language
+ */
+const gchar *
+geonames_get_city_name (gint index)
+{
+  g_return_val_if_fail (is_valid_index (index), NULL);
+
+  return city_name (get_locale (), index);
+}
+
+/**
+ * geonames_get_city_state:
+ * @index: the index of a city
+ *
+ * Returns: the state of the city at @index
+ */
+const gchar *
+geonames_get_city_state (gint index)
+{
+  g_return_val_if_fail (is_valid_index (index), NULL);
+
+  return city_state (get_locale (), index);
+}
+
+/**
+ * geonames_get_city_country:
+ * @index: the index of a city
+ *
+ * Returns: the country of the city at @index
+ */
+const gchar *
+geonames_get_city_country (gint index)
+{
+  g_return_val_if_fail (is_valid_index (index), NULL);
+
+  return city_country (get_locale (), index);
+}
+
+/**
+ * geonames_get_city_country_code:
+ * @index: the index of a city
+ *
+ * Returns: the ISO-3166 two-letter country code of the city at @index
+ */
+const gchar *
+geonames_get_city_country_code (gint index)
+{
+  g_return_val_if_fail (is_valid_index (index), NULL);
+
+  return city_country_code (index);
+}
+
+/**
+ * geonames_get_city_timezone:
+ * @index: the index of a city
+ *
+ * Returns: the timezone of the city at @index
+ */
+const gchar *
+geonames_get_city_timezone (gint index)
+{
+  g_return_val_if_fail (is_valid_index (index), NULL);
+
+  return city_timezone (index);
+}
+
+/**
+ * geonames_get_city_latitude:
+ * @index: the index of a city
+ *
+ * Returns: the latitude of the city at @index
+ */
+gdouble
+geonames_get_city_latitude (gint index)
+{
+  g_return_val_if_fail (is_valid_index (index), 0.0);
+
+  return geonames_db->city_latitudes[index];
+}
+
+/**
+ * geonames_get_city_longitude:
+ * @index: the index of a city
+ *
+ * Returns: the longitude of the city at @index
+ */
+gdouble
+geonames_get_city_longitude (gint index)
+{
+  g_return_val_if_fail (is_valid_index (index), 0.0);
+
+  return geonames_db->city_longitudes[index];
+}
+
+/**
+ * geonames_get_city_population:
+ * @index: the index of a city
+ *
+ * Returns: the population of the city at @index
+ */
+guint
+geonames_get_city_population (gint index)
+{
+  g_return_val_if_fail (is_valid_index (index), 0);
+
+  return geonames_db->city_populations[index];
+}
+
+/**
+ * geonames_get_cities_info:
+ * @indices: (array length=n_indices): indices of cities, for example
+ *   the result of a query
+ * @n_indices: the number of elements in @indices
+ * @infos: (out caller-allocates) (array length=n_indices): an array of
+ *   at least @n_indices #GeonamesCityInfo
+ *
+ * Fills @infos with everything that is known about the cities at
+ * @indices, in the same order. This is the cheapest way to show the
+ * results of a query: it doesn't allocate, and looks up the
+ * translations for the current language only once.
+ */
+void
+geonames_get_cities_info (const gint       *indices,
+                          guint             n_indices,
+                          GeonamesCityInfo *infos)
+{
+  GeonamesDbLocale *locale;
+  gint n_cities;
+  guint i;
+
+  g_return_if_fail (indices != NULL || n_indices == 0);
+  g_return_if_fail (infos != NULL || n_indices == 0);
+
+  ensure_geonames_data ();
 
-  g_variant_get_child (city, CITY_FIELD_POPULATION, "u", &population);
+  locale = get_locale ();
+  n_cities = geonames_db_get_n_cities (geonames_db);
 
-  return population;
+  for (i = 0; i < n_indices; i++)
+    {
+      GeonamesCityInfo *info = &infos[i];
+      gint index = indices[i];
+
+      g_return_if_fail (index >= 0 && index < n_cities);
+
+      info->name = city_name (locale, index);
+      info->state = city_state (locale, index);
+      info->country = city_country (locale, index);
+      info->country_code = city_country_code (index);
+      info->timezone = city_timezone (index);
+      info->latitude = geonames_db->city_latitudes[index];
+      info->longitude = geonames_db->city_longitudes[index];
+      info->population = geonames_db->city_populations[index];
+    }
 }
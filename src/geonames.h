@@ -31,16 +31,90 @@ G_BEGIN_DECLS
 /**
  * GeonamesQueryFlags:
  * @GEONAMES_QUERY_DEFAULT: no flags
+ * @GEONAMES_QUERY_FUZZY: also match names that differ from the query
+ *   by a few typos, ranked below the names that match exactly
  *
  * Flags used when querying the geonames database.
  */
 typedef enum
 {
-  GEONAMES_QUERY_DEFAULT
+  GEONAMES_QUERY_DEFAULT = 0,
+  GEONAMES_QUERY_FUZZY   = 1 << 0
 } GeonamesQueryFlags;
 
 typedef GVariant GeonamesCity;
 
+typedef struct _GeonamesQuerySession GeonamesQuerySession;
+
+/**
+ * GeonamesStats:
+ * @n_queries: the number of queries by name that were run (not
+ *   counting those answered from the query cache)
+ * @n_rows_scanned: the number of rows read from the token index to
+ *   find the candidates of those queries
+ * @n_candidates_scored: the number of candidate cities that were
+ *   scored against a query
+ * @n_matches: the number of candidates that matched a query
+ * @n_results: the number of cities that were returned
+ * @query_time_us: the total time spent running queries, in
+ *   microseconds
+ * @max_query_time_us: the longest time a single query took, in
+ *   microseconds
+ * @n_cache_hits: the number of queries answered from the query cache
+ * @n_cache_misses: the number of queries that were not
+ * @load_time_us: the time it took to load the database, in
+ *   microseconds, or 0 if it hasn't been loaded yet
+ *
+ * Statistics about the queries run since the program started,
+ * retrieved with geonames_get_stats().
+ */
+typedef struct
+{
+  guint64 n_queries;
+  guint64 n_rows_scanned;
+  guint64 n_candidates_scored;
+  guint64 n_matches;
+  guint64 n_results;
+  guint64 query_time_us;
+  guint64 max_query_time_us;
+  guint64 n_cache_hits;
+  guint64 n_cache_misses;
+  guint64 load_time_us;
+
+  /*< private >*/
+  guint64 padding[6];
+} GeonamesStats;
+
+/**
+ * GeonamesCityInfo:
+ * @name: the name of the city, in the current language
+ * @state: the state of the city
+ * @country: the country of the city
+ * @country_code: the ISO-3166 two-letter country code of the city
+ * @timezone: the timezone of the city
+ * @latitude: the latitude of the city
+ * @longitude: the longitude of the city
+ * @population: the population of the city
+ *
+ * Everything that is known about a city, filled in by
+ * geonames_get_cities_info(). The strings are owned by the database
+ * and stay valid until the program exits.
+ */
+typedef struct
+{
+  const gchar *name;
+  const gchar *state;
+  const gchar *country;
+  const gchar *country_code;
+  const gchar *timezone;
+  gdouble latitude;
+  gdouble longitude;
+  guint population;
+
+  /*< private >*/
+  gpointer padding[4];
+} GeonamesCityInfo;
+
 _GEONAMES_EXPORT
 void                    geonames_query_cities                           (const gchar         *query,
                                                                          GeonamesQueryFlags    flags,
@@ -59,6 +133,138 @@ gint *                  geonames_query_cities_sync                      (const g
                                                                          GCancellable        *cancellable,
                                                                          GError             **error);
 
+_GEONAMES_EXPORT
+void                    geonames_query_cities_full                      (const gchar         *query,
+                                                                         GeonamesQueryFlags   flags,
+                                                                         guint                max_results,
+                                                                         GCancellable        *cancellable,
+                                                                         GAsyncReadyCallback  callback,
+                                                                         gpointer             user_data);
+
+_GEONAMES_EXPORT
+gint *                  geonames_query_cities_full_sync                 (const gchar         *query,
+                                                                         GeonamesQueryFlags   flags,
+                                                                         guint                max_results,
+                                                                         guint               *length,
+                                                                         GCancellable        *cancellable,
+                                                                         GError             **error);
+
+_GEONAMES_EXPORT
+gint **                 geonames_query_cities_batch                     (const gchar * const *queries,
+                                                                         GeonamesQueryFlags   flags,
+                                                                         guint                max_results,
+                                                                         GCancellable        *cancellable,
+                                                                         GError             **error);
+
+_GEONAMES_EXPORT
+GeonamesQuerySession *  geonames_query_session_new                      (void);
+
+_GEONAMES_EXPORT
+void                    geonames_query_session_free                     (GeonamesQuerySession *session);
+
+_GEONAMES_EXPORT
+void                    geonames_query_session_cancel                   (GeonamesQuerySession *session);
+
+_GEONAMES_EXPORT
+void                    geonames_query_session_query_cities             (GeonamesQuerySession *session,
+                                                                         const gchar          *query,
+                                                                         GeonamesQueryFlags    flags,
+                                                                         guint                 max_results,
+                                                                         GAsyncReadyCallback   callback,
+                                                                         gpointer              user_data);
+
+_GEONAMES_EXPORT
+void                    geonames_query_nearest                          (gdouble              latitude,
+                                                                         gdouble              longitude,
+                                                                         guint                max_results,
+                                                                         GCancellable        *cancellable,
+                                                                         GAsyncReadyCallback  callback,
+                                                                         gpointer             user_data);
+
+_GEONAMES_EXPORT
+gint *                  geonames_query_nearest_finish                   (GAsyncResult        *result,
+                                                                         guint               *length,
+                                                                         GError             **error);
+
+_GEONAMES_EXPORT
+gint *                  geonames_query_nearest_sync                     (gdouble              latitude,
+                                                                         gdouble              longitude,
+                                                                         guint                max_results,
+                                                                         guint               *length,
+                                                                         GCancellable        *cancellable,
+                                                                         GError             **error);
+
+_GEONAMES_EXPORT
+void                    geonames_query_bbox                             (gdouble              south,
+                                                                         gdouble              west,
+                                                                         gdouble              north,
+                                                                         gdouble              east,
+                                                                         guint                min_population,
+                                                                         guint                max_results,
+                                                                         GCancellable        *cancellable,
+                                                                         GAsyncReadyCallback  callback,
+                                                                         gpointer             user_data);
+
+_GEONAMES_EXPORT
+gint *                  geonames_query_bbox_finish                      (GAsyncResult        *result,
+                                                                         guint               *length,
+                                                                         GError             **error);
+
+_GEONAMES_EXPORT
+gint *                  geonames_query_bbox_sync                        (gdouble              south,
+                                                                         gdouble              west,
+                                                                         gdouble              north,
+                                                                         gdouble              east,
+                                                                         guint                min_population,
+                                                                         guint                max_results,
+                                                                         guint               *length,
+                                                                         GCancellable        *cancellable,
+                                                                         GError             **error);
+
+_GEONAMES_EXPORT
+void                    geonames_query_radius                           (gdouble              latitude,
+                                                                         gdouble              longitude,
+                                                                         gdouble              radius,
+                                                                         guint                min_population,
+                                                                         guint                max_results,
+                                                                         GCancellable        *cancellable,
+                                                                         GAsyncReadyCallback  callback,
+                                                                         gpointer             user_data);
+
+_GEONAMES_EXPORT
+gint *                  geonames_query_radius_finish                    (GAsyncResult        *result,
+                                                                         guint               *length,
+                                                                         GError             **error);
+
+_GEONAMES_EXPORT
+gint *                  geonames_query_radius_sync                      (gdouble              latitude,
+                                                                         gdouble              longitude,
+                                                                         gdouble              radius,
+                                                                         guint                min_population,
+                                                                         guint                max_results,
+                                                                         guint               *length,
+                                                                         GCancellable        *cancellable,
+                                                                         GError             **error);
+
+_GEONAMES_EXPORT
+void                    geonames_set_max_query_threads                  (guint                n_threads);
+
+_GEONAMES_EXPORT
+void                    geonames_set_min_query_shard_size               (guint                n_candidates);
+
+_GEONAMES_EXPORT
+void                    geonames_set_query_cache_size                   (guint                n_entries);
+
+_GEONAMES_EXPORT
+guint                   geonames_get_query_cache_size                   (void);
+
+_GEONAMES_EXPORT
+void                    geonames_get_query_cache_stats                  (guint64             *hits,
+                                                                         guint64             *misses);
+
+_GEONAMES_EXPORT
+void                    geonames_get_stats                              (GeonamesStats       *stats);
+
 _GEONAMES_EXPORT
 gint                    geonames_get_n_cities                           (void);
 
@@ -92,6 +298,35 @@ gdouble                 geonames_city_get_longitude                     (Geoname
 _GEONAMES_EXPORT
 guint                   geonames_city_get_population                    (GeonamesCity *city);
 
+_GEONAMES_EXPORT
+const gchar *           geonames_get_city_name                          (gint index);
+
+_GEONAMES_EXPORT
+const gchar *           geonames_get_city_state                         (gint index);
+
+_GEONAMES_EXPORT
+const gchar *           geonames_get_city_country                       (gint index);
+
+_GEONAMES_EXPORT
+const gchar *           geonames_get_city_country_code                  (gint index);
+
+_GEONAMES_EXPORT
+const gchar *           geonames_get_city_timezone                      (gint index);
+
+_GEONAMES_EXPORT
+gdouble                 geonames_get_city_latitude                      (gint index);
+
+_GEONAMES_EXPORT
+gdouble                 geonames_get_city_longitude                     (gint index);
+
+_GEONAMES_EXPORT
+guint                   geonames_get_city_population                    (gint index);
+
+_GEONAMES_EXPORT
+void                    geonames_get_cities_info                        (const gint          *indices,
+                                                                         guint                n_indices,
+                                                                         GeonamesCityInfo    *infos);
+
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (GeonamesCity, geonames_city_free)
 
 G_END_DECLS
@@ -0,0 +1,241 @@
+/*
+ * Copyright 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures how long loading the database, running queries and reading
+ * cities takes, and prints the results as one JSON object per line, so
+ * that runs before and after a change can be compared with a script.
+ */
+
+#include <gio/gio.h>
+#include <locale.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <geonames.h>
+
+static const gchar *prefixes[] = {
+  "b", "s", "m", "l", "n", "t",
+  "be", "sa", "lo", "pa", "ne", "to",
+  "ber", "san", "lon", "par", "new", "tok",
+  "berl", "sank", "lond", "pari", "new ", "toky",
+  NULL
+};
+
+static const gchar *multi_word_queries[] = {
+  "new york", "san francisco", "san f", "the hague", "sankt p",
+  "buenos aires", "los angeles", "rio de janeiro", "hong kong", "l'hospitalet de",
+  NULL
+};
+
+static const gchar *languages[] = { "C", "de", "fr", "zh", NULL };
+
+static gint iterations = 20;
+static gint max_results = 10;
+
+static gint
+compare_int64 (gconstpointer a,
+               gconstpointer b)
+{
+  gint64 ia = *(const gint64 *) a;
+  gint64 ib = *(const gint64 *) b;
+
+  return (ia > ib) - (ia < ib);
+}
+
+static gint64
+percentile (GArray *sorted,
+            guint   p)
+{
+  guint i;
+
+  if (sorted->len == 0)
+    return 0;
+
+  i = MIN ((guint64) sorted->len * p / 100, sorted->len - 1);
+
+  return g_array_index (sorted, gint64, i);
+}
+
+static void
+print_latencies (const gchar *benchmark,
+                 const gchar *language,
+                 GArray      *latencies)
+{
+  g_array_sort (latencies, compare_int64);
+
+  g_print ("{\"benchmark\": \"%s\", \"language\": \"%s\", \"samples\": %u, "
+           "\"p50_us\": %" G_GINT64_FORMAT ", \"p90_us\": %" G_GINT64_FORMAT ", "
+           "\"p99_us\": %" G_GINT64_FORMAT ", \"max_us\": %" G_GINT64_FORMAT "}\n",
+           benchmark, language, latencies->len,
+           percentile (latencies, 50), percentile (latencies, 90),
+           percentile (latencies, 99), percentile (latencies, 100));
+}
+
+static void
+bench_startup (void)
+{
+  gint64 start;
+  gint n_cities;
+
+  start = g_get_monotonic_time ();
+  n_cities = geonames_get_n_cities ();
+
+  g_print ("{\"benchmark\": \"startup\", \"cities\": %d, \"time_us\": %" G_GINT64_FORMAT "}\n",
+           n_cities, g_get_monotonic_time () - start);
+}
+
+static void
+bench_queries (const gchar  *benchmark,
+               const gchar **queries,
+               const gchar  *language)
+{
+  g_autoptr(GArray) latencies = NULL;
+  gint i, j;
+
+  latencies = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+  for (i = 0; i < iterations; i++)
+    for (j = 0; queries[j]; j++)
+      {
+        gint64 start;
+        gint64 elapsed;
+        gint *indices;
+
+        start = g_get_monotonic_time ();
+        indices = geonames_query_cities_full_sync (queries[j], GEONAMES_QUERY_DEFAULT, max_results,
+                                                   NULL, NULL, NULL);
+        elapsed = g_get_monotonic_time () - start;
+
+        g_array_append_val (latencies, elapsed);
+        g_free (indices);
+      }
+
+  print_latencies (benchmark, language, latencies);
+}
+
+static void
+bench_cities (void)
+{
+  gint n_cities = geonames_get_n_cities ();
+  gint64 start;
+  gint64 get_city = 0;
+  gint64 getters = 0;
+  gint i;
+
+  for (i = 0; i < n_cities; i++)
+    {
+      GeonamesCity *city;
+
+      start = g_get_monotonic_time ();
+      city = geonames_get_city (i);
+      get_city += g_get_monotonic_time () - start;
+
+      start = g_get_monotonic_time ();
+      geonames_city_get_name (city);
+      geonames_city_get_state (city);
+      geonames_city_get_country (city);
+      geonames_city_get_country_code (city);
+      geonames_city_get_timezone (city);
+      geonames_city_get_latitude (city);
+      geonames_city_get_longitude (city);
+      geonames_city_get_population (city);
+      getters += g_get_monotonic_time () - start;
+
+      geonames_city_free (city);
+    }
+
+  g_print ("{\"benchmark\": \"cities\", \"cities\": %d, \"get_city_ns\": %.1f, \"getters_ns\": %.1f}\n",
+           n_cities, 1000.0 * get_city / MAX (n_cities, 1), 1000.0 * getters / MAX (n_cities, 1));
+}
+
+static void
+bench_cities_info (void)
+{
+  g_autofree gint *indices = NULL;
+  g_autofree GeonamesCityInfo *infos = NULL;
+  gint n_cities = geonames_get_n_cities ();
+  gint chunk = MAX (max_results, 1);
+  gint64 start;
+  gint i;
+
+  indices = g_new (gint, n_cities);
+  for (i = 0; i < n_cities; i++)
+    indices[i] = i;
+
+  /* in chunks the size of a page of results */
+  infos = g_new (GeonamesCityInfo, chunk);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < n_cities; i += chunk)
+    geonames_get_cities_info (indices + i, MIN (chunk, n_cities - i), infos);
+
+  g_print ("{\"benchmark\": \"cities-info\", \"cities\": %d, \"info_ns\": %.1f}\n",
+           n_cities, 1000.0 * (g_get_monotonic_time () - start) / MAX (n_cities, 1));
+}
+
+static void
+print_peak_rss (void)
+{
+  struct rusage usage;
+
+  if (getrusage (RUSAGE_SELF, &usage) == 0)
+    g_print ("{\"benchmark\": \"memory\", \"peak_rss_kb\": %ld}\n", usage.ru_maxrss);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  gint i;
+
+  const GOptionEntry entries[] = {
+    { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Run every query N times (default: 20)", "N" },
+    { "max-results", 'm', 0, G_OPTION_ARG_INT, &max_results, "Ask for N results per query (default: 10)", "N" },
+    { NULL }
+  };
+
+  setlocale (LC_ALL, "");
+
+  context = g_option_context_new ("- benchmark libgeonames");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  /* this has to run first to measure loading the database */
+  bench_startup ();
+
+  /* measure the queries themselves, not the cache */
+  geonames_set_query_cache_size (0);
+
+  for (i = 0; languages[i]; i++)
+    {
+      g_setenv ("LANGUAGE", languages[i], TRUE);
+      setlocale (LC_ALL, "");
+
+      bench_queries ("prefix-query", prefixes, languages[i]);
+      bench_queries ("multi-word-query", multi_word_queries, languages[i]);
+    }
+
+  bench_cities ();
+  bench_cities_info ();
+  print_peak_rss ();
+
+  return 0;
+}
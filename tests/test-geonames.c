@@ -18,8 +18,11 @@
  */
 
 #include <gio/gio.h>
-#include <libintl.h>
+#include <glib/gstdio.h>
 #include <locale.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 #include <geonames.h>
 
 static void
@@ -171,10 +174,677 @@ test_edge_cases (void)
   g_free (indices);
 }
 
+static void
+test_max_results (void)
+{
+  g_autofree gint *all = NULL;
+  g_autofree gint *best = NULL;
+  guint all_len, best_len, i;
+
+  all = geonames_query_cities_sync ("b", GEONAMES_QUERY_DEFAULT, &all_len, NULL, NULL);
+  g_assert_cmpint (all_len, >, 3);
+
+  best = geonames_query_cities_full_sync ("b", GEONAMES_QUERY_DEFAULT, 3, &best_len, NULL, NULL);
+  g_assert_cmpint (best_len, ==, 3);
+  g_assert_cmpint (best[best_len], ==, -1);
+
+  for (i = 0; i < best_len; i++)
+    g_assert_cmpint (best[i], ==, all[i]);
+
+  g_clear_pointer (&best, g_free);
+  best = geonames_query_cities_full_sync ("b", GEONAMES_QUERY_DEFAULT, all_len + 10, &best_len, NULL, NULL);
+  g_assert_cmpint (best_len, ==, all_len);
+  for (i = 0; i < best_len; i++)
+    g_assert_cmpint (best[i], ==, all[i]);
+}
+
+typedef struct
+{
+  gboolean done;
+  gint *indices;
+  GError *error;
+} QueryResult;
+
+static void
+query_result_cb (GObject      *source,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+  QueryResult *query_result = user_data;
+
+  query_result->indices = geonames_query_cities_finish (result, NULL, &query_result->error);
+  query_result->done = TRUE;
+}
+
+static void
+test_cancellation (void)
+{
+  g_autoptr(GCancellable) cancellable = NULL;
+  g_autoptr(GError) error = NULL;
+  GeonamesQuerySession *session;
+  QueryResult superseded = { 0 };
+  QueryResult latest = { 0 };
+  gint *indices;
+  guint len;
+
+  cancellable = g_cancellable_new ();
+  g_cancellable_cancel (cancellable);
+
+  indices = geonames_query_cities_sync ("berlin", GEONAMES_QUERY_DEFAULT, &len, cancellable, &error);
+  g_assert_null (indices);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+
+  /* the first query is superseded by the second one, but the order in
+   * which their callbacks are called is undefined */
+  session = geonames_query_session_new ();
+  geonames_query_session_query_cities (session, "b", GEONAMES_QUERY_DEFAULT, 0, query_result_cb, &superseded);
+  geonames_query_session_query_cities (session, "berlin", GEONAMES_QUERY_DEFAULT, 0, query_result_cb, &latest);
+
+  while (!superseded.done || !latest.done)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_null (superseded.indices);
+  g_assert_error (superseded.error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_error_free (superseded.error);
+
+  g_assert_no_error (latest.error);
+  g_assert_cmpint (latest.indices[0], >=, 0);
+  g_free (latest.indices);
+
+  geonames_query_session_free (session);
+}
+
+static void
+test_session_refinement (void)
+{
+  const gchar *queries[] = { "s", "sa", "san", "san f", "san fr", "ber", "b", "bernau", "new y", "new york", "new york x" };
+  /* with a limit, queries stop before the least populous cities, so
+   * the next one can't reuse all of the previous matches */
+  const guint max_results[] = { 0, 2 };
+  guint cache_size = geonames_get_query_cache_size ();
+  guint i, j, k;
+
+  /* otherwise the expected results would come from the session's queries */
+  geonames_set_query_cache_size (0);
+
+  for (k = 0; k < G_N_ELEMENTS (max_results); k++)
+    {
+      GeonamesQuerySession *session;
+
+      session = geonames_query_session_new ();
+
+      for (i = 0; i < G_N_ELEMENTS (queries); i++)
+        {
+          QueryResult result = { 0 };
+          g_autofree gint *expected = NULL;
+          guint len;
+
+          geonames_query_session_query_cities (session, queries[i], GEONAMES_QUERY_DEFAULT, max_results[k],
+                                               query_result_cb, &result);
+          while (!result.done)
+            g_main_context_iteration (NULL, TRUE);
+
+          g_assert_no_error (result.error);
+          expected = geonames_query_cities_full_sync (queries[i], GEONAMES_QUERY_DEFAULT, max_results[k],
+                                                      &len, NULL, NULL);
+
+          for (j = 0; j <= len; j++)
+            g_assert_cmpint (result.indices[j], ==, expected[j]);
+
+          g_free (result.indices);
+        }
+
+      geonames_query_session_free (session);
+    }
+
+  geonames_set_query_cache_size (cache_size);
+}
+
+static gdouble
+great_circle_distance (gdouble lat1,
+                       gdouble lon1,
+                       gdouble lat2,
+                       gdouble lon2)
+{
+  gdouble dlat = (lat2 - lat1) * G_PI / 180;
+  gdouble dlon = (lon2 - lon1) * G_PI / 180;
+  gdouble a;
+
+  a = sin (dlat / 2) * sin (dlat / 2) +
+      cos (lat1 * G_PI / 180) * cos (lat2 * G_PI / 180) * sin (dlon / 2) * sin (dlon / 2);
+
+  return 2 * atan2 (sqrt (a), sqrt (1 - a));
+}
+
+static gint
+compare_doubles (gconstpointer a,
+                 gconstpointer b)
+{
+  gdouble da = *(const gdouble *) a;
+  gdouble db = *(const gdouble *) b;
+
+  return (da > db) - (da < db);
+}
+
+static void
+test_nearest (void)
+{
+  const gdouble points[][2] = { { 52.5, 13.4 }, { 40.7, -74.0 }, { -33.9, 151.2 }, { 0, 180 }, { 90, 0 } };
+  guint n_cities = geonames_get_n_cities ();
+  g_autofree gint *indices = NULL;
+  g_autoptr(GeonamesCity) city = NULL;
+  guint i, j, len;
+
+  /* the distances of the returned cities must be the smallest ones */
+  for (i = 0; i < G_N_ELEMENTS (points); i++)
+    {
+      g_autofree gdouble *distances = g_new (gdouble, n_cities);
+
+      for (j = 0; j < n_cities; j++)
+        {
+          g_autoptr(GeonamesCity) c = geonames_get_city (j);
+
+          distances[j] = great_circle_distance (points[i][0], points[i][1],
+                                                geonames_city_get_latitude (c),
+                                                geonames_city_get_longitude (c));
+        }
+      qsort (distances, n_cities, sizeof (gdouble), compare_doubles);
+
+      g_clear_pointer (&indices, g_free);
+      indices = geonames_query_nearest_sync (points[i][0], points[i][1], 5, &len, NULL, NULL);
+      g_assert_cmpint (len, ==, MIN (5, n_cities));
+      g_assert_cmpint (indices[len], ==, -1);
+
+      for (j = 0; j < len; j++)
+        {
+          g_autoptr(GeonamesCity) c = geonames_get_city (indices[j]);
+          gdouble distance;
+
+          distance = great_circle_distance (points[i][0], points[i][1],
+                                            geonames_city_get_latitude (c),
+                                            geonames_city_get_longitude (c));
+          g_assert_cmpfloat (fabs (distance - distances[j]), <, 1e-9);
+        }
+    }
+
+  g_clear_pointer (&indices, g_free);
+  indices = geonames_query_nearest_sync (52.52, 13.40, 1, &len, NULL, NULL);
+  g_assert_cmpint (len, ==, 1);
+  city = geonames_get_city (indices[0]);
+  g_assert_cmpstr (geonames_city_get_name (city), ==, "Berlin");
+}
+
+/*
+ * Asserts that indices are exactly the cities for which in_area
+ * returns TRUE and that have at least min_population, largest first.
+ */
+static void
+assert_area_results (const gint *indices,
+                     guint       len,
+                     gboolean  (*in_area) (GeonamesCity *city, const gdouble *area),
+                     const gdouble *area,
+                     guint       min_population)
+{
+  guint n_cities = geonames_get_n_cities ();
+  guint expected = 0;
+  guint i;
+
+  for (i = 0; i < n_cities; i++)
+    {
+      g_autoptr(GeonamesCity) city = geonames_get_city (i);
+
+      if (geonames_city_get_population (city) >= min_population && in_area (city, area))
+        expected++;
+    }
+
+  g_assert_cmpint (len, ==, expected);
+  g_assert_cmpint (indices[len], ==, -1);
+
+  for (i = 0; i < len; i++)
+    {
+      g_autoptr(GeonamesCity) city = geonames_get_city (indices[i]);
+
+      g_assert_true (in_area (city, area));
+      g_assert_cmpint (geonames_city_get_population (city), >=, min_population);
+
+      if (i > 0)
+        {
+          g_autoptr(GeonamesCity) previous = geonames_get_city (indices[i - 1]);
+
+          g_assert_cmpint (geonames_city_get_population (previous), >=, geonames_city_get_population (city));
+        }
+    }
+}
+
+static gboolean
+in_bbox (GeonamesCity  *city,
+         const gdouble *bbox)
+{
+  gdouble latitude = geonames_city_get_latitude (city);
+  gdouble longitude = geonames_city_get_longitude (city);
+
+  if (latitude < bbox[0] || latitude > bbox[2])
+    return FALSE;
+
+  if (bbox[1] <= bbox[3])
+    return longitude >= bbox[1] && longitude <= bbox[3];
+  else
+    return longitude >= bbox[1] || longitude <= bbox[3];
+}
+
+static gboolean
+in_circle (GeonamesCity  *city,
+           const gdouble *circle)
+{
+  return great_circle_distance (circle[0], circle[1],
+                                geonames_city_get_latitude (city),
+                                geonames_city_get_longitude (city)) * 6371.0 <= circle[2];
+}
+
+static void
+test_area (void)
+{
+  /* south, west, north, east */
+  const gdouble boxes[][4] = { { 47, 5, 55, 15 }, { -90, -180, 90, 180 }, { -50, 170, 70, -170 }, { 10, 10, 5, 20 } };
+  /* latitude, longitude, radius */
+  const gdouble circles[][3] = { { 52.5, 13.4, 500 }, { 0, 180, 3000 }, { 85, 0, 1000 }, { 40.7, -74.0, 0 } };
+  const guint min_populations[] = { 0, 100000, 1000000 };
+  guint i, j, len, n_all;
+
+  for (i = 0; i < G_N_ELEMENTS (boxes); i++)
+    for (j = 0; j < G_N_ELEMENTS (min_populations); j++)
+      {
+        g_autofree gint *indices = NULL;
+        g_autofree gint *largest = NULL;
+
+        indices = geonames_query_bbox_sync (boxes[i][0], boxes[i][1], boxes[i][2], boxes[i][3],
+                                            min_populations[j], 0, &len, NULL, NULL);
+        assert_area_results (indices, len, in_bbox, boxes[i], min_populations[j]);
+
+        /* limiting the number of results returns the largest cities */
+        largest = geonames_query_bbox_sync (boxes[i][0], boxes[i][1], boxes[i][2], boxes[i][3],
+                                            min_populations[j], 3, &n_all, NULL, NULL);
+        g_assert_cmpint (n_all, ==, MIN (3, len));
+        g_assert_true (memcmp (indices, largest, n_all * sizeof (gint)) == 0);
+      }
+
+  for (i = 0; i < G_N_ELEMENTS (circles); i++)
+    for (j = 0; j < G_N_ELEMENTS (min_populations); j++)
+      {
+        g_autofree gint *indices = NULL;
+
+        indices = geonames_query_radius_sync (circles[i][0], circles[i][1], circles[i][2],
+                                              min_populations[j], 0, &len, NULL, NULL);
+        assert_area_results (indices, len, in_circle, circles[i], min_populations[j]);
+      }
+}
+
+static void
+test_parallel_scoring (void)
+{
+  const gchar *queries[] = { "b", "san", "berlin", "a", "new york", "" };
+  const guint max_results[] = { 0, 1, 5 };
+  guint cache_size = geonames_get_query_cache_size ();
+  guint i, j;
+
+  /* make sure that every query is actually run */
+  geonames_set_query_cache_size (0);
+
+  for (i = 0; i < G_N_ELEMENTS (queries); i++)
+    for (j = 0; j < G_N_ELEMENTS (max_results); j++)
+      {
+        g_autofree gint *serial = NULL;
+        g_autofree gint *parallel = NULL;
+        guint serial_len, parallel_len;
+
+        geonames_set_max_query_threads (1);
+        serial = geonames_query_cities_full_sync (queries[i], GEONAMES_QUERY_DEFAULT, max_results[j],
+                                                  &serial_len, NULL, NULL);
+
+        /* split even the smallest queries into as many shards as possible */
+        geonames_set_max_query_threads (4);
+        geonames_set_min_query_shard_size (1);
+        parallel = geonames_query_cities_full_sync (queries[i], GEONAMES_QUERY_DEFAULT, max_results[j],
+                                                    &parallel_len, NULL, NULL);
+
+        g_assert_cmpint (serial_len, ==, parallel_len);
+        g_assert_true (memcmp (serial, parallel, serial_len * sizeof (gint)) == 0);
+      }
+
+  geonames_set_max_query_threads (0);
+  geonames_set_min_query_shard_size (4096);
+  geonames_set_query_cache_size (cache_size);
+}
+
+static void
+test_batch (void)
+{
+  const gchar *queries[] = { "berlin", "san", "", "BERLIN ", "b", "bo", "san", "xyzzy", NULL };
+  const guint max_results[] = { 0, 2 };
+  guint i, j;
+
+  for (j = 0; j < G_N_ELEMENTS (max_results); j++)
+    {
+      gint **results;
+
+      results = geonames_query_cities_batch (queries, GEONAMES_QUERY_DEFAULT, max_results[j], NULL, NULL);
+      g_assert_nonnull (results);
+
+      for (i = 0; queries[i]; i++)
+        {
+          g_autofree gint *expected = NULL;
+          guint len;
+
+          expected = geonames_query_cities_full_sync (queries[i], GEONAMES_QUERY_DEFAULT, max_results[j],
+                                                      &len, NULL, NULL);
+
+          g_assert_nonnull (results[i]);
+          g_assert_true (memcmp (results[i], expected, (len + 1) * sizeof (gint)) == 0);
+          g_free (results[i]);
+        }
+      g_assert_null (results[i]);
+
+      g_free (results);
+    }
+}
+
+static void
+test_query_cache (void)
+{
+  g_autofree gint *first = NULL;
+  g_autofree gint *second = NULL;
+  g_autofree gint *other = NULL;
+  guint64 hits, misses;
+  guint64 hits_before, misses_before;
+  guint cache_size = geonames_get_query_cache_size ();
+  guint first_len, second_len, len;
+
+  geonames_set_query_cache_size (2);
+  geonames_get_query_cache_stats (&hits_before, &misses_before);
+
+  first = geonames_query_cities_full_sync ("San F", GEONAMES_QUERY_DEFAULT, 3, &first_len, NULL, NULL);
+  geonames_get_query_cache_stats (&hits, &misses);
+  g_assert_cmpint (hits, ==, hits_before);
+  g_assert_cmpint (misses, ==, misses_before + 1);
+
+  /* same tokens after folding */
+  second = geonames_query_cities_full_sync (" san f ", GEONAMES_QUERY_DEFAULT, 3, &second_len, NULL, NULL);
+  geonames_get_query_cache_stats (&hits, &misses);
+  g_assert_cmpint (hits, ==, hits_before + 1);
+  g_assert_cmpint (misses, ==, misses_before + 1);
+
+  g_assert_cmpint (first_len, ==, second_len);
+  g_assert_true (memcmp (first, second, (first_len + 1) * sizeof (gint)) == 0);
+
+  /* a different number of results is a different query, and evicts
+   * the least recently used one when the cache is full */
+  other = geonames_query_cities_full_sync ("san f", GEONAMES_QUERY_DEFAULT, 1, &len, NULL, NULL);
+  g_clear_pointer (&other, g_free);
+  other = geonames_query_cities_full_sync ("berlin", GEONAMES_QUERY_DEFAULT, 1, &len, NULL, NULL);
+  g_clear_pointer (&other, g_free);
+  other = geonames_query_cities_full_sync ("san f", GEONAMES_QUERY_DEFAULT, 3, &len, NULL, NULL);
+
+  geonames_get_query_cache_stats (&hits, &misses);
+  g_assert_cmpint (hits, ==, hits_before + 1);
+  g_assert_cmpint (misses, ==, misses_before + 4);
+
+  geonames_set_query_cache_size (cache_size);
+}
+
+static void
+test_stats (void)
+{
+  GeonamesStats before, after;
+  g_autofree gint *indices = NULL;
+  guint cache_size = geonames_get_query_cache_size ();
+  guint len;
+
+  geonames_set_query_cache_size (0);
+  geonames_get_stats (&before);
+
+  indices = geonames_query_cities_full_sync ("berlin", GEONAMES_QUERY_DEFAULT, 5, &len, NULL, NULL);
+  g_assert_cmpint (len, >, 0);
+
+  geonames_get_stats (&after);
+  g_assert_cmpint (after.n_queries, ==, before.n_queries + 1);
+  g_assert_cmpint (after.n_rows_scanned, >, before.n_rows_scanned);
+  g_assert_cmpint (after.n_candidates_scored, >, before.n_candidates_scored);
+  g_assert_cmpint (after.n_matches, >=, before.n_matches + len);
+  g_assert_cmpint (after.n_results, ==, before.n_results + len);
+  g_assert_cmpint (after.query_time_us, >=, before.query_time_us);
+  g_assert_cmpint (after.max_query_time_us, <=, after.query_time_us);
+  g_assert_cmpint (after.load_time_us, >, 0);
+
+  geonames_set_query_cache_size (cache_size);
+}
+
+static void
+test_city_info (void)
+{
+  g_autofree gint *indices = NULL;
+  g_autofree GeonamesCityInfo *infos = NULL;
+  guint i, len;
+
+  change_lang ("de");
+
+  indices = geonames_query_cities_sync ("san", GEONAMES_QUERY_DEFAULT, &len, NULL, NULL);
+  g_assert_cmpint (len, >, 0);
+
+  infos = g_new (GeonamesCityInfo, len);
+  geonames_get_cities_info (indices, len, infos);
+
+  for (i = 0; i < len; i++)
+    {
+      g_autoptr(GeonamesCity) city = geonames_get_city (indices[i]);
+
+      g_assert_cmpstr (infos[i].name, ==, geonames_city_get_name (city));
+      g_assert_cmpstr (infos[i].state, ==, geonames_city_get_state (city));
+      g_assert_cmpstr (infos[i].country, ==, geonames_city_get_country (city));
+      g_assert_cmpstr (infos[i].country_code, ==, geonames_city_get_country_code (city));
+      g_assert_cmpstr (infos[i].timezone, ==, geonames_city_get_timezone (city));
+      g_assert_cmpfloat (infos[i].latitude, ==, geonames_city_get_latitude (city));
+      g_assert_cmpfloat (infos[i].longitude, ==, geonames_city_get_longitude (city));
+      g_assert_cmpint (infos[i].population, ==, geonames_city_get_population (city));
+
+      g_assert_true (infos[i].name == geonames_get_city_name (indices[i]));
+      g_assert_true (infos[i].state == geonames_get_city_state (indices[i]));
+      g_assert_true (infos[i].country == geonames_get_city_country (indices[i]));
+      g_assert_true (infos[i].country_code == geonames_get_city_country_code (indices[i]));
+      g_assert_true (infos[i].timezone == geonames_get_city_timezone (indices[i]));
+      g_assert_cmpfloat (infos[i].latitude, ==, geonames_get_city_latitude (indices[i]));
+      g_assert_cmpfloat (infos[i].longitude, ==, geonames_get_city_longitude (indices[i]));
+      g_assert_cmpint (infos[i].population, ==, geonames_get_city_population (indices[i]));
+    }
+
+  change_lang ("C");
+}
+
+static void
+test_fuzzy (void)
+{
+  g_autofree gint *exact = NULL;
+  g_autofree gint *fuzzy = NULL;
+  g_autoptr(GeonamesCity) city = NULL;
+  guint len;
+
+  exact = geonames_query_cities_sync ("berln", GEONAMES_QUERY_DEFAULT, &len, NULL, NULL);
+  g_assert_cmpint (len, ==, 0);
+
+  fuzzy = geonames_query_cities_sync ("berln", GEONAMES_QUERY_FUZZY, &len, NULL, NULL);
+  g_assert_cmpint (len, >, 0);
+  city = geonames_get_city (fuzzy[0]);
+  g_assert_cmpstr (geonames_city_get_name (city), ==, "Berlin");
+  g_assert_cmpstr (geonames_city_get_country_code (city), ==, "DE");
+
+  /* exact matches still come first */
+  g_clear_pointer (&exact, g_free);
+  g_clear_pointer (&fuzzy, g_free);
+  exact = geonames_query_cities_sync ("berlin", GEONAMES_QUERY_DEFAULT, &len, NULL, NULL);
+  fuzzy = geonames_query_cities_sync ("berlin", GEONAMES_QUERY_FUZZY, &len, NULL, NULL);
+  g_assert_cmpint (fuzzy[0], ==, exact[0]);
+}
+
+/* Writes contents to the file name in dir and returns its path */
+static gchar *
+write_changes (const gchar *dir,
+               const gchar *name,
+               const gchar *contents)
+{
+  gchar *path;
+
+  path = g_build_filename (dir, name, NULL);
+  g_assert_true (g_file_set_contents (path, contents, -1, NULL));
+
+  return path;
+}
+
+/* Runs geonames-mkdb --update database files in dir */
+static void
+run_update (const gchar  *dir,
+            const gchar  *database,
+            gchar       **files)
+{
+  g_autoptr(GPtrArray) args = NULL;
+  gint status;
+
+  args = g_ptr_array_new ();
+  g_ptr_array_add (args, GEONAMES_MKDB);
+  g_ptr_array_add (args, "--update");
+  g_ptr_array_add (args, (gpointer) database);
+  for (; *files; files++)
+    g_ptr_array_add (args, *files);
+  g_ptr_array_add (args, NULL);
+
+  g_assert_true (g_spawn_sync (dir, (gchar **) args->pdata, NULL, 0, NULL, NULL, NULL, NULL, &status, NULL));
+  g_assert_cmpint (status, ==, 0);
+}
+
+static void
+assert_first_city (const gchar *query,
+                   const gchar *expected_city)
+{
+  g_autofree gint *indices = NULL;
+  g_autoptr(GeonamesCity) city = NULL;
+  guint len;
+
+  indices = geonames_query_cities_sync (query, GEONAMES_QUERY_DEFAULT, &len, NULL, NULL);
+  g_assert_cmpint (len, >, 0);
+
+  city = geonames_get_city (indices[0]);
+  g_assert_cmpstr (geonames_city_get_name (city), ==, expected_city);
+}
+
+static void
+test_update (void)
+{
+  g_autofree gchar *dir = NULL;
+  g_autofree gchar *database = NULL;
+  gchar *first[3];
+  gchar *second[3];
+  guint len;
+  guint i;
+
+  /* The database is loaded once per process, so the updated one is
+   * built and checked in a subprocess. GEONAMES_DATABASE is only set
+   * there, so that it doesn't leak into later tests. */
+  if (!g_test_subprocess ())
+    {
+      g_test_trap_subprocess (NULL, 0, 0);
+      g_test_trap_assert_passed ();
+      return;
+    }
+
+  dir = g_dir_make_tmp ("geonames-XXXXXX", NULL);
+  g_assert_nonnull (dir);
+  database = g_build_filename (dir, "cities.compiled", NULL);
+
+  first[0] = write_changes (dir, "modifications-2016-03-21.txt",
+                            "99999995\tTinyville\tTinyville\t\t52.5\t13.4\tP\tPPL\tDE\t\t16\t\t\t\t500\t\t\tEurope/Berlin\t2016-03-21\n"
+                            "99999996\tTinycapital\tTinycapital\t\t52.5\t13.4\tP\tPPLC\tDE\t\t16\t\t\t\t500\t\t\tEurope/Berlin\t2016-03-21\n"
+                            "99999997\tTestville\tTestville\t\t52.5\t13.4\tP\tPPL\tDE\t\t16\t\t\t\t20000000\t\t\tEurope/Berlin\t2016-03-21\n"
+                            "99999998\tOthertown\tOthertown\t\t52.5\t13.4\tP\tPPL\tDE\t\t16\t\t\t\t20000000\t\t\tEurope/Berlin\t2016-03-21\n"
+                            "99999999\tThirdville\tThirdville\t\t52.5\t13.4\tP\tPPL\tDE\t\t16\t\t\t\t20000000\t\t\tEurope/Berlin\t2016-03-21\n");
+  first[1] = write_changes (dir, "alternateNamesModifications-2016-03-21.txt",
+                            "999999997\t99999997\ten\tTestville Alternate\t1\t\t\t\n"
+                            "999999999\t99999999\ten\tThirdville Alternate\t1\t\t\t\n");
+  first[2] = NULL;
+  run_update (dir, GEONAMES_DATABASE_FILE, first);
+
+  second[0] = write_changes (dir, "modifications-2016-03-22.txt",
+                             "99999997\tRenamed Testville\tRenamed Testville\t\t52.5\t13.4\tP\tPPL\tDE\t\t16\t\t\t\t20000000\t\t\tEurope/Berlin\t2016-03-22\n"
+                             "99999998\tRenamed Othertown\tRenamed Othertown\t\t52.5\t13.4\tP\tPPL\tDE\t\t16\t\t\t\t20000000\t\t\tEurope/Berlin\t2016-03-22\n"
+                             "99999999\tRenamed Thirdville\tRenamed Thirdville\t\t52.5\t13.4\tP\tPPL\tDE\t\t16\t\t\t\t20000000\t\t\tEurope/Berlin\t2016-03-22\n");
+  second[1] = write_changes (dir, "alternateNamesDeletes-2016-03-22.txt",
+                             "999999997\t99999997\tTestville Alternate\t\n");
+  second[2] = NULL;
+  run_update (dir, database, second);
+
+  g_setenv ("GEONAMES_DATABASE", database, TRUE);
+  change_lang ("C");
+
+  /* a new name in the cities file replaces the old one */
+  assert_first_city ("othertown", "Renamed Othertown");
+  /* unless an English alternate name takes precedence */
+  assert_first_city ("thirdville", "Thirdville Alternate");
+  /* which falls back to the current name when it is deleted */
+  assert_first_city ("testville", "Renamed Testville");
+
+  /* places below the population of the cities file are left out, except
+   * for capitals, which stay capitals when the database is updated again */
+  g_free (geonames_query_cities_sync ("tinyville", GEONAMES_QUERY_DEFAULT, &len, NULL, NULL));
+  g_assert_cmpuint (len, ==, 0);
+  assert_first_city ("tinycapital", "Tinycapital");
+
+  for (i = 0; i < 2; i++)
+    {
+      g_unlink (first[i]);
+      g_unlink (second[i]);
+      g_free (first[i]);
+      g_free (second[i]);
+    }
+  g_unlink (database);
+  g_rmdir (dir);
+}
+
+/*
+ * A database file that is missing or truncated is rejected with a
+ * warning, and the embedded database is used instead.
+ */
+static void
+test_invalid_database (void)
+{
+  if (g_test_subprocess ())
+    {
+      g_autofree gchar *contents = NULL;
+      g_autofree gchar *path = NULL;
+      gsize length;
+      gint fd;
+
+      g_assert_true (g_file_get_contents (GEONAMES_DATABASE_FILE, &contents, &length, NULL));
+
+      fd = g_file_open_tmp ("geonames-XXXXXX.compiled", &path, NULL);
+      g_assert_cmpint (fd, >=, 0);
+      g_close (fd, NULL);
+      g_assert_true (g_file_set_contents (path, contents, length / 2, NULL));
+
+      g_log_set_always_fatal (G_LOG_FATAL_MASK);
+      g_setenv ("GEONAMES_DATABASE", path, TRUE);
+
+      change_lang ("C");
+      assert_first_city ("berlin", "Berlin");
+
+      g_unlink (path);
+      return;
+    }
+
+  g_test_trap_subprocess (NULL, 0, 0);
+  g_test_trap_assert_passed ();
+  g_test_trap_assert_stderr ("*unable to load geonames database*");
+}
+
 int
 main (int argc, char **argv)
 {
-  bindtextdomain(PACKAGE, LOCALEDIR);
   setlocale (LC_ALL, "");
 
   g_test_init (&argc, &argv, NULL);
@@ -183,6 +853,19 @@ main (int argc, char **argv)
   g_test_add_func ("/translations", test_translations);
   g_test_add_func ("/edge-cases", test_edge_cases);
   g_test_add_func ("/cities-without-some-words", test_cities_without_some_words);
+  g_test_add_func ("/max-results", test_max_results);
+  g_test_add_func ("/cancellation", test_cancellation);
+  g_test_add_func ("/session-refinement", test_session_refinement);
+  g_test_add_func ("/nearest", test_nearest);
+  g_test_add_func ("/area", test_area);
+  g_test_add_func ("/parallel-scoring", test_parallel_scoring);
+  g_test_add_func ("/batch", test_batch);
+  g_test_add_func ("/query-cache", test_query_cache);
+  g_test_add_func ("/stats", test_stats);
+  g_test_add_func ("/city-info", test_city_info);
+  g_test_add_func ("/fuzzy", test_fuzzy);
+  g_test_add_func ("/update", test_update);
+  g_test_add_func ("/invalid-database", test_invalid_database);
 
   return g_test_run ();
 }